@@ -1,7 +1,19 @@
 /* LazySorted objects */
 
 #include <Python.h>
+#include <stddef.h>
 #include <time.h>
+#include <math.h>
+
+#if defined(WITH_THREAD) || PY_VERSION_HEX >= 0x03070000
+#include <pythread.h>
+#define HAVE_THREADS
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_PTHREADS
+#endif
+#endif
 
 /* Parameters for the sorting function */
 
@@ -14,11 +26,66 @@
  * CONTIG_THRESH should always be bigger than SORT_THRESH */
 #define CONTIG_THRESH 32
 
+/* WORK_LIMIT: If a quickselect has partitioned more than WORK_LIMIT times as
+ * many items as it started with, (which is very unlikely unless the data is
+ * adversarial), it switches to median of medians pivots, which guarantee
+ * linear time. Likewise quicksort switches to heapsort when it recurses deeper
+ * than twice the log of the number of items. */
+#define WORK_LIMIT 8
+
+/* FR_THRESH: sort_point selects from regions of python objects with at least
+ * FR_THRESH items by Floyd-Rivest sampling rather than by quickselect */
+#define FR_THRESH 2000
+
+/* SLAB_MIN, SLAB_MAX: Each LazySorted object allocates its pivots from slabs
+ * of nodes, the first holding SLAB_MIN nodes and each one after that twice as
+ * many as the last, up to SLAB_MAX */
+#define SLAB_MIN 16
+#define SLAB_MAX 4096
+
+/* BITS_THRESH: LazySorted objects with at least BITS_THRESH items index their
+ * pivots with a bitvector rather than a treap */
+#ifndef BITS_THRESH
+#define BITS_THRESH 4096
+#endif
+
+/* BLOCK_SIZE: The number of items at each end that partition compares against
+ * the pivot before swapping any of them. Must fit in an unsigned char. */
+#define BLOCK_SIZE 64
+
+/* NOGIL_THRESH: Kernels on regions of at least NOGIL_THRESH unboxed items run
+ * with the GIL released */
+#ifndef NOGIL_THRESH
+#define NOGIL_THRESH (1 << 15)
+#endif
+
+/* PARALLEL_THRESH: Regions of at least PARALLEL_THRESH unboxed items are split
+ * between threads, one for each PARALLEL_THRESH / 8 items, up to one per core
+ * or the number in the LAZYSORTED_THREADS environment variable, and at most
+ * MAX_THREADS */
+#ifndef PARALLEL_THRESH
+#define PARALLEL_THRESH (1 << 20)
+#endif
+#define MAX_THREADS 64
+
 /* Macro definitions to deal different python versions */
 #if PY_MAJOR_VERSION >= 3
 #define PyString_FromString PyUnicode_FromString
 #define PyString_Format PyUnicode_Format
 #define PyInt_FromSsize_t PyLong_FromSsize_t
+#define PyInt_AsSsize_t PyLong_AsSsize_t
+#define PyInt_FromLong PyLong_FromLong
+#define PyInt_AsUnsignedLongLongMask PyLong_AsUnsignedLongLongMask
+#endif
+
+/* The new buffer protocol, used for unboxed data, appeared in python2.6 */
+#if PY_VERSION_HEX >= 0x02060000
+#define HAVE_NEWBUFFER
+#endif
+
+/* Python 3 types all have it, and dropped the flag */
+#ifndef Py_TPFLAGS_HAVE_NEWBUFFER
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
 #endif
 
 #if PY_VERSION_HEX < 0x03020000
@@ -42,15 +109,51 @@
 #define Py_TYPE(ob)             (((PyObject*)(ob))->ob_type)
 #endif
 
+/* Py_SIZE isn't assignable from python3.11, and this is new in 3.9 */
+#ifndef Py_SET_SIZE
+#define Py_SET_SIZE(ob, size)   (Py_SIZE(ob) = (size))
+#endif
+
 /* Macros to support different compilers */
 #if !(defined(__GNUC__) || defined(__clang__))
 #define __builtin_prefetch(x)
 #endif
 
+/* LOW_BIT(x) and HIGH_BIT(x) are the positions of the lowest and highest bits
+ * set in x, for nonzero x */
+#if defined(__GNUC__) || defined(__clang__)
+#define LOW_BIT(x) __builtin_ctzll(x)
+#define HIGH_BIT(x) (63 - __builtin_clzll(x))
+#else
+static int
+low_bit(unsigned long long x)
+{
+    int bit = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        bit++;
+    }
+    return bit;
+}
+
+static int
+high_bit(unsigned long long x)
+{
+    int bit = 0;
+    while (x >>= 1)
+        bit++;
+    return bit;
+}
+#define LOW_BIT(x) low_bit(x)
+#define HIGH_BIT(x) high_bit(x)
+#endif
+
 /* Definitions and functions for the binary search tree of pivot points.
  * The BST implementation is a Treap, selected because of its general speed,
  * especially when inserting and removing elements, which happens a lot in this
- * application. */
+ * application. The pivots of the tree are also kept in a doubly linked list, in
+ * order. Big lists index their pivots with bitvectors instead, (see PivotBits
+ * below), and only make nodes for the pivots they're using. */
 
 typedef struct PivotNode {
     Py_ssize_t idx;             /* The index it represents */
@@ -59,8 +162,53 @@ typedef struct PivotNode {
     struct PivotNode *left;
     struct PivotNode *right;
     struct PivotNode *parent;
+    struct PivotNode *prev;     /* The previous pivot, or NULL */
+    struct PivotNode *next;     /* The next pivot, or NULL */
 } PivotNode;
 
+/* A slab of nodes, which are handed out in order */
+typedef struct NodeSlab {
+    struct NodeSlab *next;      /* The slab allocated before this one */
+    Py_ssize_t size;            /* The number of nodes in the slab */
+    PivotNode nodes[1];         /* Really size of them */
+} NodeSlab;
+
+/* The nodes of a pivot tree. Keeping them in a few slabs, rather than
+ * allocating each separately, keeps the tree close together in memory and
+ * means they can all be freed at once. Freed nodes are reused first, most
+ * recently freed first, and are linked together by their parent pointers. */
+typedef struct {
+    NodeSlab *slabs;            /* The newest slab, or NULL */
+    Py_ssize_t used;            /* The number of its nodes handed out */
+    PivotNode *free;            /* The freed nodes */
+} NodePool;
+
+/* The pivot index for big lists: a bitvector with a bit for each index from -1
+ * to n, set where there's a pivot, and two levels of summary bits above it,
+ * each saying whether a word of the level below has any bits set. Finding the
+ * pivots around an index takes a look at a few words, with no pointer chasing.
+ * The flags are in three more bitvectors, at the bits of their pivots, while
+ * a pivot is SORTED_RIGHT if the one before it is SORTED_LEFT. That's four
+ * bits per item, however many pivots there are, and nothing per pivot.
+ *
+ * The functions below still work on PivotNodes, so a node is made for each
+ * pivot they look up, and put in a hash table so that looking it up again
+ * finds the same node. It holds the pivot's flags, whose bits are clear
+ * meanwhile, and its index, which moves with the pivot. Nodes last until ls is
+ * unlocked, when their flags go back in the bitvectors and they're freed. */
+typedef struct {
+    unsigned long long *words;      /* Bit i + 1 says whether i is a pivot */
+    unsigned long long *sorted;     /* And whether it's SORTED_LEFT */
+    unsigned long long *run_start;  /* And whether it's RUN_START */
+    unsigned long long *run_end;    /* And whether it's RUN_END */
+    unsigned long long *summary;    /* Bit w says whether words[w] != 0 */
+    unsigned long long *top;        /* Bit s says whether summary[s] != 0 */
+    Py_ssize_t n_words;             /* The number of words of each */
+    PivotNode **table;              /* The nodes made, chained by left */
+    Py_ssize_t n_table;             /* Its size, a power of two, or 0 */
+    Py_ssize_t n_live;              /* The number of nodes in it */
+} PivotBits;
+
 /* SORTED_RIGHT means the pivot is to the right of a sorted region.
  * SORTED_LEFT means the pivot is the left of a sorted region */
 #define SORTED_RIGHT 1
@@ -68,44 +216,214 @@ typedef struct PivotNode {
 #define UNSORTED 0
 #define SORTED_BOTH 3
 
-/* The LazySorted object */
+/* RUN_START means no item before the pivot is equal to it, and RUN_END means
+ * no item after it is, so searches for the ends of a run of equal items can
+ * stop at them. */
+#define RUN_START 4
+#define RUN_END 8
+
+/* Comparison functions take two keys and return 1 if x < y, 0 if x >= y, and
+ * -1 on error. They are chosen per object by scanning the keys, so that
+ * homogeneous data can skip the generic rich comparison machinery. */
+struct LSObject;
+typedef int (*lessthanfunc)(PyObject *, PyObject *, struct LSObject *);
+
+/* The kinds of keys with specialized comparison functions */
+#define KIND_GENERIC 0
+#define KIND_FLOAT 1
+#define KIND_INT 2          /* ints that fit in a C long */
+#define KIND_STR 3          /* byte strings, or one-byte-per-char unicode */
+#define KIND_TUPLE 4        /* non-empty tuples */
+
+/* Kernels for sorting unboxed data of one C type in one direction. These
+ * operate on the raw array and never touch python objects, so they can't
+ * fail */
 typedef struct {
+    char format;                /* The struct module format character */
+    Py_ssize_t itemsize;
+    PyObject *(*box)(void *, Py_ssize_t);           /* New ref to data[i] */
+    int (*unbox)(void *, Py_ssize_t, PyObject *);   /* data[i] = x, or -1 */
+    Py_ssize_t (*partition)(void *, Py_ssize_t, Py_ssize_t,
+                            unsigned long long *);
+    void (*insertion_sort)(void *, Py_ssize_t, Py_ssize_t);
+    int (*eq)(void *, Py_ssize_t, Py_ssize_t);      /* data[i] == data[j] */
+    void (*swap)(void *, Py_ssize_t, Py_ssize_t);
+    Py_ssize_t (*partition3)(void *, Py_ssize_t, Py_ssize_t, Py_ssize_t,
+                             Py_ssize_t *);
+    void (*heap_sort)(void *, Py_ssize_t, Py_ssize_t);
+    /* Moves the items in [left, right) less than data[i] to the front, and
+     * returns where the rest start */
+    Py_ssize_t (*split)(void *, Py_ssize_t, Py_ssize_t, Py_ssize_t);
+    /* Adds up data[i] - shift and its square over [left, right) */
+    void (*moments)(void *, Py_ssize_t, Py_ssize_t, double, double *);
+    /* Adds up integers exactly, or returns 0 for floating point types */
+    int (*int_sum)(void *, Py_ssize_t, Py_ssize_t, long long *,
+                   unsigned long long *);
+} NativeOps;
+
+/* The LazySorted object */
+typedef struct LSObject {
     PyObject_HEAD
     PyListObject        *xs;            /* Partially sorted list */
+    Py_ssize_t          *perm;          /* Indices sorted instead, or NULL */
+    Py_ssize_t          *where;         /* Where each index is in perm, for
+                                         * windows, or NULL */
+    PyObject            **keys;         /* Keys parallel to xs, or NULL */
+    void                *data;          /* Unboxed values, used instead of xs*/
+    Py_ssize_t          data_len;       /* The number of unboxed values */
+    const NativeOps     *ops;           /* Kernels for data, or NULL for xs */
     PivotNode           *root;          /* Root of the pivot BST */
+    NodePool            pool;           /* Where the pivots come from */
+    PivotBits           bits;           /* Used instead of root if words */
     PyObject            *keyfunc;       /* The key function */
     int                 reverse;        /* 1 for reverse order */
+    unsigned long long  rng;            /* State of the random generator */
+    int                 prepared;       /* 1 once keys and lt are set up */
+    int                 kind;           /* The KIND_* of every key */
+    int                 elem_kind;      /* The KIND_* of every key[0] */
+    lessthanfunc        lt;             /* Compares keys, including reverse */
+    lessthanfunc        elem_lt;        /* Compares key[0]'s for KIND_TUPLE */
+    int                 busy;           /* Nonzero while calling python code */
+    unsigned long       version;        /* Bumped whenever items come or go */
+    Py_ssize_t          shared_len;     /* Length of a caller's list we sort
+                                         * in place, or -1 if xs is ours */
+    int                 shared_ok;      /* 0 once it's changed under us */
+    PyObject            **shared_items; /* Its items as we left them, which
+                                         * BUSY hides */
+    Py_ssize_t          shared_alloc;   /* And their allocated size */
+    void                *lock;          /* Held by the thread using it */
+    unsigned long       owner;          /* That thread, or 0 */
+    int                 depth;          /* How many times it holds lock */
+    int                 worker;         /* 1 for the copies threads work on */
+    Py_ssize_t          exports;        /* Buffers that views have exported */
 } LSObject;
 
 static PyTypeObject LS_Type;
 #define LSObject_Check(v)      (Py_TYPE(v) == &LS_Type)
 
-/* Returns the next (bigger) pivot, or NULL if it's the last pivot */
-PivotNode *
-next_pivot(PivotNode *current)
+/* The number of items, whether they're boxed or not */
+#define LS_SIZE(ls)     ((ls)->ops != NULL ? (ls)->data_len :                 \
+                                             Py_SIZE((ls)->xs))
+
+/* Returns a new reference to the item at index k */
+static inline PyObject *
+ls_item(LSObject *ls, Py_ssize_t k)
 {
-    PivotNode *curr = current;
-    if (curr->right != NULL) {
-        curr = curr->right;
-        while (curr->left != NULL) {
-            curr = curr->left;
-        }
+    if (ls->ops != NULL)
+        return ls->ops->box(ls->data, k);
+    if (ls->perm != NULL) {
+        /* A window sorts indices to keep track of its items, but they're
+         * what it's asked for */
+        if (ls->where == NULL)
+            return PyInt_FromSsize_t(ls->perm[k]);
+        k = ls->perm[k];
     }
-    else {
-        while (curr->parent != NULL && curr->parent->idx < curr->idx) {
-            curr = curr->parent;
-        }
+    Py_INCREF(ls->xs->ob_item[k]);
+    return ls->xs->ob_item[k];
+}
 
-        if (curr->parent == NULL) {
-            return NULL;
-        }
-        else {
-            curr = curr->parent;
-        }
+/* A caller's list that's sorted in place looks empty to the python code run
+ * while ls is busy, as a list does during list.sort, since the code could
+ * otherwise pull the items out from under us. */
+static inline void
+busy_enter(LSObject *ls)
+{
+    PyListObject *xs = ls->xs;
+
+    if (ls->busy++ > 0 || ls->shared_len < 0)
+        return;
+    ls->shared_items = xs->ob_item;
+    ls->shared_alloc = xs->allocated;
+    xs->ob_item = NULL;
+    Py_SET_SIZE(xs, 0);
+    xs->allocated = 0;
+}
+
+/* Puts the items back, throwing away whatever the python code put in the list
+ * in the meantime, which breaks ls, since it no longer matches the caller's
+ * idea of the list */
+static inline void
+busy_leave(LSObject *ls)
+{
+    PyListObject *xs = ls->xs;
+    PyObject **stray;
+    Py_ssize_t i;
+
+    if (--ls->busy > 0 || ls->shared_len < 0)
+        return;
+    while (xs->ob_item != NULL) {
+        stray = xs->ob_item;
+        i = Py_SIZE(xs);
+        xs->ob_item = NULL;
+        Py_SET_SIZE(xs, 0);
+        xs->allocated = 0;
+        while (--i >= 0)
+            Py_XDECREF(stray[i]);
+        PyMem_Free(stray);
+        ls->shared_ok = 0;
+    }
+    xs->ob_item = ls->shared_items;
+    Py_SET_SIZE(xs, ls->shared_len);
+    xs->allocated = ls->shared_alloc;
+}
+
+/* Marks ls busy while python code that might try to modify it runs, since
+ * the functions calling into python hold indices and pointers into its
+ * storage. Evaluates to CALL. */
+#define BUSY(ls, CALL)  (busy_enter(ls), busy_res = (CALL), busy_leave(ls),   \
+                         busy_res)
+
+/* Returns 1 if item == the item at index k, 0 if not, and -1 on error */
+static int
+item_eq(LSObject *ls, PyObject *item, Py_ssize_t k)
+{
+    int busy_res;
+
+    if (ls->perm != NULL) {
+        PyObject *other = ls->xs->ob_item[ls->perm[k]];
+        return BUSY(ls, PyObject_RichCompareBool(item, other, Py_EQ));
+    }
+    if (ls->ops == NULL) {
+        PyObject *other = ls->xs->ob_item[k];   /* BUSY may hide xs */
+        return BUSY(ls, PyObject_RichCompareBool(item, other, Py_EQ));
     }
 
-    assert(curr->idx > current->idx);
-    return curr;
+    PyObject *boxed = ls->ops->box(ls->data, k);
+    if (boxed == NULL)
+        return -1;
+    int res = BUSY(ls, PyObject_RichCompareBool(item, boxed, Py_EQ));
+    Py_DECREF(boxed);
+    return res;
+}
+
+/* The keys to compare: the cached keys, or the items themselves if there's no
+ * key function. Not meaningful for unboxed data. */
+#define LS_KEYS(ls)     ((ls)->keys != NULL ? (ls)->keys : (ls)->xs->ob_item)
+
+/* The key of the item at index k, which perm points to if ls sorts indices */
+#define LS_KEY(ls, k)   (LS_KEYS(ls)[(ls)->perm != NULL ? (ls)->perm[k] : (k)])
+
+/* Puts node into the list of pivots, between the adjacent pivots prev and
+ * next, either of which may be NULL */
+static void
+link_pivot(PivotNode *node, PivotNode *prev, PivotNode *next)
+{
+    node->prev = prev;
+    node->next = next;
+    if (prev != NULL)
+        prev->next = node;
+    if (next != NULL)
+        next->prev = node;
+}
+
+/* Takes node out of the list of pivots */
+static void
+unlink_pivot(PivotNode *node)
+{
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
 }
 
 /* A recursive function getting the consistency of a node.
@@ -139,22 +457,23 @@ assert_tree(PivotNode *root)
     assert_node(root);
 }
 
-/* A series of assert statements that the tree's flags are consistent */
+/* A series of assert statements that the flags of the pivots in the list with
+ * node in it are consistent */
 static void
-assert_tree_flags(PivotNode *root)
+assert_tree_flags(PivotNode *node)
 {
     PivotNode *prev = NULL;
-    PivotNode *curr = root;
-    while (curr->left != NULL)
-        curr = curr->left;
+    PivotNode *curr = node;
+    while (curr->prev != NULL)
+        curr = curr->prev;
     while (curr != NULL) {
         if (curr->flags & SORTED_LEFT)
-            assert(next_pivot(curr)->flags & SORTED_RIGHT);
+            assert(curr->next->flags & SORTED_RIGHT);
         if (curr->flags & SORTED_RIGHT)
             assert(prev->flags & SORTED_LEFT);
 
         prev = curr;
-        curr = next_pivot(curr);
+        curr = curr->next;
     }
 }
 #else
@@ -164,40 +483,172 @@ assert_tree_flags(PivotNode *root)
 #define assert_tree_flags(x)
 #endif
 
+/* Each LazySorted object has its own xorshift64* generator, which picks its
+ * pivots and treap priorities. It's much faster than rand(), gives 64 bits,
+ * and isn't shared between objects. */
+static unsigned long long
+rng_next(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* A random index left <= i < right */
+#define RANDOM_IDX(rng, left, right)                                          \
+    ((left) + (Py_ssize_t)(rng_next(rng) %                                    \
+                           (unsigned long long)((right) - (left))))
+
+/* Scrambles a seed into a generator state with splitmix64, so that nearby
+ * seeds give unrelated states, and the state is never zero */
+static unsigned long long
+rng_seed(unsigned long long seed)
+{
+    unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+}
+
+/* Objects that aren't given a seed use entropy plus a count of such objects,
+ * where entropy comes from os.urandom when the module is loaded */
+static unsigned long long entropy;
+static unsigned long long unseeded_count = 0;
+
+static void
+entropy_init(void)
+{
+    PyObject *os, *bytes = NULL;
+
+    entropy = (unsigned long long)time(NULL);
+    os = PyImport_ImportModule("os");
+    if (os != NULL) {
+        bytes = PyObject_CallMethod(os, "urandom", "i",
+                                    (int)sizeof(entropy));
+        Py_DECREF(os);
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (bytes != NULL && PyBytes_Check(bytes) &&
+            PyBytes_GET_SIZE(bytes) == sizeof(entropy))
+        memcpy(&entropy, PyBytes_AS_STRING(bytes), sizeof(entropy));
+#else
+    if (bytes != NULL && PyString_Check(bytes) &&
+            PyString_GET_SIZE(bytes) == sizeof(entropy))
+        memcpy(&entropy, PyString_AS_STRING(bytes), sizeof(entropy));
+#endif
+    Py_XDECREF(bytes);
+    PyErr_Clear();  /* Falling back to the time is fine */
+}
+
+/* Returns an uninitialized node from pool, or NULL on error */
+static PivotNode *pool_alloc(NodePool *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static PivotNode *
+pool_alloc(NodePool *pool)
+{
+    PivotNode *node = pool->free;
+    if (node != NULL) {
+        pool->free = node->parent;
+        return node;
+    }
+
+    if (pool->slabs == NULL || pool->used == pool->slabs->size) {
+        Py_ssize_t size = SLAB_MIN;
+        if (pool->slabs != NULL)
+            size = pool->slabs->size < SLAB_MAX ? 2 * pool->slabs->size
+                                                 : SLAB_MAX;
+
+        NodeSlab *slab = (NodeSlab *)PyMem_Malloc(
+            offsetof(NodeSlab, nodes) + size * sizeof(PivotNode));
+        if (slab == NULL)
+            return (PivotNode *)PyErr_NoMemory();
+        slab->next = pool->slabs;
+        slab->size = size;
+        pool->slabs = slab;
+        pool->used = 0;
+    }
+
+    return &pool->slabs->nodes[pool->used++];
+}
+
+/* Returns node to pool, for a later pool_alloc to reuse */
+static void
+pool_free(NodePool *pool, PivotNode *node)
+{
+    node->parent = pool->free;
+    pool->free = node;
+}
+
+/* Frees every node of pool, in use or not */
+static void
+pool_clear(NodePool *pool)
+{
+    NodeSlab *slab, *next;
+    for (slab = pool->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        PyMem_Free(slab);
+    }
+    pool->slabs = NULL;
+    pool->used = 0;
+    pool->free = NULL;
+}
+
+/* Frees every node of pool, keeping its slab for reuse if it only has one */
+static void
+pool_reset(NodePool *pool)
+{
+    if (pool->slabs != NULL && pool->slabs->next != NULL) {
+        pool_clear(pool);
+        return;
+    }
+    pool->used = 0;
+    pool->free = NULL;
+}
 
 /* Inserts an index, returning a pointer to the node, or NULL on error.
  * *root is the root of the tree, while start is the node to insert from.
+ * The node comes from pool, and its priority is drawn from rng.
  */
-static PivotNode *insert_pivot(Py_ssize_t, int, PivotNode **, PivotNode *)
+static PivotNode *insert_pivot(Py_ssize_t, int, PivotNode **, PivotNode *,
+                               NodePool *, unsigned long long *)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
 static PivotNode *
-insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start)
+insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start,
+             NodePool *pool, unsigned long long *rng)
 {
     /* Build the node */
-    PivotNode *node = (PivotNode *)PyMem_Malloc(sizeof(PivotNode));
+    PivotNode *node = pool_alloc(pool);
     if (node == NULL)
-        return (PivotNode *)PyErr_NoMemory();
+        return NULL;
     node->idx = k;
     node->flags = flags;
-    node->priority = rand();
+    node->priority = (int)(rng_next(rng) >> 33);
     node->left = NULL;
     node->right = NULL;
 
     /* Special case the empty tree */
     if (*root == NULL) {
         node->parent = NULL;
+        link_pivot(node, NULL, NULL);
         *root = node;
         return node;
     }
 
-    /* Put the node in its sorted order */
+    /* Put the node in its sorted order. A new leaf comes right after its
+     * parent if it's a right child, or right before it if it's a left one. */
     PivotNode *current = start;
     while (1) {
         if (current->idx < k) {
             if (current->right == NULL) {
                 current->right = node;
                 node->parent = current;
+                link_pivot(node, current, current->next);
                 break;
             }
             current = current->right;
@@ -206,12 +657,14 @@ insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start)
             if (current->left == NULL) {
                 current->left = node;
                 node->parent = current;
+                link_pivot(node, current->prev, current);
                 break;
             }
             current = current->left;
         }
         else {
             /* The pivot BST should always have unique pivots */
+            pool_free(pool, node);
             PyErr_SetString(PyExc_SystemError, "All pivots must be unique");
             return NULL;
         }
@@ -317,9 +770,10 @@ merge_trees(PivotNode *left, PivotNode *right)
 }
 
 static void
-delete_node(PivotNode *node, PivotNode **root)
+delete_node(PivotNode *node, PivotNode **root, NodePool *pool)
 {
     assert_tree(*root);
+    unlink_pivot(node);
 
     if (node->left == NULL) {
         /* node has at most one child in node->right, so we just have the 
@@ -341,7 +795,7 @@ delete_node(PivotNode *node, PivotNode **root)
             node->right->parent = node->parent;
         }
 
-        PyMem_Free(node);
+        pool_free(pool, node);
     }
     else {
         if (node->right == NULL) {
@@ -362,7 +816,7 @@ delete_node(PivotNode *node, PivotNode **root)
             /* node->left is not NULL because of the outer if-else statement */
             node->left->parent = node->parent;
 
-            PyMem_Free(node);
+            pool_free(pool, node);
         }
         else {
             /* The hard case: node has two children. We merge the two children
@@ -384,1018 +838,7194 @@ delete_node(PivotNode *node, PivotNode **root)
             /* children is not NULL since node has two children */
             children->parent = node->parent;
 
-            PyMem_Free(node);
+            pool_free(pool, node);
         }
     }
 
     assert_tree(*root);
 }
 
-/* If a sorted pivot is between two sorted section, removes the sorted pivot */
-static void
-depivot(PivotNode *left, PivotNode *right, PivotNode **root)
-{
-    assert_tree(*root);
-    assert_tree_flags(*root);
-    assert(left->flags & SORTED_LEFT);
-    assert(right->flags & SORTED_RIGHT);
-
-    if (left->flags & SORTED_RIGHT) {
-        delete_node(left, root);
-    }
-
-    if (right->flags & SORTED_LEFT) {
-        delete_node(right, root);
-    }
-
-    assert_tree(*root);
-    assert_tree_flags(*root);
-}
-
-/* If the value at middle is equal to the value at left, left is removed.
- * If the value at middle is equal to the value at right, right is removed.
- * Returns 0 on success, or -1 on failure */
+/* Bit p of the bitvector v */
+#define BIT_GET(v, p)       ((int)((v)[(p) >> 6] >> ((p) & 63)) & 1)
+#define BIT_SET(v, p)       ((v)[(p) >> 6] |= 1ULL << ((p) & 63))
+#define BIT_CLEAR(v, p)     ((v)[(p) >> 6] &= ~(1ULL << ((p) & 63)))
 
-static int uniq_pivots(PivotNode *, PivotNode *, PivotNode *, LSObject *)
+/* Sets up the bitvectors for the indices from -1 to n, with no pivots yet,
+ * returning 0 on success or -1 on error */
+static int bits_init(PivotBits *, Py_ssize_t)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
 static int
-uniq_pivots(PivotNode *left, PivotNode *middle, PivotNode *right, LSObject *ls)
+bits_init(PivotBits *pb, Py_ssize_t n)
 {
-    assert_tree(ls->root);
-    assert_tree_flags(ls->root);
-    assert(left->idx < middle->idx && middle->idx < right->idx);
-    int cmp;
-
-    if (left->idx >= 0) {
-        if ((cmp = PyObject_RichCompareBool(ls->xs->ob_item[left->idx],
-                                            ls->xs->ob_item[middle->idx],
-                                            Py_EQ)) < 0) {
-            return -1;
-        }
-        else if (cmp) {
-            middle->flags = left->flags;
-            delete_node(left, &ls->root);
-        }
-    }
-
-    if (right->idx < Py_SIZE(ls->xs)) {
-        if ((cmp = PyObject_RichCompareBool(ls->xs->ob_item[middle->idx],
-                                            ls->xs->ob_item[right->idx],
-                                            Py_EQ)) < 0) {
-            return -1;
-        }
-        else if (cmp) {
-            middle->flags = right->flags;
-            delete_node(right, &ls->root);
-        }
+    Py_ssize_t n_words = (n + 2 + 63) / 64;
+    Py_ssize_t n_summary = (n_words + 63) / 64;
+    Py_ssize_t n_top = (n_summary + 63) / 64;
+    Py_ssize_t size = 4 * n_words + n_summary + n_top;
+
+    pb->words = (unsigned long long *)PyMem_Malloc(
+        size * sizeof(unsigned long long));
+    if (pb->words == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
-
-    assert_tree(ls->root);
-    assert_tree_flags(ls->root);
+    memset(pb->words, 0, size * sizeof(unsigned long long));
+    pb->sorted = pb->words + n_words;
+    pb->run_start = pb->sorted + n_words;
+    pb->run_end = pb->run_start + n_words;
+    pb->summary = pb->run_end + n_words;
+    pb->top = pb->summary + n_summary;
+    pb->n_words = n_words;
+    pb->table = NULL;
+    pb->n_table = 0;
+    pb->n_live = 0;
     return 0;
 }
 
-/* Finds PivotNodes left and right that bound the index */
-/* Never returns k in right_node, only the left, if applicable */
+/* Frees the bitvectors and the table, but not the nodes in it */
 static void
-bound_idx(Py_ssize_t k, PivotNode *root, PivotNode **left, PivotNode **right)
+bits_clear(PivotBits *pb)
 {
-    assert_tree(root);
-    assert_tree_flags(root);
+    if (pb->words == NULL)
+        return;
+    PyMem_Free(pb->words);
+    PyMem_Free(pb->table);
+    pb->words = NULL;
+    pb->table = NULL;
+    pb->n_table = 0;
+    pb->n_live = 0;
+}
 
-    *left = NULL;
-    *right = NULL;
-    PivotNode *current = root;
-    while (current != NULL) {
-        if (current->idx < k) {
-            *left = current;
-            current = current->right;
-        }
-        else if (current->idx > k) {
-            *right = current;
-            current = current->left;
-        }
-        else {
-            *left = current;
-            break;
-        }
+/* Returns the position of the last set bit at or before position p. The bit
+ * for index -1 is always set, so there is one. */
+static Py_ssize_t
+bits_pred(PivotBits *pb, Py_ssize_t p)
+{
+    Py_ssize_t w = p >> 6;
+    Py_ssize_t s, t;
+    unsigned long long m = pb->words[w] & (~0ULL >> (63 - (p & 63)));
+
+    if (m != 0)
+        return (w << 6) + HIGH_BIT(m);
+
+    /* The last nonempty word before w, from the summaries */
+    s = w >> 6;
+    m = pb->summary[s] & ((1ULL << (w & 63)) - 1);
+    if (m == 0) {
+        t = s >> 6;
+        m = pb->top[t] & ((1ULL << (s & 63)) - 1);
+        while (m == 0)
+            m = pb->top[--t];
+        s = (t << 6) + HIGH_BIT(m);
+        m = pb->summary[s];
     }
+    w = (s << 6) + HIGH_BIT(m);
+    return (w << 6) + HIGH_BIT(pb->words[w]);
+}
 
-    assert(*left != NULL && ((*left)->idx == k || *right != NULL));
-    assert((*left)->idx == k || *right == next_pivot(*left));
+/* Returns the position of the first set bit at or after position p, or -1 if
+ * there isn't one */
+static Py_ssize_t
+bits_succ(PivotBits *pb, Py_ssize_t p)
+{
+    Py_ssize_t w = p >> 6;
+    Py_ssize_t s, t, n_top = (pb->n_words + 4095) >> 12;
+    unsigned long long m;
+
+    if (w >= pb->n_words)
+        return -1;
+    m = pb->words[w] & (~0ULL << (p & 63));
+    if (m != 0)
+        return (w << 6) + LOW_BIT(m);
+
+    /* The first nonempty word after w, from the summaries */
+    s = w >> 6;
+    m = pb->summary[s] & ((~0ULL << (w & 63)) << 1);
+    if (m == 0) {
+        t = s >> 6;
+        m = pb->top[t] & ((~0ULL << (s & 63)) << 1);
+        while (m == 0) {
+            if (++t >= n_top)
+                return -1;
+            m = pb->top[t];
+        }
+        s = (t << 6) + LOW_BIT(m);
+        m = pb->summary[s];
+    }
+    w = (s << 6) + LOW_BIT(m);
+    return (w << 6) + LOW_BIT(pb->words[w]);
 }
 
+/* Sets the bit for index idx */
 static void
-free_tree(PivotNode *root)
+bits_set(PivotBits *pb, Py_ssize_t idx)
 {
-    assert_node(root);  /* might not be the actual root because of recursion */
-
-    if (root->left != NULL)
-        free_tree(root->left);
-    if (root->right != NULL)
-        free_tree(root->right);
+    Py_ssize_t w = (idx + 1) >> 6;
 
-    PyMem_Free(root);
+    BIT_SET(pb->words, idx + 1);
+    pb->summary[w >> 6] |= 1ULL << (w & 63);
+    pb->top[w >> 12] |= 1ULL << ((w >> 6) & 63);
 }
 
+/* Clears the bit for index idx */
 static void
-LS_dealloc(LSObject *self)
+bits_unset(PivotBits *pb, Py_ssize_t idx)
 {
-    Py_DECREF(self->xs);
-    Py_XDECREF(self->keyfunc);
-    if (self->root != NULL) {
-        free_tree(self->root);
+    Py_ssize_t w = (idx + 1) >> 6;
+
+    BIT_CLEAR(pb->words, idx + 1);
+    if (pb->words[w] == 0) {
+        pb->summary[w >> 6] &= ~(1ULL << (w & 63));
+        if (pb->summary[w >> 6] == 0)
+            pb->top[w >> 12] &= ~(1ULL << ((w >> 6) & 63));
     }
-    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-static PyObject *
-newLSObject(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    LSObject *self;
-    PyListObject *xs;
-    PyObject *sequence = NULL;
-    PyObject *keyfunc = NULL;
-    int reverse = 0;
-    static char *kwdlist[] = {"sequence", "key", "reverse", 0};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oi:LazySorted",
-        kwdlist, &sequence, &keyfunc, &reverse))
-        return NULL;
+/* The chain of the table of pb for the node of the pivot at index idx */
+#define BITS_CHAIN(pb, idx)                                                   \
+    ((pb)->table + ((size_t)(idx) & (size_t)((pb)->n_table - 1)))
 
-    PyObject *list_args = Py_BuildValue("(O)", sequence);
-    if (list_args == NULL)
-        return NULL;
+/* Returns the node made for the pivot at index idx, or NULL if none is */
+static PivotNode *
+bits_live(PivotBits *pb, Py_ssize_t idx)
+{
+    PivotNode *node;
 
-    xs = (PyListObject *)PyList_Type.tp_new(&PyList_Type, list_args, NULL);
-    if (xs == NULL) {
-        Py_DECREF(list_args);
+    if (pb->n_table == 0)
         return NULL;
+    for (node = *BITS_CHAIN(pb, idx); node != NULL; node = node->left) {
+        if (node->idx == idx)
+            return node;
     }
+    return NULL;
+}
 
-    if (PyList_Type.tp_init((PyObject *)xs, list_args, NULL)) {
-        Py_DECREF(list_args);
-        Py_DECREF(xs);
-        return NULL;
-    }
-    Py_DECREF(list_args);
+/* Puts node in the table of pb, which must have room for it */
+static void
+bits_hash(PivotBits *pb, PivotNode *node)
+{
+    PivotNode **chain = BITS_CHAIN(pb, node->idx);
 
-    self = (LSObject *)type->tp_alloc(type, 0);
-    if (self == NULL) {
-        Py_DECREF(xs);
-        return NULL;
-    }
-    self->root = NULL;
-    self->keyfunc = NULL;
-    self->reverse = 0;
-    self->xs = xs;
+    node->left = *chain;
+    *chain = node;
+    pb->n_live++;
+}
 
-    if (insert_pivot(-1, UNSORTED, &self->root, self->root) == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
+/* Takes node out of the table of pb */
+static void
+bits_unhash(PivotBits *pb, PivotNode *node)
+{
+    PivotNode **link = BITS_CHAIN(pb, node->idx);
 
-    if (insert_pivot(Py_SIZE(xs), UNSORTED, &self->root, self->root) == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
+    while (*link != node)
+        link = &(*link)->left;
+    *link = node->left;
+    pb->n_live--;
+}
 
-    if (reverse)
-        self->reverse = 1;
+/* Makes room in the table of pb for another node, doubling it when it's
+ * full, so that the chains stay short. Returns 0 on success or -1 on
+ * error. */
+static int bits_reserve(PivotBits *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
 
-    if (keyfunc == Py_None)
-        keyfunc = NULL;
+static int
+bits_reserve(PivotBits *pb)
+{
+    PivotNode **old = pb->table, *node, *next;
+    Py_ssize_t n_old = pb->n_table, i;
+    Py_ssize_t size = n_old > 0 ? 2 * n_old : SLAB_MIN;
 
-    if (keyfunc != NULL) {
-        /* Since we sort lazily, we wouldn't discover that the key isn't
-         * callable until we actually attempted sorting. So let's try to help
-         * the user by failing fast if this is the case. */
-        if (!PyCallable_Check(keyfunc)) {
-            PyErr_SetString(PyExc_TypeError, "key must be callable");
-            Py_DECREF(self);
-            return NULL;
+    if (pb->n_live < n_old)
+        return 0;
+    pb->table = (PivotNode **)PyMem_Malloc(size * sizeof(PivotNode *));
+    if (pb->table == NULL) {
+        pb->table = old;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(pb->table, 0, size * sizeof(PivotNode *));
+    pb->n_table = size;
+    pb->n_live = 0;
+    for (i = 0; i < n_old; i++) {
+        for (node = old[i]; node != NULL; node = next) {
+            next = node->left;
+            bits_hash(pb, node);
         }
-        self->keyfunc = keyfunc;
-        Py_INCREF(self->keyfunc);
     }
-
-    return (PyObject *)self;
+    PyMem_Free(old);
+    return 0;
 }
 
-/* Private helper functions for partial sorting */
+/* Moves node, and the bit of its pivot, to index idx, with no pivot
+ * between */
+static void
+bits_move(PivotBits *pb, PivotNode *node, Py_ssize_t idx)
+{
+    bits_unhash(pb, node);
+    bits_unset(pb, node->idx);
+    node->idx = idx;
+    bits_set(pb, idx);
+    bits_hash(pb, node);
+}
 
-/* These macros are basically taken from list.c
- * Returns 1 if x < y, 0 if x >= y, and -1 on error */
-/* #define ISLT(X, Y) PyObject_RichCompareBool(X, Y, Py_LT) */
+/* Returns the flags of the pivot at index idx, from its node if it has one,
+ * or else from the bitvectors */
+static int
+bits_flags(PivotBits *pb, Py_ssize_t idx)
+{
+    PivotNode *node = bits_live(pb, idx);
+    Py_ssize_t p = idx + 1, q;
+    int flags = 0;
+
+    if (node != NULL)
+        return node->flags;
+    if (BIT_GET(pb->sorted, p))
+        flags |= SORTED_LEFT;
+    if (BIT_GET(pb->run_start, p))
+        flags |= RUN_START;
+    if (BIT_GET(pb->run_end, p))
+        flags |= RUN_END;
+    if (p > 0) {
+        q = bits_pred(pb, p - 1);
+        node = bits_live(pb, q - 1);
+        if (node != NULL ? node->flags & SORTED_LEFT : BIT_GET(pb->sorted, q))
+            flags |= SORTED_RIGHT;
+    }
+    return flags;
+}
 
-static inline int islt(PyObject *, PyObject *, LSObject *)
+/* Returns the node for the pivot at index idx, making it if there isn't one
+ * yet, or NULL on error. It takes over the pivot's flags, whose bits are
+ * clear while it has them. */
+static PivotNode *bits_node(LSObject *, Py_ssize_t)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
-static inline int
-islt(PyObject *x, PyObject *y, LSObject *ls)
+static PivotNode *
+bits_node(LSObject *ls, Py_ssize_t idx)
 {
-    if (ls->keyfunc != NULL) {
-        PyObject *x_cmp, *y_cmp;
+    PivotBits *pb = &ls->bits;
+    PivotNode *node = bits_live(pb, idx);
+    Py_ssize_t p = idx + 1;
 
-        PyObject *x_arg = Py_BuildValue("(O)", x);
-        x_cmp = PyObject_CallObject(ls->keyfunc, x_arg);
-        Py_DECREF(x_arg);
-        if (x_cmp == NULL) {
-            return -1;
-        }
+    assert(BIT_GET(pb->words, p));
+    if (node != NULL)
+        return node;
+    if (bits_reserve(pb) < 0 || (node = pool_alloc(&ls->pool)) == NULL)
+        return NULL;
+    node->idx = idx;
+    node->flags = bits_flags(pb, idx);
+    node->right = NULL;
+    node->parent = NULL;
+    node->prev = NULL;
+    node->next = NULL;
+    BIT_CLEAR(pb->sorted, p);
+    BIT_CLEAR(pb->run_start, p);
+    BIT_CLEAR(pb->run_end, p);
+    bits_hash(pb, node);
+    return node;
+}
 
-        PyObject *y_arg = Py_BuildValue("(O)", y);
-        y_cmp = PyObject_CallObject(ls->keyfunc, y_arg);
-        Py_DECREF(y_arg);
-        if (y_cmp == NULL) {
-            Py_DECREF(x_cmp);
-            return -1;
+#ifndef NDEBUG
+/* Asserts that the flags of the nodes made for ls agree with their
+ * neighbours' */
+static void
+assert_bits_flags(PivotBits *pb)
+{
+    PivotNode *node;
+    Py_ssize_t i;
+    int left;
+
+    for (i = 0; i < pb->n_table; i++) {
+        for (node = pb->table[i]; node != NULL; node = node->left) {
+            if (node->idx < 0)
+                continue;
+            left = bits_flags(pb, bits_pred(pb, node->idx) - 1);
+            assert(!(node->flags & SORTED_RIGHT) == !(left & SORTED_LEFT));
         }
-
-        int res = ls->reverse ? PyObject_RichCompareBool(x_cmp, y_cmp, Py_GT)
-                              : PyObject_RichCompareBool(x_cmp, y_cmp, Py_LT);
-
-        Py_DECREF(x_cmp);
-        Py_DECREF(y_cmp);
-        return res;
-    } else {
-        return ls->reverse ? PyObject_RichCompareBool(x, y, Py_GT)
-                           : PyObject_RichCompareBool(x, y, Py_LT);
     }
 }
+#else
+#define assert_bits_flags(x)
+#endif
 
-#define IFLT(X, Y) if ((ltflag = islt(X, Y, ls)) < 0) goto fail;  \
-            if(ltflag)
-
-/* N.B: No semicolon at the end, so that you can include one yourself */
-#define SWAP(i, j) tmp = ob_item[i];  \
-                   ob_item[i] = ob_item[j];  \
-                   ob_item[j] = tmp
-
-/* Picks a pivot point among the indices left <= i < right. Returns -1 on
- * error */
-
-static Py_ssize_t pick_pivot(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
-static Py_ssize_t
-pick_pivot(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+/* Asserts that the flags of the pivots of ls around node are consistent */
+#define assert_flags(ls, node)                                                \
+    do {                                                                      \
+        if ((ls)->bits.words != NULL) {                                       \
+            assert_bits_flags(&(ls)->bits);                                   \
+        }                                                                     \
+        else {                                                                \
+            assert_tree_flags(node);                                          \
+        }                                                                     \
+    } while (0)
+
+/* Puts the flags of the nodes made for ls back in its bitvectors, and frees
+ * the nodes. This happens whenever ls is unlocked, since nothing can be
+ * holding them then. A small table and the first slab are kept for next
+ * time. */
+static void
+bits_flush(LSObject *ls)
 {
-    PyObject **ob_item = ls->xs->ob_item;
-
-    /* Use median of three trick */
-    Py_ssize_t idx1 = left + rand() % (right - left);
-    Py_ssize_t idx2 = left + rand() % (right - left);
-    Py_ssize_t idx3 = left + rand() % (right - left);
+    PivotBits *pb = &ls->bits;
+    PivotNode *node;
+    Py_ssize_t i, p;
 
-    int ltflag;
-    IFLT(ob_item[idx1], ob_item[idx3]) {
-        IFLT(ob_item[idx1], ob_item[idx2]) {
-            /* 1 2 3 vs. 1 3 2 */
-            IFLT(ob_item[idx2], ob_item[idx3]) {
-                return idx2;
-            }
-            else {
-                return idx3;
-            }
-        }
-        else {
-            /* 2 1 3 */
-            return idx1;
+    if (pb->n_live == 0)
+        return;
+    assert_bits_flags(pb);
+    for (i = 0; i < pb->n_table; i++) {
+        for (node = pb->table[i]; node != NULL; node = node->left) {
+            p = node->idx + 1;
+            if (node->flags & SORTED_LEFT)
+                BIT_SET(pb->sorted, p);
+            if (node->flags & RUN_START)
+                BIT_SET(pb->run_start, p);
+            if (node->flags & RUN_END)
+                BIT_SET(pb->run_end, p);
         }
     }
+    if (pb->n_table > SLAB_MIN) {
+        PyMem_Free(pb->table);
+        pb->table = NULL;
+        pb->n_table = 0;
+    }
     else {
-        IFLT(ob_item[idx3], ob_item[idx2]) {
-            /* 3 1 2 vs 3 2 1 */
-            IFLT(ob_item[idx1], ob_item[idx2]) {
-                return idx1;
-            }
-            else {
-                return idx2;
-            }
-        }
-        else {
-            /* 2 3 1 */
-            return idx3;
-        }
+        memset(pb->table, 0, pb->n_table * sizeof(PivotNode *));
     }
-
-fail:
-    return -1;
+    pb->n_live = 0;
+    pool_reset(&ls->pool);
 }
 
-/* Partitions the data between left and right into
- * [less than region | greater or equal to region]
- * and returns the pivot index, or -1 on error */
-static Py_ssize_t partition(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
-static Py_ssize_t
-partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+/* Returns the next (bigger) pivot, or NULL if it's the last pivot. For big
+ * lists, whose nodes are made as they're needed, it also returns NULL on
+ * error. */
+static inline PivotNode *
+next_pivot(LSObject *ls, PivotNode *current)
 {
-    PyObject **ob_item = ls->xs->ob_item;
-
-    PyObject *tmp;  /* Used by SWAP macro */
-    PyObject *pivot;
-    int ltflag;
+    Py_ssize_t p;
 
-    Py_ssize_t piv_idx = pick_pivot(ls, left, right);
-    if (piv_idx < 0) {
-        return -1;
+    if (ls->bits.words != NULL) {
+        p = bits_succ(&ls->bits, current->idx + 2);
+        return p < 0 ? NULL : bits_node(ls, p - 1);
     }
-    pivot = ob_item[piv_idx];
-
-    SWAP(left, piv_idx);
-    Py_ssize_t last_less = left;
+    assert(current->next == NULL || current->next->idx > current->idx);
+    return current->next;
+}
 
-    /* Invariant: last_less and everything to its left is less than
-     * pivot or the pivot itself */
+/* Returns the previous (smaller) pivot, or NULL if it's the first pivot, or
+ * on error, as for next_pivot */
+static inline PivotNode *
+prev_pivot(LSObject *ls, PivotNode *current)
+{
+    if (ls->bits.words != NULL) {
+        if (current->idx < 0)
+            return NULL;
+        return bits_node(ls, bits_pred(&ls->bits, current->idx) - 1);
+    }
+    assert(current->prev == NULL || current->prev->idx < current->idx);
+    return current->prev;
+}
 
-    Py_ssize_t i;
-    for (i = left + 1; i < right - 3; i++) {
-        /*
-        This single line boosts performance by a factor of around 2 on GCC.
-        The optimal lookahead distance i+3 was chosen by experimentation.
-        See http://www.naftaliharris.com/blog/2x-speedup-with-one-line-of-code/
-        */
-        __builtin_prefetch(ob_item[i+3]);
-        IFLT(ob_item[i], pivot) {
-            last_less++;
-            SWAP(i, last_less);
-        }
+/* Removes the pivot node from ls */
+static void
+remove_pivot(LSObject *ls, PivotNode *node)
+{
+    if (ls->bits.words != NULL) {
+        bits_unset(&ls->bits, node->idx);
+        bits_unhash(&ls->bits, node);
+        pool_free(&ls->pool, node);
     }
-    assert(right - left >= 3);  /* partition isn't called on small lists */
-    for (i = right - 3; i < right; i++) {
-        IFLT(ob_item[i], pivot) {
-            last_less++;
-            SWAP(i, last_less);
-        }
+    else {
+        delete_node(node, &ls->root, &ls->pool);
     }
-
-    SWAP(left, last_less);
-    return last_less;
-
-fail:  /* From IFLT macro */
-    return -1;
 }
 
-/* Runs insertion sort on the items left <= i < right */
-static int insertion_sort(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
-static int
-insertion_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+/* If a sorted pivot is between two sorted section, removes the sorted pivot */
+static void
+depivot(LSObject *ls, PivotNode *left, PivotNode *right)
 {
-    PyObject **ob_item = ls->xs->ob_item;
+    assert_flags(ls, left);
+    assert(left->flags & SORTED_LEFT);
+    assert(right->flags & SORTED_RIGHT);
 
-    PyObject *tmp;
-    Py_ssize_t i, j;
+    if (left->flags & SORTED_RIGHT) {
+        remove_pivot(ls, left);
+    }
 
-    for (i = left; i < right; i++) {
-        tmp = ob_item[i];
-        int ltflag = 0;
-        for (j = i; j > 0 && (ltflag = islt(tmp, ob_item[j - 1], ls)) > 0; j--)
-            ob_item[j] = ob_item[j - 1];
-        ob_item[j] = tmp;
-        if (ltflag < 0) {
-            return -1;
-        }
+    if (right->flags & SORTED_LEFT) {
+        remove_pivot(ls, right);
     }
-    return 0;
 }
 
-/* Runs quicksort on the items left <= i < right, returning 0 on success
- * or -1 on error. Does not affect stored pivots at all. */
-static int quick_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+/* Inserts an unsorted pivot at idx, which is between the adjacent pivots left
+ * and right. Returns the new node, or NULL on error. */
+static PivotNode *add_pivot(LSObject *, Py_ssize_t, PivotNode *, PivotNode *)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
-static int
-quick_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+static PivotNode *
+add_pivot(LSObject *ls, Py_ssize_t idx, PivotNode *left, PivotNode *right)
 {
-    if (right - left <= SORT_THRESH) {
-        return insertion_sort(ls, left, right);
+    PivotNode *node;
+
+    if (ls->bits.words == NULL) {
+        assert(left->next == right);
+        /* One of left and right is an ancestor of the other, and the new node
+         * goes right under the lower one, so start the search from there */
+        return insert_pivot(idx, UNSORTED, &ls->root,
+                            left->right == NULL ? left : right, &ls->pool,
+                            &ls->rng);
     }
 
-    Py_ssize_t piv_idx = partition(ls, left, right);
-    if (piv_idx < 0)
-        return -1;
-
-    if (quick_sort(ls, left, piv_idx) < 0)
-        return -1;
-
-    if (quick_sort(ls, piv_idx + 1, right) < 0)
-        return -1;
-
-    return 0;
+    if (bits_reserve(&ls->bits) < 0 || (node = pool_alloc(&ls->pool)) == NULL)
+        return NULL;
+    node->idx = idx;
+    node->flags = UNSORTED;
+    node->right = NULL;
+    node->parent = NULL;
+    node->prev = NULL;
+    node->next = NULL;
+    bits_set(&ls->bits, idx);
+    bits_hash(&ls->bits, node);
+    return node;
 }
 
-/* Sorts the list ls sufficiently such that ls->xs->ob_item[k] is actually the
- * kth value in sorted order. Returns 0 on success and -1 on error. */
-static int sort_point(LSObject *, Py_ssize_t)
+/* Finds PivotNodes left and right that bound the index. Never returns k in
+ * right, only the left, if applicable, and then right may be anything.
+ * Returns 0 on success or -1 on error, which only big lists can have. */
+static int bound_idx(LSObject *, Py_ssize_t, PivotNode **, PivotNode **)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
 static int
-sort_point(LSObject *ls, Py_ssize_t k)
+bound_idx(LSObject *ls, Py_ssize_t k, PivotNode **left, PivotNode **right)
 {
-    /* Find the best possible bounds */
-    PivotNode *left, *right, *middle;
-    bound_idx(k, ls->root, &left, &right);
-
-    /* bound_idx never returns k in right, but right might be NULL if
-     * left->idx == k, so check left->idx first. */
-    if (left->idx == k || right->flags & SORTED_RIGHT) {
+    if (ls->bits.words != NULL) {
+        *right = NULL;
+        if ((*left = bits_node(ls, bits_pred(&ls->bits, k + 1) - 1)) == NULL)
+            return -1;
+        if ((*left)->idx != k && (*right = next_pivot(ls, *left)) == NULL)
+            return -1;
         return 0;
     }
 
-    /* Run quickselect */
-    Py_ssize_t piv_idx;
-
-    while (left->idx + 1 + SORT_THRESH <= right->idx) {
-        piv_idx = partition(ls, left->idx + 1, right->idx);
-        if (piv_idx < 0) {
-            return -1;
-        }
-        if (piv_idx < k) {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
+    assert_tree(ls->root);
+    assert_tree_flags(ls->root);
 
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            left = middle;
+    *left = NULL;
+    *right = NULL;
+    PivotNode *current = ls->root;
+    while (current != NULL) {
+        if (current->idx < k) {
+            *left = current;
+            current = current->right;
         }
-        else if (piv_idx > k) {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
-
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            right = middle;
+        else if (current->idx > k) {
+            *right = current;
+            current = current->left;
         }
         else {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
-
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            return 0;
+            *left = current;
+            break;
         }
     }
 
-    if (insertion_sort(ls, left->idx + 1, right->idx) < 0) {
-        return -1;
-    }
-    left->flags |= SORTED_LEFT;
-    right->flags |= SORTED_RIGHT;
-    depivot(left, right, &ls->root);
-
+    assert(*left != NULL && ((*left)->idx == k || *right != NULL));
+    assert((*left)->idx == k || *right == (*left)->next);
     return 0;
 }
 
-/* Sorts the list ls sufficiently such that everything between indices start
- * and stop is in sorted order. Returns 0 on success and -1 on error. */
-static int sort_range(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+/* Kernels for unboxed data. NATIVE_KERNELS instantiates them for one C type
+ * and one direction, where LT(a, b) says whether a comes before b. They mirror
+ * pick_pivot, partition, insertion_sort, partition3, and heap_sort below,
+ * minus the error handling. */
+
+#define ASC_LT(a, b) ((a) < (b))
+#define DESC_LT(a, b) ((a) > (b))
+
+#define NATIVE_KERNELS(NAME, TYPE, LT)                                        \
+static Py_ssize_t                                                             \
+NAME##_pick_pivot(TYPE *xs, Py_ssize_t left, Py_ssize_t right,                \
+                  unsigned long long *rng)                                    \
+{                                                                             \
+    /* Use median of three trick */                                           \
+    Py_ssize_t idx1 = RANDOM_IDX(rng, left, right);                           \
+    Py_ssize_t idx2 = RANDOM_IDX(rng, left, right);                           \
+    Py_ssize_t idx3 = RANDOM_IDX(rng, left, right);                           \
+    if (LT(xs[idx1], xs[idx3]))                                               \
+        return LT(xs[idx1], xs[idx2]) ? (LT(xs[idx2], xs[idx3]) ? idx2        \
+                                                                : idx3)       \
+                                      : idx1;                                 \
+    else                                                                      \
+        return LT(xs[idx3], xs[idx2]) ? (LT(xs[idx1], xs[idx2]) ? idx1        \
+                                                                : idx2)       \
+                                      : idx3;                                 \
+}                                                                             \
+                                                                              \
+static Py_ssize_t                                                             \
+NAME##_split(void *data, Py_ssize_t left, Py_ssize_t right,                  \
+             Py_ssize_t piv_idx)                                              \
+{                                                                             \
+    TYPE *xs = (TYPE *)data;                                                  \
+    TYPE tmp, pivot = xs[piv_idx];                                            \
+    Py_ssize_t i, lt = left;                                                  \
+    /* Swapping every item and advancing lt by the comparison avoids a hard \
+     * to predict branch */                                                   \
+    for (i = left; i < right; i++) {                                          \
+        tmp = xs[i];                                                          \
+        xs[i] = xs[lt];                                                       \
+        xs[lt] = tmp;                                                         \
+        lt += LT(tmp, pivot);                                                 \
+    }                                                                         \
+    return lt;                                                                \
+}                                                                             \
+                                                                              \
+static Py_ssize_t                                                             \
+NAME##_partition(void *data, Py_ssize_t left, Py_ssize_t right,              \
+                 unsigned long long *rng)                                     \
+{                                                                             \
+    TYPE *xs = (TYPE *)data;                                                  \
+    TYPE pivot;                                                               \
+    Py_ssize_t last_less;                                                     \
+    Py_ssize_t piv_idx = NAME##_pick_pivot(xs, left, right, rng);             \
+                                                                              \
+    pivot = xs[piv_idx];                                                      \
+    xs[piv_idx] = xs[left];                                                   \
+    xs[left] = pivot;                                                         \
+    last_less = NAME##_split(data, left + 1, right, left) - 1;                \
+    xs[left] = xs[last_less];                                                 \
+    xs[last_less] = pivot;                                                    \
+    return last_less;                                                         \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+NAME##_insertion_sort(void *data, Py_ssize_t left, Py_ssize_t right)          \
+{                                                                             \
+    TYPE *xs = (TYPE *)data;                                                  \
+    TYPE tmp;                                                                 \
+    Py_ssize_t i, j;                                                          \
+    for (i = left; i < right; i++) {                                          \
+        tmp = xs[i];                                                          \
+        for (j = i; j > left && LT(tmp, xs[j - 1]); j--)                      \
+            xs[j] = xs[j - 1];                                                \
+        xs[j] = tmp;                                                          \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static Py_ssize_t                                                             \
+NAME##_partition3(void *data, Py_ssize_t left, Py_ssize_t right,              \
+                  Py_ssize_t piv_idx, Py_ssize_t *gt)                         \
+{                                                                             \
+    TYPE *xs = (TYPE *)data;                                                  \
+    TYPE tmp, pivot = xs[piv_idx];                                            \
+    Py_ssize_t lt = left, i = left, g = right;                                \
+    while (i < g) {                                                           \
+        if (LT(xs[i], pivot)) {                                               \
+            tmp = xs[i]; xs[i++] = xs[lt]; xs[lt++] = tmp;                    \
+        }                                                                     \
+        else if (LT(pivot, xs[i])) {                                          \
+            tmp = xs[i]; xs[i] = xs[--g]; xs[g] = tmp;                        \
+        }                                                                     \
+        else {                                                                \
+            i++;                                                              \
+        }                                                                     \
+    }                                                                         \
+    *gt = g;                                                                  \
+    return lt;                                                                \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+NAME##_sift_down(TYPE *xs, Py_ssize_t root, Py_ssize_t n)                     \
+{                                                                             \
+    TYPE tmp = xs[root];                                                      \
+    Py_ssize_t child;                                                         \
+    while ((child = 2 * root + 1) < n) {                                      \
+        if (child + 1 < n && LT(xs[child], xs[child + 1]))                    \
+            child++;                                                          \
+        if (!LT(tmp, xs[child]))                                              \
+            break;                                                            \
+        xs[root] = xs[child];                                                 \
+        root = child;                                                         \
+    }                                                                         \
+    xs[root] = tmp;                                                           \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+NAME##_heap_sort(void *data, Py_ssize_t left, Py_ssize_t right)               \
+{                                                                             \
+    TYPE *xs = (TYPE *)data + left;                                           \
+    TYPE tmp;                                                                 \
+    Py_ssize_t n = right - left, i;                                           \
+    for (i = n / 2 - 1; i >= 0; i--)                                          \
+        NAME##_sift_down(xs, i, n);                                           \
+    for (i = n - 1; i > 0; i--) {                                             \
+        tmp = xs[0]; xs[0] = xs[i]; xs[i] = tmp;                              \
+        NAME##_sift_down(xs, 0, i);                                           \
+    }                                                                         \
+}
 
+/* Converters from python numbers to the widest C type of their kind, which
+ * return 0 on success and -1 on error. Like array.array, ints can go in float
+ * buffers but floats can't go in int buffers. */
 static int
-sort_range(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+as_longlong(PyObject *x, long long *value)
 {
-    /* The xs list is always partially sorted, with pivots partioning up the
-     * space, like in this picture:
-     *
-     * | ~~~~~ | ~~~ | ~~~~~ | ~~ | ~~~~~~~ |
-     *
-     * '|' indicates a pivot and '~~' indicates unsorted data.
-     *
-     * So we iterate through the regions bounding our data, and sort them.
-     */
+    PyObject *index = PyNumber_Index(x);
+    if (index == NULL)
+        return -1;
+    *value = PyLong_AsLongLong(index);
+    Py_DECREF(index);
+    return *value == -1 && PyErr_Occurred() ? -1 : 0;
+}
 
-    assert(0 <= start && start < stop && stop <= Py_SIZE(ls->xs));
+static int
+as_ulonglong(PyObject *x, unsigned long long *value)
+{
+    PyObject *index, *num;
 
-    if (sort_point(ls, start) < 0)
+    if ((index = PyNumber_Index(x)) == NULL)
         return -1;
-    if (sort_point(ls, stop) < 0)
+    num = PyNumber_Long(index);     /* Python 2 needs a long, not an int */
+    Py_DECREF(index);
+    if (num == NULL)
         return -1;
+    *value = PyLong_AsUnsignedLongLong(num);
+    Py_DECREF(num);
+    return *value == (unsigned long long)-1 && PyErr_Occurred() ? -1 : 0;
+}
 
-    PivotNode *current, *next;
-    bound_idx(start, ls->root, &current, &next);
-    if (current->idx == start)
-        next = next_pivot(current);
-
-    while (current->idx < stop) {
-        if (current->flags & SORTED_LEFT) {
-            assert(next->flags & SORTED_RIGHT);
-        }
-        else {
-            /* Since we are sorting the entire region, we don't need to keep
-             * track of pivots, and so we can use vanilla quicksort */
-            if (quick_sort(ls, current->idx + 1, next->idx) < 0) {
-                return -1;    
-            }
-            current->flags |= SORTED_LEFT;
-            next->flags |= SORTED_RIGHT;
-        }
+static int
+as_double(PyObject *x, double *value)
+{
+    *value = PyFloat_AsDouble(x);
+    return *value == -1.0 && PyErr_Occurred() ? -1 : 0;
+}
 
-        if (current->flags & SORTED_RIGHT) {
-            delete_node(current, &ls->root);
-        }
+/* Kahan's compensated addition of x to the sum s, whose lost low-order bits
+ * are -c */
+#define KAHAN_ADD(s, c, x) do {                                               \
+    double y_ = (x) - (c);                                                    \
+    double t_ = (s) + y_;                                                     \
+    (c) = (t_ - (s)) - y_;                                                    \
+    (s) = t_;                                                                 \
+} while (0)
+
+/* Returns the total of the n compensated sums s, whose lost bits are -c */
+static double
+kahan_total(const double *s, const double *c, int n)
+{
+    double total = 0.0, comp = 0.0;
+    int j;
 
-        current = next;
-        next = next_pivot(current);
+    for (j = 0; j < n; j++) {
+        KAHAN_ADD(total, comp, s[j]);
+        KAHAN_ADD(total, comp, -c[j]);
     }
+    return total;
+}
 
-    assert(current->flags & SORTED_RIGHT);
-    if (current->flags & SORTED_LEFT) {
-        delete_node(current, &ls->root);
-    }
+/* Integer types can be added up exactly, as *hi * 2^32 + *lo, where neither
+ * half can overflow for fewer than 2^31 items. The int_sum for floating point
+ * types returns 0 to say it can't. */
+#define NATIVE_INT_SUM_1(NAME, TYPE, WIDE)                                    \
+static int                                                                    \
+NAME##_int_sum(void *data, Py_ssize_t left, Py_ssize_t right,                 \
+               long long *hi, unsigned long long *lo)                         \
+{                                                                             \
+    const TYPE *xs = (const TYPE *)data;                                      \
+    long long h = 0;                                                          \
+    unsigned long long l = 0;                                                 \
+    WIDE x;                                                                   \
+    Py_ssize_t i;                                                             \
+                                                                              \
+    for (i = left; i < right; i++) {                                          \
+        x = xs[i];                                                            \
+        h += (long long)(x >> 32);                                            \
+        l += (unsigned long long)(x & 0xffffffffU);                           \
+    }                                                                         \
+    *hi = h;                                                                  \
+    *lo = l;                                                                  \
+    return 1;                                                                 \
+}
 
-    return 0;
+#define NATIVE_INT_SUM_0(NAME, TYPE, WIDE)                                    \
+static int                                                                    \
+NAME##_int_sum(void *data, Py_ssize_t left, Py_ssize_t right,                 \
+               long long *hi, unsigned long long *lo)                         \
+{                                                                             \
+    (void)data;                                                               \
+    (void)left;                                                               \
+    (void)right;                                                              \
+    (void)hi;                                                                 \
+    (void)lo;                                                                 \
+    return 0;                                                                 \
 }
 
-/* Returns the first index of item in the list, or -2 on error, or -1 if item
- * is not present. Places item in that first idx, but makes no guarantees
- * any duplicate versions of item will immediately follow. Eg, it's possible
- * calling find_item on some list with item = 1 will result in the following
- * list:
- * [0, 0, 0, 1, 2, 2, 1, 2, 1, 1, 2]
- */
-static Py_ssize_t find_item(LSObject *, PyObject *)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+/* NATIVE_TYPE instantiates everything needed for one C type, where BOX
+ * converts a TYPE to a new python object, and UNBOX converts a python object
+ * to a WIDE, which is range checked if it's an integer type */
+#define NATIVE_TYPE(NAME, TYPE, BOX, WIDE, UNBOX, IS_INT)                     \
+static PyObject *                                                             \
+NAME##_box(void *data, Py_ssize_t i)                                          \
+{                                                                             \
+    return BOX(((TYPE *)data)[i]);                                            \
+}                                                                             \
+                                                                              \
+static int                                                                    \
+NAME##_unbox(void *data, Py_ssize_t i, PyObject *x)                           \
+{                                                                             \
+    WIDE value;                                                               \
+    if (UNBOX(x, &value) < 0)                                                 \
+        return -1;                                                            \
+    if (IS_INT && (WIDE)(TYPE)value != value) {                               \
+        PyErr_SetString(PyExc_OverflowError,                                  \
+                        "value out of range for the buffer's type");          \
+        return -1;                                                            \
+    }                                                                         \
+    ((TYPE *)data)[i] = (TYPE)value;                                          \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+static int                                                                    \
+NAME##_eq(void *data, Py_ssize_t i, Py_ssize_t j)                             \
+{                                                                             \
+    return ((TYPE *)data)[i] == ((TYPE *)data)[j];                            \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+NAME##_swap(void *data, Py_ssize_t i, Py_ssize_t j)                           \
+{                                                                             \
+    TYPE tmp = ((TYPE *)data)[i];                                             \
+    ((TYPE *)data)[i] = ((TYPE *)data)[j];                                    \
+    ((TYPE *)data)[j] = tmp;                                                  \
+}                                                                             \
+                                                                              \
+/* Adds up x - shift and its square for the items x in [left, right), into   \
+ * sums[0] and sums[1], with compensation. The four independent lanes keep   \
+ * the additions from waiting on each other, and can share vector registers. \
+ */                                                                           \
+static void                                                                   \
+NAME##_moments(void *data, Py_ssize_t left, Py_ssize_t right, double shift,   \
+               double *sums)                                                  \
+{                                                                             \
+    const TYPE *xs = (const TYPE *)data;                                      \
+    double s[4] = {0, 0, 0, 0}, c[4] = {0, 0, 0, 0};                          \
+    double q[4] = {0, 0, 0, 0}, cq[4] = {0, 0, 0, 0};                         \
+    double d;                                                                 \
+    Py_ssize_t i;                                                             \
+    int j;                                                                    \
+                                                                              \
+    for (i = left; i + 4 <= right; i += 4) {                                  \
+        for (j = 0; j < 4; j++) {                                             \
+            d = (double)xs[i + j] - shift;                                    \
+            KAHAN_ADD(s[j], c[j], d);                                         \
+            KAHAN_ADD(q[j], cq[j], d * d);                                    \
+        }                                                                     \
+    }                                                                         \
+    for (j = 0; i < right; i++, j++) {                                        \
+        d = (double)xs[i] - shift;                                            \
+        KAHAN_ADD(s[j], c[j], d);                                             \
+        KAHAN_ADD(q[j], cq[j], d * d);                                        \
+    }                                                                         \
+    sums[0] = kahan_total(s, c, 4);                                           \
+    sums[1] = kahan_total(q, cq, 4);                                          \
+}                                                                             \
+                                                                              \
+NATIVE_INT_SUM_##IS_INT(NAME, TYPE, WIDE)                                     \
+                                                                              \
+NATIVE_KERNELS(NAME##_asc, TYPE, ASC_LT)                                      \
+NATIVE_KERNELS(NAME##_desc, TYPE, DESC_LT)
+
+NATIVE_TYPE(schar, signed char, PyInt_FromLong,
+            long long, as_longlong, 1)
+NATIVE_TYPE(uchar, unsigned char, PyInt_FromLong,
+            unsigned long long, as_ulonglong, 1)
+NATIVE_TYPE(short, short, PyInt_FromLong,
+            long long, as_longlong, 1)
+NATIVE_TYPE(ushort, unsigned short, PyInt_FromLong,
+            unsigned long long, as_ulonglong, 1)
+NATIVE_TYPE(int, int, PyInt_FromLong,
+            long long, as_longlong, 1)
+NATIVE_TYPE(uint, unsigned int, PyLong_FromUnsignedLong,
+            unsigned long long, as_ulonglong, 1)
+NATIVE_TYPE(long, long, PyInt_FromLong,
+            long long, as_longlong, 1)
+NATIVE_TYPE(ulong, unsigned long, PyLong_FromUnsignedLong,
+            unsigned long long, as_ulonglong, 1)
+NATIVE_TYPE(longlong, long long, PyLong_FromLongLong,
+            long long, as_longlong, 1)
+NATIVE_TYPE(ulonglong, unsigned long long, PyLong_FromUnsignedLongLong,
+            unsigned long long, as_ulonglong, 1)
+NATIVE_TYPE(float, float, PyFloat_FromDouble,
+            double, as_double, 0)
+NATIVE_TYPE(double, double, PyFloat_FromDouble,
+            double, as_double, 0)
+
+#define NATIVE_OPS(FORMAT, NAME, TYPE)                                        \
+    {FORMAT, sizeof(TYPE), NAME##_box, NAME##_unbox, NAME##_asc_partition,    \
+     NAME##_asc_insertion_sort, NAME##_eq, NAME##_swap,                       \
+     NAME##_asc_partition3, NAME##_asc_heap_sort, NAME##_asc_split,           \
+     NAME##_moments, NAME##_int_sum},                                         \
+    {FORMAT, sizeof(TYPE), NAME##_box, NAME##_unbox, NAME##_desc_partition,   \
+     NAME##_desc_insertion_sort, NAME##_eq, NAME##_swap,                      \
+     NAME##_desc_partition3, NAME##_desc_heap_sort, NAME##_desc_split,        \
+     NAME##_moments, NAME##_int_sum}
+
+/* Ascending and descending kernels for each supported format, in pairs. The
+ * partition kernels are replaced by vectorized ones in simd_init(.) if the CPU
+ * supports them. */
+static NativeOps native_ops[] = {
+    NATIVE_OPS('b', schar, signed char),
+    NATIVE_OPS('B', uchar, unsigned char),
+    NATIVE_OPS('h', short, short),
+    NATIVE_OPS('H', ushort, unsigned short),
+    NATIVE_OPS('i', int, int),
+    NATIVE_OPS('I', uint, unsigned int),
+    NATIVE_OPS('l', long, long),
+    NATIVE_OPS('L', ulong, unsigned long),
+    NATIVE_OPS('q', longlong, long long),
+    NATIVE_OPS('Q', ulonglong, unsigned long long),
+    NATIVE_OPS('f', float, float),
+    NATIVE_OPS('d', double, double),
+};
 
-static Py_ssize_t
-find_item(LSObject *ls, PyObject *item)
+/* Vectorized partition kernels for 32 and 64 bit numbers, using AVX2 or
+ * AVX-512 when the CPU supports them at runtime.
+ *
+ * They partition in place, like this: one vector is loaded from each end of
+ * the range and set aside, which leaves room to write. Then vectors are read
+ * from whichever end has less room left, and each one is split into the lanes
+ * less than the pivot, which are written at the left write cursor, and the
+ * rest, which are written just before the right write cursor. AVX2 does the
+ * split by permuting the vector with a lookup table and storing all of it at
+ * both ends, letting the junk lanes be overwritten later; AVX-512 uses
+ * compress-stores. The tail that doesn't fill a vector is done one element at
+ * a time, and finally the two vectors that were set aside are written. */
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) ||     \
+     (defined(__GNUC__) && (__GNUC__ > 4 ||                                   \
+                            (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define HAVE_SIMD_KERNELS
+#endif
+
+#ifdef HAVE_SIMD_KERNELS
+#include <immintrin.h>
+#include <limits.h>
+
+/* lut64[mask] and lut32[mask] hold the 32-bit lane permutations that move the
+ * 64 and 32 bit lanes set in mask to the front, in order. Filled by
+ * simd_init */
+static unsigned char lut64[16][8];
+static unsigned char lut32[256][8];
+
+#define SIMD_PARTITION(NAME, SCALAR, LT, TARGET, TYPE, W, VT, LOAD, SETUP,    \
+                       STORE, MASK)                                           \
+__attribute__((target(TARGET)))                                               \
+static Py_ssize_t                                                             \
+NAME(void *data, Py_ssize_t left, Py_ssize_t right, unsigned long long *rng)  \
+{                                                                             \
+    TYPE *xs = (TYPE *)data;                                                  \
+    TYPE pivot, tail[W];                                                      \
+    Py_ssize_t piv_idx, rl, rr, wl, wr, nless, i, ntail;                      \
+    VT vl, vr, v;                                                             \
+                                                                              \
+    if (right - left <= 2 * W + 1)                                            \
+        return SCALAR##_partition(data, left, right, rng);                    \
+                                                                              \
+    piv_idx = SCALAR##_pick_pivot(xs, left, right, rng);                      \
+    pivot = xs[piv_idx];                                                      \
+    xs[piv_idx] = xs[left];                                                   \
+    xs[left] = pivot;                                                         \
+    SETUP;                                                                    \
+                                                                              \
+    /* Partition [left + 1, right). Unread data is in [rl, rr). */            \
+    wl = left + 1;                                                            \
+    wr = right;                                                               \
+    vl = LOAD(xs + wl);                                                       \
+    vr = LOAD(xs + wr - W);                                                   \
+    rl = wl + W;                                                              \
+    rr = wr - W;                                                              \
+    while (rr - rl >= W) {                                                    \
+        if (rl - wl <= wr - rr) {                                             \
+            v = LOAD(xs + rl);                                                \
+            rl += W;                                                          \
+        }                                                                     \
+        else {                                                                \
+            rr -= W;                                                          \
+            v = LOAD(xs + rr);                                                \
+        }                                                                     \
+        STORE(v, MASK(v));                                                    \
+    }                                                                         \
+                                                                              \
+    ntail = rr - rl;                                                          \
+    memcpy(tail, xs + rl, ntail * sizeof(TYPE));                              \
+    for (i = 0; i < ntail; i++) {                                             \
+        if (LT(tail[i], pivot))                                               \
+            xs[wl++] = tail[i];                                               \
+        else                                                                  \
+            xs[--wr] = tail[i];                                               \
+    }                                                                         \
+    STORE(vl, MASK(vl));                                                      \
+    STORE(vr, MASK(vr));                                                      \
+    assert(wl == wr);                                                         \
+                                                                              \
+    /* wl - 1 is the last element less than the pivot, or left itself */      \
+    wl--;                                                                     \
+    xs[left] = xs[wl];                                                        \
+    xs[wl] = pivot;                                                           \
+    return wl;                                                                \
+}
+
+/* Instantiates the ascending and descending kernels for one type and ISA */
+#define SIMD_KERNELS(SCALAR, ISA, TARGET, TYPE, W, VT, LOAD, SETUP, STORE,    \
+                     MASK_ASC, MASK_DESC)                                     \
+    SIMD_PARTITION(SCALAR##_asc_##ISA##_partition, SCALAR##_asc, ASC_LT,      \
+                   TARGET, TYPE, W, VT, LOAD, SETUP, STORE, MASK_ASC)         \
+    SIMD_PARTITION(SCALAR##_desc_##ISA##_partition, SCALAR##_desc, DESC_LT,   \
+                   TARGET, TYPE, W, VT, LOAD, SETUP, STORE, MASK_DESC)
+
+/* AVX2 */
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+
+#define AVX2_STORE(V, MASK, LUT, W) do {                                      \
+        int mask_ = (MASK);                                                   \
+        __m256i perm_ = _mm256_cvtepu8_epi32(                                 \
+                _mm_loadl_epi64((const __m128i *)LUT[mask_]));                \
+        __m256i vp_ = _mm256_permutevar8x32_epi32(V, perm_);                  \
+        _mm256_storeu_si256((__m256i *)(xs + wl), vp_);                       \
+        _mm256_storeu_si256((__m256i *)(xs + wr - W), vp_);                   \
+        nless = __builtin_popcount(mask_);                                    \
+        wl += nless;                                                          \
+        wr -= W - nless;                                                      \
+    } while (0)
+#define AVX2_STORE64(V, MASK) AVX2_STORE(V, MASK, lut64, 4)
+#define AVX2_STORE32(V, MASK) AVX2_STORE(V, MASK, lut32, 8)
+
+#define AVX2_PD_SETUP __m256d pv = _mm256_set1_pd(pivot)
+#define AVX2_PD_LT(v) _mm256_movemask_pd(                                     \
+        _mm256_cmp_pd(_mm256_castsi256_pd(v), pv, _CMP_LT_OQ))
+#define AVX2_PD_GT(v) _mm256_movemask_pd(                                     \
+        _mm256_cmp_pd(_mm256_castsi256_pd(v), pv, _CMP_GT_OQ))
+
+#define AVX2_PS_SETUP __m256 pv = _mm256_set1_ps(pivot)
+#define AVX2_PS_LT(v) _mm256_movemask_ps(                                     \
+        _mm256_cmp_ps(_mm256_castsi256_ps(v), pv, _CMP_LT_OQ))
+#define AVX2_PS_GT(v) _mm256_movemask_ps(                                     \
+        _mm256_cmp_ps(_mm256_castsi256_ps(v), pv, _CMP_GT_OQ))
+
+/* Unsigned numbers are compared as signed ones after flipping the sign bit */
+#define AVX2_EPI64_SETUP __m256i pv = _mm256_set1_epi64x((long long)pivot);   \
+                         __m256i bias = _mm256_setzero_si256()
+#define AVX2_EPU64_SETUP __m256i bias = _mm256_set1_epi64x(LLONG_MIN);        \
+                         __m256i pv = _mm256_xor_si256(                       \
+                             _mm256_set1_epi64x((long long)pivot), bias)
+#define AVX2_EPI64_LT(v) _mm256_movemask_pd(_mm256_castsi256_pd(              \
+        _mm256_cmpgt_epi64(pv, _mm256_xor_si256(v, bias))))
+#define AVX2_EPI64_GT(v) _mm256_movemask_pd(_mm256_castsi256_pd(              \
+        _mm256_cmpgt_epi64(_mm256_xor_si256(v, bias), pv)))
+#define AVX2_EPU64_LT AVX2_EPI64_LT
+#define AVX2_EPU64_GT AVX2_EPI64_GT
+
+#define AVX2_EPI32_SETUP __m256i pv = _mm256_set1_epi32((int)pivot);          \
+                         __m256i bias = _mm256_setzero_si256()
+#define AVX2_EPU32_SETUP __m256i bias = _mm256_set1_epi32(INT_MIN);           \
+                         __m256i pv = _mm256_xor_si256(                       \
+                             _mm256_set1_epi32((int)pivot), bias)
+#define AVX2_EPI32_LT(v) _mm256_movemask_ps(_mm256_castsi256_ps(              \
+        _mm256_cmpgt_epi32(pv, _mm256_xor_si256(v, bias))))
+#define AVX2_EPI32_GT(v) _mm256_movemask_ps(_mm256_castsi256_ps(              \
+        _mm256_cmpgt_epi32(_mm256_xor_si256(v, bias), pv)))
+#define AVX2_EPU32_LT AVX2_EPI32_LT
+#define AVX2_EPU32_GT AVX2_EPI32_GT
+
+#define AVX2_KERNELS(SCALAR, TYPE, W, SETUP, STORE, MASK)                     \
+    SIMD_KERNELS(SCALAR, avx2, "avx2", TYPE, W, __m256i, AVX2_LOAD, SETUP,    \
+                 STORE, MASK##_LT, MASK##_GT)
+
+/* AVX-512 */
+#define AVX512_LOAD(p) _mm512_loadu_si512((const void *)(p))
+
+#define AVX512_STORE(V, MASK, COMPRESS, W) do {                               \
+        unsigned int mask_ = (MASK);                                          \
+        nless = __builtin_popcount(mask_);                                    \
+        COMPRESS((void *)(xs + wl), mask_, V);                                \
+        COMPRESS((void *)(xs + wr - (W - nless)), ~mask_, V);                 \
+        wl += nless;                                                          \
+        wr -= W - nless;                                                      \
+    } while (0)
+#define AVX512_STORE64(V, MASK)                                               \
+        AVX512_STORE(V, MASK, _mm512_mask_compressstoreu_epi64, 8)
+#define AVX512_STORE32(V, MASK)                                               \
+        AVX512_STORE(V, MASK, _mm512_mask_compressstoreu_epi32, 16)
+
+#define AVX512_PD_SETUP __m512d pv = _mm512_set1_pd(pivot)
+#define AVX512_PD_LT(v) _mm512_cmp_pd_mask(_mm512_castsi512_pd(v), pv,        \
+                                           _CMP_LT_OQ)
+#define AVX512_PD_GT(v) _mm512_cmp_pd_mask(_mm512_castsi512_pd(v), pv,        \
+                                           _CMP_GT_OQ)
+
+#define AVX512_PS_SETUP __m512 pv = _mm512_set1_ps(pivot)
+#define AVX512_PS_LT(v) _mm512_cmp_ps_mask(_mm512_castsi512_ps(v), pv,        \
+                                           _CMP_LT_OQ)
+#define AVX512_PS_GT(v) _mm512_cmp_ps_mask(_mm512_castsi512_ps(v), pv,        \
+                                           _CMP_GT_OQ)
+
+#define AVX512_EPI64_SETUP __m512i pv = _mm512_set1_epi64((long long)pivot)
+#define AVX512_EPI64_LT(v) _mm512_cmplt_epi64_mask(v, pv)
+#define AVX512_EPI64_GT(v) _mm512_cmpgt_epi64_mask(v, pv)
+#define AVX512_EPU64_SETUP AVX512_EPI64_SETUP
+#define AVX512_EPU64_LT(v) _mm512_cmplt_epu64_mask(v, pv)
+#define AVX512_EPU64_GT(v) _mm512_cmpgt_epu64_mask(v, pv)
+
+#define AVX512_EPI32_SETUP __m512i pv = _mm512_set1_epi32((int)pivot)
+#define AVX512_EPI32_LT(v) _mm512_cmplt_epi32_mask(v, pv)
+#define AVX512_EPI32_GT(v) _mm512_cmpgt_epi32_mask(v, pv)
+#define AVX512_EPU32_SETUP AVX512_EPI32_SETUP
+#define AVX512_EPU32_LT(v) _mm512_cmplt_epu32_mask(v, pv)
+#define AVX512_EPU32_GT(v) _mm512_cmpgt_epu32_mask(v, pv)
+
+#define AVX512_KERNELS(SCALAR, TYPE, W, SETUP, STORE, MASK)                   \
+    SIMD_KERNELS(SCALAR, avx512, "avx512f", TYPE, W, __m512i, AVX512_LOAD,    \
+                 SETUP, STORE, MASK##_LT, MASK##_GT)
+
+/* Instantiates both ISAs for a type, where CLASS is one of the mask families
+ * above and BITS is its lane width */
+#define X86_KERNELS(SCALAR, TYPE, CLASS, BITS)                                \
+    AVX2_KERNELS(SCALAR, TYPE, 256 / BITS, AVX2_##CLASS##_SETUP,              \
+                 AVX2_STORE##BITS, AVX2_##CLASS)                              \
+    AVX512_KERNELS(SCALAR, TYPE, 512 / BITS, AVX512_##CLASS##_SETUP,          \
+                   AVX512_STORE##BITS, AVX512_##CLASS)
+
+X86_KERNELS(int, int, EPI32, 32)
+X86_KERNELS(uint, unsigned int, EPU32, 32)
+#if LONG_MAX == LLONG_MAX
+X86_KERNELS(long, long, EPI64, 64)
+X86_KERNELS(ulong, unsigned long, EPU64, 64)
+#endif
+X86_KERNELS(longlong, long long, EPI64, 64)
+X86_KERNELS(ulonglong, unsigned long long, EPU64, 64)
+X86_KERNELS(float, float, PS, 32)
+X86_KERNELS(double, double, PD, 64)
+
+typedef struct {
+    char format;
+    Py_ssize_t (*partition[4])(void *, Py_ssize_t, Py_ssize_t,
+                               unsigned long long *);
+} SimdPartition;
+
+#define SIMD_PARTITIONS(FORMAT, SCALAR)                                       \
+    {FORMAT, {SCALAR##_asc_avx2_partition, SCALAR##_desc_avx2_partition,      \
+              SCALAR##_asc_avx512_partition, SCALAR##_desc_avx512_partition}}
+
+static const SimdPartition simd_partitions[] = {
+    SIMD_PARTITIONS('i', int),
+    SIMD_PARTITIONS('I', uint),
+#if LONG_MAX == LLONG_MAX
+    SIMD_PARTITIONS('l', long),
+    SIMD_PARTITIONS('L', ulong),
+#endif
+    SIMD_PARTITIONS('q', longlong),
+    SIMD_PARTITIONS('Q', ulonglong),
+    SIMD_PARTITIONS('f', float),
+    SIMD_PARTITIONS('d', double),
+};
+
+/* Fills the lookup table for lanes of the given width in 32-bit units */
+static void
+fill_lut(unsigned char (*lut)[8], int lanes, int width)
 {
-    PivotNode *left = NULL;
-    PivotNode *right = NULL;
-    PivotNode *middle;
-    PivotNode *current = ls->root;
-    int ltflag;
-    Py_ssize_t xs_len = Py_SIZE(ls->xs);
-    Py_ssize_t left_idx, right_idx;
+    int mask, lane, j, out;
+    for (mask = 0; mask < (1 << lanes); mask++) {
+        out = 0;
+        for (lane = 0; lane < lanes; lane++)
+            if (mask & (1 << lane))
+                for (j = 0; j < width; j++)
+                    lut[mask][out++] = lane * width + j;
+        for (lane = 0; lane < lanes; lane++)
+            if (!(mask & (1 << lane)))
+                for (j = 0; j < width; j++)
+                    lut[mask][out++] = lane * width + j;
+    }
+}
+#endif
 
-    while (current != NULL) {
-        if (current->idx == -1) {
-            left = current;
-            current = current->right;
-        }
-        else if (current->idx == xs_len) {
-            right = current;
-            current = current->left;
-        }
-        else {
-            IFLT(ls->xs->ob_item[current->idx], item) {
-                left = current;
-                current = current->right;
-            }
-            else {
-                right = current;
-                current = current->left;
+/* Installs the fastest partition kernels the CPU supports. The environment
+ * variable LAZYSORTED_SIMD can be set to "avx2" or "none" to limit them, which
+ * is mostly useful for testing. */
+static void
+simd_init(void)
+{
+#ifdef HAVE_SIMD_KERNELS
+    const char *limit = getenv("LAZYSORTED_SIMD");
+    size_t i, j;
+    int isa;
+
+    fill_lut(lut64, 4, 2);
+    fill_lut(lut32, 8, 1);
+
+    __builtin_cpu_init();
+    if (limit != NULL && strcmp(limit, "none") == 0)
+        return;
+    else if (__builtin_cpu_supports("avx512f") &&
+             (limit == NULL || strcmp(limit, "avx2") != 0))
+        isa = 2;
+    else if (__builtin_cpu_supports("avx2"))
+        isa = 0;
+    else
+        return;
+
+    for (i = 0; i < sizeof(native_ops) / sizeof(NativeOps); i += 2) {
+        for (j = 0; j < sizeof(simd_partitions) / sizeof(SimdPartition); j++) {
+            if (simd_partitions[j].format == native_ops[i].format) {
+                native_ops[i].partition = simd_partitions[j].partition[isa];
+                native_ops[i + 1].partition =
+                    simd_partitions[j].partition[isa + 1];
             }
         }
     }
+#endif
+}
 
-    if (left->flags & SORTED_LEFT) {
-        assert(right->flags & SORTED_RIGHT);
-        left_idx = left->idx + 1;
-        right_idx = right->idx == xs_len ? xs_len : right->idx + 1;
-    }
-    else {
-        Py_ssize_t piv_idx;
-        while (left->idx + 1 + SORT_THRESH <= right->idx) {
-            if ((piv_idx = partition(ls, left->idx + 1, right->idx)) < 0) {
+#ifdef HAVE_NEWBUFFER
+/* If sequence exports a one dimensional, C-contiguous buffer of a supported
+ * native type, with any extra buffer flags, gets it into view, which must then
+ * be released, and returns its kernels for the given direction. Returns NULL
+ * if it doesn't, in which case it should be boxed into a list instead. */
+static const NativeOps *
+native_view(PyObject *sequence, Py_buffer *view, int flags, int reverse)
+{
+    const char *format;
+    size_t i;
+
+    /* Strings iterate as characters rather than as numbers. So do
+     * memoryviews in python2. */
+    if (!PyObject_CheckBuffer(sequence) || PyBytes_Check(sequence) ||
+        PyByteArray_Check(sequence) || PyUnicode_Check(sequence))
+        return NULL;
+#if PY_MAJOR_VERSION < 3
+    if (PyMemoryView_Check(sequence))
+        return NULL;
+#endif
+
+    if (PyObject_GetBuffer(sequence, view,
+                           flags | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    format = view->format != NULL ? view->format : "B";
+    if (format[0] == '@')
+        format++;
+
+    if (view->ndim == 1 && format[0] != '\0' && format[1] == '\0') {
+        for (i = 0; i < sizeof(native_ops) / sizeof(NativeOps); i += 2) {
+            if (native_ops[i].format == format[0] &&
+                native_ops[i].itemsize == view->itemsize)
+                return &native_ops[i + (reverse ? 1 : 0)];
+        }
+    }
+    PyBuffer_Release(view);
+    return NULL;
+}
+
+/* If sequence is a buffer that native_view takes, copies its values into
+ * ls->data and returns 1. Returns 0 if the sequence should be boxed into a
+ * list instead, or -1 on error. */
+static int
+native_init(LSObject *ls, PyObject *sequence)
+{
+    Py_buffer view;
+
+    if ((ls->ops = native_view(sequence, &view, 0, ls->reverse)) == NULL)
+        return 0;
+
+    ls->data = PyMem_Malloc(view.len > 0 ? view.len : 1);
+    if (ls->data == NULL) {
+        ls->ops = NULL;
+        PyBuffer_Release(&view);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(ls->data, view.buf, view.len);
+    ls->data_len = view.len / view.itemsize;
+
+    PyBuffer_Release(&view);
+    return 1;
+}
+#endif
+
+/* Threads. Unboxed data never needs python, so the kernels run on big regions
+ * of it with the GIL released, and the biggest regions are split between
+ * threads. The threads are started for each region and joined before it's
+ * done, so none of them outlive the call that needed them. */
+
+static int n_threads = 1;       /* The most threads to use at once */
+
+/* Sets n_threads from the number of cores, or from LAZYSORTED_THREADS */
+static void
+threads_init(void)
+{
+#ifdef HAVE_PTHREADS
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("LAZYSORTED_THREADS");
+
+    if (env != NULL && atol(env) > 0)
+        n = atol(env);
+    n_threads = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : (int)n;
+#endif
+}
+
+/* Returns the number of threads to split n unboxed items between */
+static int
+threads_for(Py_ssize_t n)
+{
+    Py_ssize_t per_thread = PARALLEL_THRESH / 8 > 0 ? PARALLEL_THRESH / 8 : 1;
+
+    if (n < PARALLEL_THRESH || n / per_thread < 2)
+        return 1;
+    return n / per_thread < n_threads ? (int)(n / per_thread) : n_threads;
+}
+
+/* Runs func(arg) on nthreads threads at once, counting this one, and returns
+ * once they've all finished. func takes its work from arg until there's none
+ * left, so it's fine if some of the threads can't be started. */
+static void
+run_threads(int nthreads, void *(*func)(void *), void *arg)
+{
+#ifdef HAVE_PTHREADS
+    pthread_t threads[MAX_THREADS];
+    int i, started = 0;
+
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, func, arg) == 0)
+            started++;
+    }
+    func(arg);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+#else
+    func(arg);
+#endif
+}
+
+/* Each LazySorted has a lock, which the thread querying or changing it holds
+ * throughout, so threads take turns at it. Without it, a thread could find ls
+ * half partitioned while another is in a comparison or key function that let
+ * go of the GIL, or in a kernel that runs without it. Waiting for the lock
+ * releases the GIL. The lock covers the whole object rather than each gap
+ * between pivots, so threads partitioning different gaps still take turns,
+ * and only the reads that CAN_READ allows skip it. */
+
+static unsigned long
+thread_id(void)
+{
+#ifdef HAVE_THREADS
+    return (unsigned long)PyThread_get_thread_ident();
+#else
+    return 1;
+#endif
+}
+
+/* Takes ls for the current thread, until the matching ls_unlock */
+static void
+ls_lock(LSObject *ls)
+{
+#ifdef HAVE_THREADS
+    unsigned long me = thread_id();
+
+    if (ls->lock != NULL && ls->owner != me) {
+        if (!PyThread_acquire_lock(ls->lock, NOWAIT_LOCK)) {
+            Py_BEGIN_ALLOW_THREADS
+            PyThread_acquire_lock(ls->lock, WAIT_LOCK);
+            Py_END_ALLOW_THREADS
+        }
+        ls->owner = me;
+    }
+#endif
+    ls->depth++;
+}
+
+/* Lets go of ls, and of the nodes made for its pivots once nothing is using
+ * them */
+static void
+ls_unlock(LSObject *ls)
+{
+    if (--ls->depth > 0)
+        return;
+    if (ls->bits.words != NULL)
+        bits_flush(ls);
+#ifdef HAVE_THREADS
+    if (ls->lock != NULL) {
+        ls->owner = 0;
+        PyThread_release_lock(ls->lock);
+    }
+#endif
+}
+
+/* Takes ls like ls_lock, for a query or change. The pivots and items are in
+ * flux while the thread holding ls runs python code from the middle of one,
+ * like a comparison, so that code can't start another, and nothing can use a
+ * caller's list that changed under us. Sets an error, lets go and returns -1
+ * if so, or returns 0. */
+static int check_shared(LSObject *);
+static int ls_enter(LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+ls_enter(LSObject *ls)
+{
+    ls_lock(ls);
+    if (ls->depth > 1) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted used during one of its comparisons");
+        ls_unlock(ls);
+        return -1;
+    }
+    if (check_shared(ls) < 0) {
+        ls_unlock(ls);
+        return -1;
+    }
+    return 0;
+}
+
+/* With the GIL, nobody can take ls until the thread reading it lets go of the
+ * GIL, so while nobody holds it, reading items that are already in place,
+ * which doesn't let go, needn't take the lock. Free-threaded builds always
+ * take it, and so do reads of a caller's list sorted in place, which the
+ * holder checks hasn't changed. */
+#ifdef Py_GIL_DISABLED
+#define CAN_READ(ls)    0
+#else
+#define CAN_READ(ls)    ((ls)->depth == 0 && (ls)->shared_len < 0)
+#endif
+
+/* Runs the statement CODE, which mustn't touch python, without the GIL.
+ * Kernels running without it work on copies of ls with worker set, so they
+ * don't try to release it again. */
+#define NOGIL(ls, CODE) do {                                                  \
+    Py_BEGIN_ALLOW_THREADS                                                    \
+    CODE;                                                                     \
+    Py_END_ALLOW_THREADS                                                      \
+} while (0)
+
+/* Defines NAME_locked, a method that runs NAME with the LazySorted LS locked,
+ * or returns ERR if ls_enter refuses it. PARAMS is NAME's parenthesized
+ * parameter list, and ARGS the list of their names. */
+#define LOCKED_OR(ERR, TYPE, NAME, LS, PARAMS, ARGS)                          \
+static TYPE                                                                   \
+NAME##_locked PARAMS                                                          \
+{                                                                             \
+    TYPE res;                                                                 \
+                                                                              \
+    if (ls_enter(LS) < 0)                                                     \
+        return ERR;                                                           \
+    res = NAME ARGS;                                                          \
+    ls_unlock(LS);                                                            \
+    return res;                                                               \
+}
+
+#define LOCKED(TYPE, NAME, LS, PARAMS, ARGS)                                  \
+    LOCKED_OR(NULL, TYPE, NAME, LS, PARAMS, ARGS)
+
+#ifdef HAVE_PTHREADS
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#else
+#define MUTEX_LOCK(m)
+#define MUTEX_UNLOCK(m)
+#endif
+
+#define MAX_CHUNKS (4 * MAX_THREADS)
+#define SPLIT_SAMPLE 63
+
+/* A region of unboxed data being split between threads around the pivot at
+ * piv_idx, just before it. First the threads take turns at chunks of the
+ * region, moving the items less than the pivot to the front of each one. That
+ * leaves runs of items on the wrong side of mid, where the small items end
+ * overall, as many of them bigger as smaller, and the threads then take turns
+ * at parts of those to swap them across. */
+typedef struct {
+    const NativeOps     *ops;
+    char                *data;
+    Py_ssize_t          piv_idx;
+    int                 nchunks;
+    int                 next;           /* The next chunk or part to take */
+    Py_ssize_t          bounds[MAX_CHUNKS + 1]; /* Chunk c is [bounds[c],
+                                                 * bounds[c + 1]) */
+    Py_ssize_t          splits[MAX_CHUNKS];     /* And its big items start at
+                                                 * splits[c] */
+    Py_ssize_t          nmisplaced;     /* The items on each wrong side */
+    Py_ssize_t          big_start[MAX_CHUNKS];  /* Runs of big items */
+    Py_ssize_t          big_len[MAX_CHUNKS + 1];
+    Py_ssize_t          small_start[MAX_CHUNKS];/* Runs of small items */
+    Py_ssize_t          small_len[MAX_CHUNKS + 1];
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t     mutex;
+#endif
+} Split;
+
+/* Returns the next chunk or part of sp to work on, or -1 if they're taken */
+static int
+split_next(Split *sp)
+{
+    int c;
+
+    MUTEX_LOCK(&sp->mutex);
+    c = sp->next < sp->nchunks ? sp->next++ : -1;
+    MUTEX_UNLOCK(&sp->mutex);
+    return c;
+}
+
+static void *
+split_chunks(void *arg)
+{
+    Split *sp = (Split *)arg;
+    int c;
+
+    while ((c = split_next(sp)) >= 0) {
+        sp->splits[c] = sp->ops->split(sp->data, sp->bounds[c],
+                                       sp->bounds[c + 1], sp->piv_idx);
+    }
+    return NULL;
+}
+
+/* Finds the run in lens holding the item with the given ordinal, and the
+ * offset of the item in it */
+static void
+find_run(const Py_ssize_t *lens, Py_ssize_t ordinal, int *run,
+         Py_ssize_t *offset)
+{
+    int r = 0;
+
+    while (ordinal >= lens[r])
+        ordinal -= lens[r++];
+    *run = r;
+    *offset = ordinal;
+}
+
+static void
+swap_bytes(char *a, char *b, size_t n)
+{
+    char tmp[512];
+    size_t k;
+
+    while (n > 0) {
+        k = n < sizeof(tmp) ? n : sizeof(tmp);
+        memcpy(tmp, a, k);
+        memcpy(a, b, k);
+        memcpy(b, tmp, k);
+        a += k;
+        b += k;
+        n -= k;
+    }
+}
+
+static void *
+swap_misplaced(void *arg)
+{
+    Split *sp = (Split *)arg;
+    Py_ssize_t size = sp->ops->itemsize;
+    Py_ssize_t per_part = (sp->nmisplaced + sp->nchunks - 1) / sp->nchunks;
+    Py_ssize_t start, stop, big_off, small_off, count;
+    int p, big, small;
+
+    while ((p = split_next(sp)) >= 0) {
+        start = per_part * p;
+        stop = start + per_part < sp->nmisplaced ? start + per_part
+                                                  : sp->nmisplaced;
+        if (start >= stop)
+            continue;
+        find_run(sp->big_len, start, &big, &big_off);
+        find_run(sp->small_len, start, &small, &small_off);
+        while (start < stop) {
+            count = stop - start;
+            if (sp->big_len[big] - big_off < count)
+                count = sp->big_len[big] - big_off;
+            if (sp->small_len[small] - small_off < count)
+                count = sp->small_len[small] - small_off;
+            swap_bytes(sp->data + (sp->big_start[big] + big_off) * size,
+                       sp->data + (sp->small_start[small] + small_off) * size,
+                       count * size);
+            start += count;
+            if ((big_off += count) == sp->big_len[big]) {
+                big++;
+                big_off = 0;
+            }
+            if ((small_off += count) == sp->small_len[small]) {
+                small++;
+                small_off = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Partitions the unboxed data between left and right as ops->partition does,
+ * but on nthreads threads, around the median of a random sample. Doesn't touch
+ * python, so it can run without the GIL. Returns the pivot index. */
+static Py_ssize_t
+split_parallel(LSObject *ls, Py_ssize_t left, Py_ssize_t right, int nthreads)
+{
+    const NativeOps *ops = ls->ops;
+    Py_ssize_t n = right - left;
+    Py_ssize_t sample = n < SPLIT_SAMPLE ? n : SPLIT_SAMPLE;
+    Py_ssize_t i, lo, hi, mid, step;
+    int c, nbig = 0, nsmall = 0;
+    Split sp;
+
+    for (i = 0; i < sample; i++)
+        ops->swap(ls->data, left + i, RANDOM_IDX(&ls->rng, left + i, right));
+    ops->insertion_sort(ls->data, left, left + sample);
+    ops->swap(ls->data, left, left + sample / 2);
+
+    sp.ops = ops;
+    sp.data = (char *)ls->data;
+    sp.piv_idx = left;
+    sp.nchunks = 4 * nthreads;
+    step = (n - 1) / sp.nchunks;
+    for (c = 0; c < sp.nchunks; c++)
+        sp.bounds[c] = left + 1 + step * c;
+    sp.bounds[sp.nchunks] = right;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&sp.mutex, NULL);
+#endif
+
+    sp.next = 0;
+    run_threads(nthreads, split_chunks, &sp);
+
+    mid = left + 1;
+    for (c = 0; c < sp.nchunks; c++)
+        mid += sp.splits[c] - sp.bounds[c];
+    sp.nmisplaced = 0;
+    for (c = 0; c < sp.nchunks; c++) {
+        lo = sp.splits[c];
+        hi = sp.bounds[c + 1] < mid ? sp.bounds[c + 1] : mid;
+        if (lo < hi) {
+            sp.big_start[nbig] = lo;
+            sp.big_len[nbig++] = hi - lo;
+            sp.nmisplaced += hi - lo;
+        }
+        lo = sp.bounds[c] > mid ? sp.bounds[c] : mid;
+        hi = sp.splits[c];
+        if (lo < hi) {
+            sp.small_start[nsmall] = lo;
+            sp.small_len[nsmall++] = hi - lo;
+        }
+    }
+    sp.big_len[nbig] = sp.small_len[nsmall] = 0;
+
+    if (sp.nmisplaced > 0) {
+        sp.next = 0;
+        run_threads(nthreads, swap_misplaced, &sp);
+    }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&sp.mutex);
+#endif
+
+    ops->swap(ls->data, left, mid - 1);
+    return mid - 1;
+}
+
+/* Adds the pivots before the first item and after the last, in a bitvector if
+ * there are enough items. Returns 0 on success or -1 on error. */
+static int init_pivots(LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+init_pivots(LSObject *ls)
+{
+    Py_ssize_t xs_len = LS_SIZE(ls);
+    PivotNode *first;
+
+    if (xs_len < BITS_THRESH) {
+        if (insert_pivot(-1, UNSORTED, &ls->root, ls->root, &ls->pool,
+                         &ls->rng) == NULL)
+            return -1;
+        if (insert_pivot(xs_len, UNSORTED, &ls->root, ls->root, &ls->pool,
+                         &ls->rng) == NULL)
+            return -1;
+        return 0;
+    }
+
+    if (bits_init(&ls->bits, xs_len) < 0)
+        return -1;
+    if ((first = add_pivot(ls, -1, NULL, NULL)) == NULL)
+        return -1;
+    if (add_pivot(ls, xs_len, first, NULL) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Frees the items of ls, their keys and the pivots, leaving it empty */
+static void
+clear_items(LSObject *self)
+{
+    if (self->keys != NULL) {
+        Py_ssize_t i, n = self->shared_len >= 0 ? self->shared_len :
+                                                  Py_SIZE(self->xs);
+        for (i = 0; i < n; i++) {
+            Py_XDECREF(self->keys[i]);
+        }
+        PyMem_Free(self->keys);
+        self->keys = NULL;
+    }
+    if (self->data != NULL) {
+        PyMem_Free(self->data);
+        self->data = NULL;
+    }
+    Py_CLEAR(self->xs);
+    PyMem_Free(self->perm);
+    self->perm = NULL;
+    PyMem_Free(self->where);
+    self->where = NULL;
+    bits_clear(&self->bits);
+    pool_clear(&self->pool);
+    self->root = NULL;
+}
+
+static void
+LS_dealloc(LSObject *self)
+{
+    clear_items(self);
+    Py_XDECREF(self->keyfunc);
+#ifdef HAVE_THREADS
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+#endif
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+newLSObject(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    LSObject *self;
+    PyListObject *xs;
+    PyObject *sequence = NULL;
+    PyObject *keyfunc = NULL;
+    PyObject *seed = NULL;
+    int reverse = 0;
+    int copy = 1;
+    int return_indices = 0;
+    unsigned long long seed_value;
+    static char *kwdlist[] = {"sequence", "key", "reverse", "seed", "copy",
+                              "return_indices", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OiOii:LazySorted",
+        kwdlist, &sequence, &keyfunc, &reverse, &seed, &copy,
+        &return_indices))
+        return NULL;
+
+    /* Sorting in place only makes sense for something we can sort */
+    if (!copy && !PyList_Check(sequence)) {
+        PyErr_SetString(PyExc_TypeError, "copy=False needs a list");
+        return NULL;
+    }
+    if (!copy && return_indices) {
+        PyErr_SetString(PyExc_TypeError,
+                        "copy=False can't be used with return_indices");
+        return NULL;
+    }
+
+    /* A seed makes the pivot choices, and so the timing, reproducible */
+    if (seed == NULL || seed == Py_None) {
+        seed_value = entropy + unseeded_count++;
+    }
+    else {
+        PyObject *index = PyNumber_Index(seed);
+        if (index == NULL)
+            return NULL;
+        seed_value = PyInt_AsUnsignedLongLongMask(index);
+        Py_DECREF(index);
+        if (seed_value == (unsigned long long)-1 && PyErr_Occurred())
+            return NULL;
+    }
+
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+
+    /* Since we sort lazily, we wouldn't discover that the key isn't
+     * callable until we actually attempted sorting. So let's try to help
+     * the user by failing fast if this is the case. */
+    if (keyfunc != NULL && !PyCallable_Check(keyfunc)) {
+        PyErr_SetString(PyExc_TypeError, "key must be callable");
+        return NULL;
+    }
+
+    self = (LSObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->xs = NULL;
+    self->perm = NULL;
+    self->where = NULL;
+    self->root = NULL;
+    self->pool.slabs = NULL;
+    self->pool.used = 0;
+    self->pool.free = NULL;
+    self->bits.words = NULL;
+    self->bits.table = NULL;
+    self->bits.n_table = 0;
+    self->bits.n_live = 0;
+    self->keys = NULL;
+    self->data = NULL;
+    self->data_len = 0;
+    self->ops = NULL;
+    self->keyfunc = NULL;
+    self->reverse = reverse ? 1 : 0;
+    self->rng = rng_seed(seed_value);
+    self->prepared = 0;
+    self->busy = 0;
+    self->version = 0;
+    self->exports = 0;
+    self->shared_len = -1;
+    self->shared_ok = 1;
+    self->shared_items = NULL;
+    self->lock = NULL;
+    self->owner = 0;
+    self->depth = 0;
+    self->worker = 0;
+#ifdef HAVE_THREADS
+    if ((self->lock = PyThread_allocate_lock()) == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+#endif
+
+    if (!copy) {
+        /* Partitioning the caller's list itself saves copying it */
+        Py_INCREF(sequence);
+        self->xs = (PyListObject *)sequence;
+        self->shared_len = Py_SIZE(sequence);
+        self->shared_items = self->xs->ob_item;
+    }
+#ifdef HAVE_NEWBUFFER
+    /* Numeric buffers are sorted unboxed, unless a key or the indices need
+     * the objects */
+    else if (keyfunc == NULL && !return_indices &&
+             native_init(self, sequence) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+#endif
+
+    if (self->ops == NULL && self->xs == NULL) {
+        PyObject *list_args = Py_BuildValue("(O)", sequence);
+        if (list_args == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        xs = (PyListObject *)PyList_Type.tp_new(&PyList_Type, list_args, NULL);
+        if (xs == NULL) {
+            Py_DECREF(list_args);
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->xs = xs;
+
+        if (PyList_Type.tp_init((PyObject *)xs, list_args, NULL)) {
+            Py_DECREF(list_args);
+            Py_DECREF(self);
+            return NULL;
+        }
+        Py_DECREF(list_args);
+    }
+
+    if (return_indices) {
+        /* The items and their keys stay where they are, and an array of
+         * their indices is partitioned instead, which moves half as much */
+        Py_ssize_t i, n = Py_SIZE(self->xs);
+        self->perm = (Py_ssize_t *)PyMem_Malloc((n > 0 ? n : 1) *
+                                                sizeof(Py_ssize_t));
+        if (self->perm == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+        for (i = 0; i < n; i++)
+            self->perm[i] = i;
+    }
+
+    if (init_pivots(self) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if (keyfunc != NULL) {
+        self->keyfunc = keyfunc;
+        Py_INCREF(self->keyfunc);
+
+        /* Keys are computed once, by prepare(.) on the first query, and then
+         * kept alongside their items for the life of the object */
+        Py_ssize_t n = Py_SIZE(self->xs);
+        self->keys = (PyObject **)PyMem_Malloc(n * sizeof(PyObject *));
+        if (self->keys == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+        memset(self->keys, 0, n * sizeof(PyObject *));
+    }
+
+    return (PyObject *)self;
+}
+
+/* Private helper functions for partial sorting */
+
+/* Comparison functions for each kind of key. The *_gt versions are used for
+ * reverse sorting. These macros are basically taken from list.c */
+
+static int
+generic_lt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    int busy_res;
+    return BUSY(ls, PyObject_RichCompareBool(x, y, Py_LT));
+}
+
+static int
+generic_gt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    int busy_res;
+    return BUSY(ls, PyObject_RichCompareBool(x, y, Py_GT));
+}
+
+static int
+float_lt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    (void)ls;
+    return PyFloat_AS_DOUBLE(x) < PyFloat_AS_DOUBLE(y);
+}
+
+static int
+float_gt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    (void)ls;
+    return PyFloat_AS_DOUBLE(x) > PyFloat_AS_DOUBLE(y);
+}
+
+#if PY_MAJOR_VERSION >= 3
+#define INT_AS_LONG(x) PyLong_AsLong(x)
+#else
+#define INT_AS_LONG(x) PyInt_AS_LONG(x)
+#endif
+
+static int
+int_lt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    (void)ls;
+    return INT_AS_LONG(x) < INT_AS_LONG(y);
+}
+
+static int
+int_gt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    (void)ls;
+    return INT_AS_LONG(x) > INT_AS_LONG(y);
+}
+
+#if PY_MAJOR_VERSION >= 3
+#define STR_DATA(x) ((const char *)PyUnicode_DATA(x))
+#define STR_SIZE(x) PyUnicode_GET_LENGTH(x)
+#else
+#define STR_DATA(x) PyString_AS_STRING(x)
+#define STR_SIZE(x) PyString_GET_SIZE(x)
+#endif
+
+static int
+str_lt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    (void)ls;
+    Py_ssize_t x_len = STR_SIZE(x);
+    Py_ssize_t y_len = STR_SIZE(y);
+    int res = memcmp(STR_DATA(x), STR_DATA(y), x_len < y_len ? x_len : y_len);
+    return res != 0 ? res < 0 : x_len < y_len;
+}
+
+static int
+str_gt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    return str_lt(y, x, ls);
+}
+
+/* Tuples are compared by finding the first unequal element, and then using
+ * elem_lt if it's the first element (the common case) */
+static int
+tuple_lt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    Py_ssize_t x_len = PyTuple_GET_SIZE(x);
+    Py_ssize_t y_len = PyTuple_GET_SIZE(y);
+    Py_ssize_t i;
+    int eq, busy_res;
+
+    for (i = 0; i < x_len && i < y_len; i++) {
+        eq = BUSY(ls, PyObject_RichCompareBool(PyTuple_GET_ITEM(x, i),
+                                               PyTuple_GET_ITEM(y, i), Py_EQ));
+        if (eq < 0)
+            return -1;
+        if (!eq)
+            break;
+    }
+
+    if (i >= x_len || i >= y_len)
+        return x_len < y_len;
+    if (i == 0)
+        return ls->elem_lt(PyTuple_GET_ITEM(x, 0), PyTuple_GET_ITEM(y, 0), ls);
+    return BUSY(ls, PyObject_RichCompareBool(PyTuple_GET_ITEM(x, i),
+                                             PyTuple_GET_ITEM(y, i), Py_LT));
+}
+
+static int
+tuple_gt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    return tuple_lt(y, x, ls);
+}
+
+/* Returns the KIND_* of a single key. Tuples are not examined further. */
+static int
+key_kind(PyObject *key)
+{
+    if (PyFloat_CheckExact(key)) {
+        return KIND_FLOAT;
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if (PyLong_CheckExact(key)) {
+        int overflow;
+        PyLong_AsLongAndOverflow(key, &overflow);
+        return overflow ? KIND_GENERIC : KIND_INT;
+    }
+#if PY_VERSION_HEX >= 0x03030000
+    else if (PyUnicode_CheckExact(key)) {
+#if PY_VERSION_HEX < 0x030C0000
+        if (!PyUnicode_IS_READY(key))
+            return KIND_GENERIC;
+#endif
+        return PyUnicode_KIND(key) == PyUnicode_1BYTE_KIND ? KIND_STR
+                                                           : KIND_GENERIC;
+    }
+#endif
+#else
+    else if (PyInt_CheckExact(key)) {
+        return KIND_INT;
+    }
+    else if (PyString_CheckExact(key)) {
+        return KIND_STR;
+    }
+#endif
+    else if (PyTuple_CheckExact(key) && PyTuple_GET_SIZE(key) > 0) {
+        return KIND_TUPLE;
+    }
+    return KIND_GENERIC;
+}
+
+/* Returns the KIND_* shared by all n keys, or KIND_GENERIC if they differ. If
+ * the keys are tuples, also sets *elem_kind to the kind shared by the
+ * key[0]'s */
+static int
+scan_kinds(PyObject **keys, Py_ssize_t n, int *elem_kind)
+{
+    Py_ssize_t i;
+    int kind;
+
+    *elem_kind = KIND_GENERIC;
+    if (n == 0)
+        return KIND_GENERIC;
+
+    kind = key_kind(keys[0]);
+    for (i = 1; i < n && kind != KIND_GENERIC; i++) {
+        if (key_kind(keys[i]) != kind)
+            kind = KIND_GENERIC;
+    }
+
+    if (kind == KIND_TUPLE) {
+        *elem_kind = key_kind(PyTuple_GET_ITEM(keys[0], 0));
+        for (i = 1; i < n && *elem_kind != KIND_GENERIC; i++) {
+            if (key_kind(PyTuple_GET_ITEM(keys[i], 0)) != *elem_kind)
+                *elem_kind = KIND_GENERIC;
+        }
+        /* Nested tuples go through the generic path */
+        if (*elem_kind == KIND_TUPLE)
+            *elem_kind = KIND_GENERIC;
+    }
+
+    return kind;
+}
+
+static const lessthanfunc lt_funcs[] = {generic_lt, float_lt, int_lt, str_lt,
+                                        tuple_lt};
+static const lessthanfunc gt_funcs[] = {generic_gt, float_gt, int_gt, str_gt,
+                                        tuple_gt};
+
+/* Returns 1 if key can be compared against the data with ls->lt, or 0 if it
+ * needs the generic comparison, (eg, a float probe in a list of ints) */
+static int
+key_fits(LSObject *ls, PyObject *key)
+{
+    if (ls->kind == KIND_GENERIC || key_kind(key) != ls->kind)
+        return ls->kind == KIND_GENERIC;
+    if (ls->kind == KIND_TUPLE && ls->elem_kind != KIND_GENERIC)
+        return key_kind(PyTuple_GET_ITEM(key, 0)) == ls->elem_kind;
+    return 1;
+}
+
+/* Makes ls compare its keys in a way that works for key too, which it's about
+ * to get. The generic comparison works for anything. */
+static void
+widen_kind(LSObject *ls, PyObject *key)
+{
+    if (key_fits(ls, key))
+        return;
+    if (ls->kind == KIND_TUPLE && key_kind(key) == KIND_TUPLE) {
+        ls->elem_kind = KIND_GENERIC;
+    }
+    else {
+        ls->kind = ls->elem_kind = KIND_GENERIC;
+        ls->lt = ls->reverse ? generic_gt : generic_lt;
+    }
+    ls->elem_lt = generic_lt;
+}
+
+/* Our pivots and keys are only good for the caller's list as we left it.
+ * Sets an error and returns -1 if its length or its array of items has
+ * changed, or returns 0. Items replaced or moved within the same array go
+ * unnoticed. */
+static int
+check_shared(LSObject *ls)
+{
+    if (ls->shared_len >= 0 && (Py_SIZE(ls->xs) != ls->shared_len ||
+                                ls->xs->ob_item != ls->shared_items ||
+                                !ls->shared_ok)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "list changed while LazySorted was sorting it");
+        return -1;
+    }
+    return 0;
+}
+
+/* Computes any keys that haven't been computed yet, and picks the comparison
+ * function by scanning them. This is done on the first query rather than in
+ * the constructor, since the first query touches every element anyway. Every
+ * query on a caller's list sorted in place comes here first, to check that
+ * it's still the list we left. Returns 0 on success and -1 on error. */
+static int prepare(LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+prepare(LSObject *ls)
+{
+    Py_ssize_t n = LS_SIZE(ls);
+    Py_ssize_t i;
+    PyObject *item, *busy_res;
+
+    if (check_shared(ls) < 0)
+        return -1;
+    if (ls->prepared)
+        return 0;
+
+    /* Unboxed data is compared by its kernels. Probes of it get boxed. */
+    if (ls->ops != NULL) {
+        ls->kind = ls->elem_kind = KIND_GENERIC;
+        ls->lt = ls->reverse ? generic_gt : generic_lt;
+        ls->elem_lt = generic_lt;
+        ls->prepared = 1;
+        return 0;
+    }
+
+    if (ls->keys != NULL) {
+        for (i = 0; i < n; i++) {
+            if (ls->keys[i] == NULL) {
+                item = ls->xs->ob_item[i];      /* BUSY may hide xs */
+                ls->keys[i] = BUSY(ls, PyObject_CallFunctionObjArgs(
+                                   ls->keyfunc, item, NULL));
+                if (ls->keys[i] == NULL)
+                    return -1;
+            }
+        }
+    }
+
+    ls->kind = scan_kinds(LS_KEYS(ls), n, &ls->elem_kind);
+    ls->lt = ls->reverse ? gt_funcs[ls->kind] : lt_funcs[ls->kind];
+    ls->elem_lt = lt_funcs[ls->elem_kind];
+    ls->prepared = 1;
+    return 0;
+}
+
+/* Returns 1 if the key at index i is less than the probe key according to lt,
+ * 0 if not, and -1 on error. Unboxed data is boxed for the comparison. */
+static int
+key_lt_probe(LSObject *ls, Py_ssize_t i, PyObject *probe, lessthanfunc lt)
+{
+    if (ls->ops == NULL)
+        return lt(LS_KEY(ls, i), probe, ls);
+
+    PyObject *boxed = ls->ops->box(ls->data, i);
+    if (boxed == NULL)
+        return -1;
+    int res = lt(boxed, probe, ls);
+    Py_DECREF(boxed);
+    return res;
+}
+
+/* Returns 1 if the probe key is less than the key at index i according to lt,
+ * 0 if not, and -1 on error. */
+static int
+probe_lt_key(LSObject *ls, PyObject *probe, Py_ssize_t i, lessthanfunc lt)
+{
+    if (ls->ops == NULL)
+        return lt(probe, LS_KEY(ls, i), ls);
+
+    PyObject *boxed = ls->ops->box(ls->data, i);
+    if (boxed == NULL)
+        return -1;
+    int res = lt(probe, boxed, ls);
+    Py_DECREF(boxed);
+    return res;
+}
+
+#define PREPARE(ls) if ((!(ls)->prepared || (ls)->shared_len >= 0) &&        \
+                         prepare(ls) < 0)
+
+#define IFLT_BY(LT, X, Y) if ((ltflag = LT(X, Y, ls)) < 0) goto fail;  \
+            if(ltflag)
+
+#define IFLT(X, Y) IFLT_BY(ls->lt, X, Y)
+
+/* Swaps the items at indices i and j, along with their keys if they're
+ * separate, or just their indices if ls sorts indices, noting where they went
+ * if it's a window. Expects ls, ob_item, keys, perm, and tmp to be in scope.
+ * N.B: No semicolon at the end, so that you can include one yourself */
+#define SWAP(i, j) do {  \
+                       if (perm != NULL) {  \
+                           Py_ssize_t t_ = perm[i];  \
+                           perm[i] = perm[j];  \
+                           perm[j] = t_;  \
+                           if (ls->where != NULL) {  \
+                               ls->where[perm[i]] = perm + (i) - ls->perm;  \
+                               ls->where[perm[j]] = perm + (j) - ls->perm;  \
+                           }  \
+                           break;  \
+                       }  \
+                       tmp = ob_item[i];  \
+                       ob_item[i] = ob_item[j];  \
+                       ob_item[j] = tmp;  \
+                       if (keys != ob_item) {  \
+                           tmp = keys[i];  \
+                           keys[i] = keys[j];  \
+                           keys[j] = tmp;  \
+                       }  \
+                   } while (0)
+
+/* The key of the item at index i, as LS_KEY. Expects keys and perm to be in
+ * scope. */
+#define KEY(i)  (perm != NULL ? keys[perm[i]] : keys[i])
+
+/* Picks a pivot point among the indices left <= i < right. Returns -1 on
+ * error */
+
+static Py_ssize_t pick_pivot(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+pick_pivot(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    /* Use median of three trick */
+    Py_ssize_t idx1 = RANDOM_IDX(&ls->rng, left, right);
+    Py_ssize_t idx2 = RANDOM_IDX(&ls->rng, left, right);
+    Py_ssize_t idx3 = RANDOM_IDX(&ls->rng, left, right);
+
+    int ltflag;
+    IFLT(KEY(idx1), KEY(idx3)) {
+        IFLT(KEY(idx1), KEY(idx2)) {
+            /* 1 2 3 vs. 1 3 2 */
+            IFLT(KEY(idx2), KEY(idx3)) {
+                return idx2;
+            }
+            else {
+                return idx3;
+            }
+        }
+        else {
+            /* 2 1 3 */
+            return idx1;
+        }
+    }
+    else {
+        IFLT(KEY(idx3), KEY(idx2)) {
+            /* 3 1 2 vs 3 2 1 */
+            IFLT(KEY(idx1), KEY(idx2)) {
+                return idx1;
+            }
+            else {
+                return idx2;
+            }
+        }
+        else {
+            /* 2 3 1 */
+            return idx3;
+        }
+    }
+
+fail:
+    return -1;
+}
+
+/* Partitions the data between left and right into
+ * [less than or equal region | pivot | greater than or equal region]
+ * and returns the pivot index, or -1 on error.
+ *
+ * This is Hoare's scheme done a block at a time, as in BlockQuicksort: a block
+ * of items from each end is compared against the pivot, and the offsets of the
+ * misplaced ones are recorded without branching on the comparisons. Then the
+ * misplaced items from both blocks are swapped with each other in one tight
+ * loop. So the comparisons don't cause branch mispredictions, and each item is
+ * moved at most once. */
+static Py_ssize_t object_partition(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+object_partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+    lessthanfunc lt = ls->lt;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *pivot;
+    int ltflag;
+
+    unsigned char offsets_l[BLOCK_SIZE];
+    unsigned char offsets_r[BLOCK_SIZE];
+    Py_ssize_t num_l = 0, num_r = 0;        /* Misplaced items left to swap */
+    Py_ssize_t start_l = 0, start_r = 0;
+    Py_ssize_t size_l = BLOCK_SIZE, size_r = BLOCK_SIZE;
+    Py_ssize_t i, num, remaining, last;
+    int last_round;
+
+    Py_ssize_t piv_idx = pick_pivot(ls, left, right);
+    if (piv_idx < 0) {
+        return -1;
+    }
+    pivot = KEY(piv_idx);
+    SWAP(left, piv_idx);
+
+    /* Invariant: everything in [left + 1, lo) is less than or equal to the
+     * pivot, and everything in (hi, right) is greater than or equal to it */
+    Py_ssize_t lo = left + 1;
+    Py_ssize_t hi = right - 1;
+
+    do {
+        remaining = hi - lo + 1;
+        last_round = remaining <= 2 * BLOCK_SIZE;
+        if (last_round) {
+            /* Shrink the blocks to cover exactly what's left. A block that
+             * still has misplaced items from the last round keeps its size */
+            if (num_l == 0 && num_r == 0) {
+                size_l = remaining / 2;
+                size_r = remaining - size_l;
+            }
+            else if (num_l == 0) {
+                size_l = remaining - size_r;
+            }
+            else {
+                size_r = remaining - size_l;
+            }
+        }
+
+        if (num_l == 0) {
+            start_l = 0;
+            for (i = 0; i < size_l; i++) {
+                if (i + 3 < size_l)
+                    __builtin_prefetch(KEY(lo + i + 3));
+                if ((ltflag = lt(KEY(lo + i), pivot, ls)) < 0)
+                    goto fail;
+                offsets_l[num_l] = (unsigned char)i;
+                num_l += !ltflag;
+            }
+        }
+        if (num_r == 0) {
+            start_r = 0;
+            for (i = 0; i < size_r; i++) {
+                if (i + 3 < size_r)
+                    __builtin_prefetch(KEY(hi - i - 3));
+                if ((ltflag = lt(pivot, KEY(hi - i), ls)) < 0)
+                    goto fail;
+                offsets_r[num_r] = (unsigned char)i;
+                num_r += !ltflag;
+            }
+        }
+
+        num = num_l < num_r ? num_l : num_r;
+        for (i = 0; i < num; i++) {
+            SWAP(lo + offsets_l[start_l + i], hi - offsets_r[start_r + i]);
+        }
+        num_l -= num;
+        num_r -= num;
+        start_l += num;
+        start_r += num;
+
+        if (num_l == 0)
+            lo += size_l;
+        if (num_r == 0)
+            hi -= size_r;
+    } while (!last_round);
+
+    /* At most one block still has misplaced items, and it's all that's left
+     * between lo and hi. Move them to its far end, largest offsets first */
+    if (num_l > 0) {
+        while (num_l > 0) {
+            num_l--;
+            SWAP(lo + offsets_l[start_l + num_l], hi);
+            hi--;
+        }
+        last = hi;
+    }
+    else {
+        while (num_r > 0) {
+            num_r--;
+            SWAP(hi - offsets_r[start_r + num_r], lo);
+            lo++;
+        }
+        last = lo - 1;
+    }
+
+    SWAP(left, last);
+    return last;
+
+fail:
+    return -1;
+}
+
+/* Runs insertion sort on the items left <= i < right */
+static int object_insertion_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+object_insertion_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+    lessthanfunc lt = ls->lt;
+
+    PyObject *tmp, *key;
+    Py_ssize_t i, j, idx;
+    int ltflag = 0;
+
+    /* Sorting indices only moves them */
+    if (perm != NULL) {
+        for (i = left; i < right; i++) {
+            idx = perm[i];
+            key = keys[idx];
+            for (j = i; j > left && (ltflag = lt(key, KEY(j - 1), ls)) > 0;
+                 j--) {
+                perm[j] = perm[j - 1];
+            }
+            perm[j] = idx;
+            if (ls->where != NULL) {
+                for (; j <= i; j++)
+                    ls->where[perm[j]] = j;
+            }
+            if (ltflag < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    for (i = left; i < right; i++) {
+        tmp = ob_item[i];
+        key = keys[i];
+        for (j = i; j > left && (ltflag = lt(key, keys[j - 1], ls)) > 0; j--) {
+            ob_item[j] = ob_item[j - 1];
+            keys[j] = keys[j - 1];
+        }
+        ob_item[j] = tmp;
+        keys[j] = key;
+        if (ltflag < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Partitions the data between left and right around the item at piv_idx into
+ * [less than region | equal region | greater than region]
+ * Returns the start of the equal region and puts the end of it in *gt, or
+ * returns -1 on error. */
+static Py_ssize_t object_partition3(LSObject *, Py_ssize_t, Py_ssize_t,
+                                    Py_ssize_t, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+object_partition3(LSObject *ls, Py_ssize_t left, Py_ssize_t right,
+                  Py_ssize_t piv_idx, Py_ssize_t *gt)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *pivot = KEY(piv_idx);
+    int ltflag;
+
+    /* Invariant: [left, lt) is less than the pivot, [lt, i) is equal to it,
+     * and [g, right) is greater than it */
+    Py_ssize_t lt = left, i = left, g = right;
+    while (i < g) {
+        IFLT(KEY(i), pivot) {
+            SWAP(i, lt);
+            i++;
+            lt++;
+        }
+        else {
+            IFLT(pivot, KEY(i)) {
+                g--;
+                SWAP(i, g);
+            }
+            else {
+                i++;
+            }
+        }
+    }
+
+    *gt = g;
+    return lt;
+
+fail:  /* From IFLT macro */
+    return -1;
+}
+
+/* Moves the item at index root of the heap starting at base, with n items, to
+ * its place. Returns 0 on success or -1 on error. */
+static int object_sift_down(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+object_sift_down(LSObject *ls, Py_ssize_t base, Py_ssize_t root, Py_ssize_t n)
+{
+    PyObject **ob_item = ls->xs->ob_item + base;
+    Py_ssize_t *perm = ls->perm != NULL ? ls->perm + base : NULL;
+    /* Indices point at keys that don't move, from the start of the items */
+    PyObject **keys = LS_KEYS(ls) + (perm != NULL ? 0 : base);
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    Py_ssize_t child;
+    int ltflag;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n) {
+            IFLT(KEY(child), KEY(child + 1)) {
+                child++;
+            }
+        }
+        IFLT(KEY(root), KEY(child)) {
+            SWAP(root, child);
+            root = child;
+        }
+        else {
+            break;
+        }
+    }
+    return 0;
+
+fail:  /* From IFLT macro */
+    return -1;
+}
+
+/* Runs heapsort on the items left <= i < right. Returns 0 on success or -1 on
+ * error */
+static int object_heap_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+object_heap_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    Py_ssize_t n = right - left;
+    Py_ssize_t i;
+
+    for (i = n / 2 - 1; i >= 0; i--) {
+        if (object_sift_down(ls, left, i, n) < 0)
+            return -1;
+    }
+    for (i = n - 1; i > 0; i--) {
+        SWAP(left, left + i);
+        if (object_sift_down(ls, left, 0, i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Partitions the data between left and right, boxed or not, as described in
+ * object_partition, without the GIL and maybe on several threads if it's a
+ * big region of unboxed data. Returns the pivot index, or -1 on error */
+static Py_ssize_t partition(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    Py_ssize_t piv_idx;
+    int nthreads;
+
+    if (ls->ops == NULL)
+        return object_partition(ls, left, right);
+    if (ls->worker || right - left < NOGIL_THRESH)
+        return ls->ops->partition(ls->data, left, right, &ls->rng);
+
+    if ((nthreads = threads_for(right - left)) > 1)
+        NOGIL(ls, piv_idx = split_parallel(ls, left, right, nthreads));
+    else
+        NOGIL(ls, piv_idx = ls->ops->partition(ls->data, left, right,
+                                               &ls->rng));
+    return piv_idx;
+}
+
+/* Runs insertion sort on the items left <= i < right, boxed or not. Returns 0
+ * on success or -1 on error. */
+static int insertion_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+insertion_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (ls->ops != NULL) {
+        ls->ops->insertion_sort(ls->data, left, right);
+        return 0;
+    }
+    return object_insertion_sort(ls, left, right);
+}
+
+/* Partitions the data between left and right around the item at piv_idx,
+ * boxed or not, as described in object_partition3. */
+static Py_ssize_t partition3(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t,
+                             Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+partition3(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t piv_idx,
+           Py_ssize_t *gt)
+{
+    if (ls->ops != NULL)
+        return ls->ops->partition3(ls->data, left, right, piv_idx, gt);
+    return object_partition3(ls, left, right, piv_idx, gt);
+}
+
+/* Runs heapsort on the items left <= i < right, boxed or not. Returns 0 on
+ * success or -1 on error. */
+static int heap_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+heap_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (ls->ops != NULL) {
+        ls->ops->heap_sort(ls->data, left, right);
+        return 0;
+    }
+    return object_heap_sort(ls, left, right);
+}
+
+/* Sifts the item at position root down the heap of the n items from base,
+ * which runs backwards from base if back, keeping every item's key from being
+ * below its children's: less than them going forwards, so the biggest is at
+ * the root, or greater going backwards, so the smallest is. Returns 0 on
+ * success and -1 on error. */
+static int heap_sift(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+#define IFBELOW(X, Y) if ((ltflag = back ? ls->lt(Y, X, ls) :                 \
+                                           ls->lt(X, Y, ls)) < 0) goto fail;  \
+            if (ltflag)
+
+static int
+heap_sift(LSObject *ls, Py_ssize_t base, Py_ssize_t root, Py_ssize_t n,
+          int back)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    Py_ssize_t step = back ? -1 : 1;
+    Py_ssize_t child, i, c;
+    int ltflag;
+
+    while ((child = 2 * root + 1) < n) {
+        c = base + step * child;
+        if (child + 1 < n) {
+            IFBELOW(KEY(c), KEY(c + step)) {
+                child++;
+                c += step;
+            }
+        }
+        i = base + step * root;
+        IFBELOW(KEY(i), KEY(c)) {
+            SWAP(i, c);
+            root = child;
+        }
+        else {
+            break;
+        }
+    }
+    return 0;
+
+fail:  /* From IFBELOW macro */
+    return -1;
+}
+
+/* Moves the k smallest items in the region from left up to right to its
+ * front, in sorted order, or the k largest to its back if back, by running
+ * the rest of the region past a heap of the best k so far. That's one
+ * comparison for each item, and about log(k) more for each of the k log(m / k)
+ * or so that make it into the heap, which for small k is fewer than the
+ * partitions of a selection need, and it moves hardly any items. Returns 0 on
+ * success and -1 on error. */
+static int heap_select(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+heap_select(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t k,
+            int back)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    Py_ssize_t step = back ? -1 : 1;
+    Py_ssize_t base = back ? right - 1 : left;
+    Py_ssize_t i, j;
+    int ltflag;
+
+    for (j = k / 2 - 1; j >= 0; j--) {
+        if (heap_sift(ls, base, j, k, back) < 0)
+            return -1;
+    }
+
+    /* Items below the root belong in the heap instead of it */
+    for (j = k; j < right - left; j++) {
+        i = base + step * j;
+        IFBELOW(KEY(i), KEY(base)) {
+            SWAP(i, base);
+            if (heap_sift(ls, base, 0, k, back) < 0)
+                return -1;
+        }
+    }
+
+    for (j = k - 1; j > 0; j--) {
+        SWAP(base, base + step * j);
+        if (heap_sift(ls, base, 0, j, back) < 0)
+            return -1;
+    }
+    return 0;
+
+fail:  /* From IFBELOW macro */
+    return -1;
+}
+
+#undef IFBELOW
+
+/* Sorts the items from start up to stop by heap_select, if they're at one end
+ * of an unsorted region of python objects that's long enough for that to be
+ * cheaper than partitioning it, returning 1, or returns 0 without doing
+ * anything if they aren't, or -1 on error */
+static int heap_range(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+heap_range(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    PivotNode *left, *right, *node;
+    Py_ssize_t k, m;
+    double lg, heap_cost, partition_cost;
+    int back;
+
+    if (ls->ops != NULL)
+        return 0;
+    PREPARE(ls) {
+        return -1;
+    }
+
+    /* Pivots at either end are already in place */
+    if (bound_idx(ls, start, &left, &right) < 0)
+        return -1;
+    if (left->idx == start) {
+        start++;
+        if ((right = next_pivot(ls, left)) == NULL)
+            return -1;
+    }
+    if (right->idx == stop - 1)
+        stop--;
+    if (start >= stop || stop > right->idx || right->flags & SORTED_RIGHT)
+        return 0;
+
+    back = start > left->idx + 1;
+    if (back ? stop < right->idx : stop == right->idx)
+        return 0;
+
+    /* Both ways compare every item once. On top of that, each of the items
+     * that make it into the heap costs about 1.4 log2(k) comparisons, and
+     * heapsorting them at the end 2 log2(k) each, while partitioning costs
+     * about m comparisons for quickselect, or 4 m^(2/3) for Floyd-Rivest's
+     * samples, and quicksorting the k items 1.1 log2(k) each, (as measured on
+     * random data) */
+    k = stop - start;
+    m = right->idx - left->idx - 1;
+    lg = log(k + 1.0) / log(2.0);
+    heap_cost = 1.4 * k * lg * log((double)m / k) + 2 * k * lg;
+    partition_cost = (m >= FR_THRESH ? 4 * pow((double)m, 2.0 / 3) : m) +
+                     1.1 * k * lg;
+    if (heap_cost >= partition_cost)
+        return 0;
+
+    if (heap_select(ls, left->idx + 1, right->idx, k, back) < 0)
+        return -1;
+
+    if (back) {
+        if ((node = add_pivot(ls, start, left, right)) == NULL)
+            return -1;
+        node->flags |= SORTED_LEFT;
+        right->flags |= SORTED_RIGHT;
+        depivot(ls, node, right);
+    }
+    else {
+        if ((node = add_pivot(ls, stop - 1, left, right)) == NULL)
+            return -1;
+        left->flags |= SORTED_LEFT;
+        node->flags |= SORTED_RIGHT;
+        depivot(ls, left, node);
+    }
+    return 1;
+}
+
+/* Swaps the items at indices i and j, boxed or not */
+static void
+swap_items(LSObject *ls, Py_ssize_t i, Py_ssize_t j)
+{
+    PyObject **ob_item, **keys;
+    Py_ssize_t *perm = ls->perm;
+    PyObject *tmp;  /* Used by SWAP macro */
+
+    if (ls->ops != NULL) {
+        ls->ops->swap(ls->data, i, j);
+        return;
+    }
+    ob_item = ls->xs->ob_item;
+    keys = LS_KEYS(ls);
+    SWAP(i, j);
+}
+
+static Py_ssize_t select_kth(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+/* Returns the index of a pivot between left and right that's guaranteed to
+ * have at least about 3/10 of the items on either side of it, by taking the
+ * median of the medians of groups of five. Moves the medians to the start of
+ * the range along the way. Returns -1 on error. */
+static Py_ssize_t median_of_medians(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+median_of_medians(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    Py_ssize_t n = right - left;
+    Py_ssize_t i;
+
+    if (n <= 5) {
+        if (insertion_sort(ls, left, right) < 0)
+            return -1;
+        return left + n / 2;
+    }
+
+    for (i = 0; i < n / 5; i++) {
+        if (insertion_sort(ls, left + 5 * i, left + 5 * i + 5) < 0)
+            return -1;
+        swap_items(ls, left + i, left + 5 * i + 2);
+    }
+
+    return select_kth(ls, left, left + n / 5, left + n / 10);
+}
+
+/* Moves the kth smallest item between left and right to index k, without
+ * touching the pivot tree, in worst case linear time. Returns k, or -1 on
+ * error. */
+static Py_ssize_t
+select_kth(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t k)
+{
+    Py_ssize_t piv_idx, lt, gt;
+
+    while (right - left > SORT_THRESH) {
+        if ((piv_idx = median_of_medians(ls, left, right)) < 0)
+            return -1;
+        if ((lt = partition3(ls, left, right, piv_idx, &gt)) < 0)
+            return -1;
+
+        if (k < lt)
+            right = lt;
+        else if (k >= gt)
+            left = gt;
+        else
+            return k;
+    }
+
+    if (insertion_sort(ls, left, right) < 0)
+        return -1;
+    return k;
+}
+
+/* Partitions the data between left and right around a median of medians
+ * pivot, for when quickselect isn't making enough progress. The items equal to
+ * the pivot end up in [*lt, *gt), and any index there is a valid pivot.
+ * Returns 0 on success or -1 on error. */
+static int fallback_partition(LSObject *, Py_ssize_t, Py_ssize_t,
+                              Py_ssize_t *, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+fallback_partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right,
+                   Py_ssize_t *lt, Py_ssize_t *gt)
+{
+    Py_ssize_t piv_idx = median_of_medians(ls, left, right);
+    if (piv_idx < 0)
+        return -1;
+    if ((*lt = partition3(ls, left, right, piv_idx, gt)) < 0)
+        return -1;
+    return 0;
+}
+
+/* Returns 1 if the items at indices i and j are equal, given that the item at
+ * i is no greater than the one at j, 0 if not, or -1 on error. This takes one
+ * comparison, rather than the two that testing equality by ordering would
+ * otherwise need. */
+static int
+ordered_items_eq(LSObject *ls, Py_ssize_t i, Py_ssize_t j)
+{
+    int ltflag;
+
+    if (ls->ops != NULL)
+        return ls->ops->eq(ls->data, i, j);
+    if ((ltflag = ls->lt(LS_KEY(ls, i), LS_KEY(ls, j), ls)) < 0)
+        return -1;
+    return !ltflag;
+}
+
+/* Moves the items between left and right that are equal to the item at
+ * piv_idx, which must be outside the range, to the end of the range if
+ * at_end, or else to the start, and returns the index where they start or
+ * end respectively, or -1 on error. The item at piv_idx must be no greater
+ * than all the items in the range if at_end is 0, and no less if it's 1, so
+ * for python objects this takes one comparison per item rather than the two
+ * that partition3 would. */
+static Py_ssize_t gather_equal(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t,
+                               int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+gather_equal(LSObject *ls, Py_ssize_t left, Py_ssize_t right,
+             Py_ssize_t piv_idx, int at_end)
+{
+    PyObject **ob_item, **keys;
+    Py_ssize_t *perm = ls->perm;
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *pivot;
+    Py_ssize_t i, lt, gt;
+    int ltflag;
+
+    if (ls->ops != NULL) {
+        lt = ls->ops->partition3(ls->data, left, right, piv_idx, &gt);
+        return at_end ? lt : gt;
+    }
+
+    ob_item = ls->xs->ob_item;
+    keys = LS_KEYS(ls);
+    pivot = KEY(piv_idx);
+    if (at_end) {
+        /* Invariant: [left, lt) is less than the pivot */
+        for (i = lt = left; i < right; i++) {
+            IFLT(KEY(i), pivot) {
+                SWAP(i, lt);
+                lt++;
+            }
+        }
+        return lt;
+    }
+    else {
+        /* Invariant: [left, gt) is equal to the pivot */
+        for (i = gt = left; i < right; i++) {
+            IFLT(pivot, KEY(i)) {
+                continue;
+            }
+            SWAP(i, gt);
+            gt++;
+        }
+        return gt;
+    }
+
+fail:  /* From IFLT macro */
+    return -1;
+}
+
+/* Partitions the data between left and right into
+ * [less than region | equal region | greater than region]
+ * around a random pivot, putting the bounds of the equal region in *lt and
+ * *gt. The items at left - 1 and at right, if they're in the list, must be no
+ * greater and no less than all the items in between, as they are when they're
+ * pivots.
+ *
+ * Finding the items equal to the pivot would take a second comparison for
+ * many items, so this is done only when it's likely to pay off: partition
+ * splits the items around the pivot, and if the pivot is equal to the item
+ * just outside the region on one side, all the items on that side of it are
+ * equal to it too, and only the other side needs another pass to gather the
+ * rest. Data with many duplicates keeps hitting this case, since the previous
+ * pivots become the bounds, and each run of equal items is then collected
+ * once and never partitioned again. Otherwise the equal region is just the
+ * pivot, and there may be items equal to it on either side.
+ *
+ * Returns 1 if the equal region has all the items equal to the pivot, 0 if it
+ * might not, or -1 on error. */
+static int partition_region(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t *,
+                            Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+partition_region(LSObject *ls, Py_ssize_t left, Py_ssize_t right,
+                 Py_ssize_t *lt, Py_ssize_t *gt)
+{
+    Py_ssize_t piv_idx;
+    int eq;
+
+    if ((piv_idx = partition(ls, left, right)) < 0)
+        return -1;
+    *lt = piv_idx;
+    *gt = piv_idx + 1;
+
+    if (left > 0) {
+        if ((eq = ordered_items_eq(ls, left - 1, piv_idx)) < 0)
+            return -1;
+        if (eq) {
+            if ((*gt = gather_equal(ls, piv_idx + 1, right, piv_idx, 0)) < 0)
+                return -1;
+            *lt = left;
+            return 1;
+        }
+    }
+
+    if (right < LS_SIZE(ls)) {
+        if ((eq = ordered_items_eq(ls, piv_idx, right)) < 0)
+            return -1;
+        if (eq) {
+            if ((*lt = gather_equal(ls, left, piv_idx, piv_idx, 1)) < 0)
+                return -1;
+            *gt = right;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Moves the kth smallest item between left and right to index k, without
+ * touching the pivot tree, by quickselect, falling back to select_kth if it's
+ * going badly. Returns k, or -1 on error. */
+static Py_ssize_t quick_select(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+quick_select(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t k)
+{
+    Py_ssize_t piv_idx;
+    Py_ssize_t work = WORK_LIMIT * (right - left);
+
+    while (right - left > SORT_THRESH) {
+        if (work <= 0)
+            return select_kth(ls, left, right, k);
+        work -= right - left;
+
+        if ((piv_idx = partition(ls, left, right)) < 0)
+            return -1;
+        if (k < piv_idx)
+            right = piv_idx;
+        else if (k > piv_idx)
+            left = piv_idx + 1;
+        else
+            return k;
+    }
+
+    if (insertion_sort(ls, left, right) < 0)
+        return -1;
+    return k;
+}
+
+/* Partitions the python objects between left and right around two pivots,
+ * chosen so that the kth item very probably lies between them, as in
+ * Floyd and Rivest's selection algorithm. The pivots are the items whose ranks
+ * in a random sample of about n^(2/3) items are a little below and a little
+ * above k's expected rank, so most of the items end up outside them. Each item
+ * is compared first against the pivot on the side most items are on, so the
+ * partition takes about n + min(k, n - k) comparisons. Puts the indices of the
+ * pivots in *u_idx and *v_idx, and returns 0 on success or -1 on error. */
+static int floyd_rivest(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t,
+                        Py_ssize_t *, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+floyd_rivest(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t k,
+             Py_ssize_t *u_idx, Py_ssize_t *v_idx)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **keys = LS_KEYS(ls);
+    Py_ssize_t *perm = ls->perm;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *u, *v;
+    int ltflag;
+    Py_ssize_t n = right - left;
+    Py_ssize_t i, j, lt, gt, rank, gap, ru, rv;
+    int mostly_greater = k - left < n / 2;
+
+    /* Draw the sample into [left, left + s) */
+    Py_ssize_t s = (Py_ssize_t)pow((double)n, 2.0 / 3.0);
+    for (i = left; i < left + s; i++) {
+        j = RANDOM_IDX(&ls->rng, i, right);
+        SWAP(i, j);
+    }
+
+    /* Pick the pivots, about sqrt(log(n)) standard deviations of k's rank in
+     * the sample on either side of it */
+    rank = (Py_ssize_t)((double)(k - left) * s / n);
+    gap = (Py_ssize_t)(0.5 * sqrt(s * log((double)n))) + 1;
+    ru = rank - gap < 0 ? 0 : rank - gap;
+    rv = rank + gap > s - 1 ? s - 1 : rank + gap;
+    if (quick_select(ls, left, left + s, left + rv) < 0)
+        return -1;
+    if (quick_select(ls, left, left + rv, left + ru) < 0)
+        return -1;
+
+    /* Set the pivots aside at the ends */
+    SWAP(left, left + ru);
+    SWAP(right - 1, left + rv);
+    u = KEY(left);
+    v = KEY(right - 1);
+
+    /* Invariant: [left + 1, lt) is less than u, [lt, i) is between u and v,
+     * and [gt, right - 1) is greater than v */
+    lt = i = left + 1;
+    gt = right - 1;
+    while (i < gt) {
+        if (mostly_greater) {
+            IFLT(v, KEY(i)) {
+                gt--;
+                SWAP(i, gt);
+                continue;
+            }
+            IFLT(KEY(i), u) {
+                SWAP(i, lt);
+                lt++;
+            }
+        }
+        else {
+            IFLT(KEY(i), u) {
+                SWAP(i, lt);
+                lt++;
+                i++;
+                continue;
+            }
+            IFLT(v, KEY(i)) {
+                gt--;
+                SWAP(i, gt);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    /* Put the pivots back at the edges of the middle */
+    SWAP(left, lt - 1);
+    SWAP(right - 1, gt);
+    *u_idx = lt - 1;
+    *v_idx = gt;
+    return 0;
+
+fail:  /* From IFLT macro */
+    return -1;
+}
+
+/* Moves the kth smallest item between left and right to index k, with no
+ * bigger items before it and no smaller ones after, as select_point does but
+ * without keeping any pivots, for the module functions that select once. The
+ * items must be bounded as in partition_region. Returns 0 on success or -1 on
+ * error. */
+static int select_nth(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+select_nth(LSObject *ls, Py_ssize_t left, Py_ssize_t right, Py_ssize_t k)
+{
+    Py_ssize_t lt, gt, u_idx, v_idx;
+    Py_ssize_t work = WORK_LIMIT * (right - left);
+    int eq;
+
+    while (left + SORT_THRESH <= right) {
+        if (work <= 0) {
+            if (fallback_partition(ls, left, right, &lt, &gt) < 0)
+                return -1;
+        }
+        else if (ls->ops == NULL && right - left >= FR_THRESH) {
+            work -= right - left;
+            if (floyd_rivest(ls, left, right, k, &u_idx, &v_idx) < 0)
+                return -1;
+            if ((eq = ordered_items_eq(ls, u_idx, v_idx)) < 0)
+                return -1;
+
+            /* Everything between the pivots is equal if they are */
+            if (k < u_idx)
+                right = u_idx;
+            else if (k > v_idx)
+                left = v_idx + 1;
+            else if (eq || k == u_idx || k == v_idx)
+                return 0;
+            else {
+                left = u_idx + 1;
+                right = v_idx;
+            }
+            continue;
+        }
+        else {
+            work -= right - left;
+            if (partition_region(ls, left, right, &lt, &gt) < 0)
+                return -1;
+        }
+
+        if (k < lt)
+            right = lt;
+        else if (k >= gt)
+            left = gt;
+        else
+            return 0;
+    }
+
+    return insertion_sort(ls, left, right);
+}
+
+/* Runs quicksort on the items left <= i < right, which must be bounded as in
+ * partition_region, returning 0 on success or -1 on error. Does not affect
+ * stored pivots at all. Falls back to heapsort on subranges where it recurses
+ * too deeply, so it's O(n log n) worst case. */
+static int quick_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int intro_sort(LSObject *, Py_ssize_t, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+/* Does the work for quick_sort, switching to heapsort once depth runs out */
+static int
+intro_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right, int depth)
+{
+    if (right - left <= SORT_THRESH) {
+        return insertion_sort(ls, left, right);
+    }
+    if (depth == 0) {
+        return heap_sort(ls, left, right);
+    }
+
+    Py_ssize_t lt, gt;
+    if (partition_region(ls, left, right, &lt, &gt) < 0)
+        return -1;
+
+    if (intro_sort(ls, left, lt, depth - 1) < 0)
+        return -1;
+
+    if (intro_sort(ls, gt, right, depth - 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+quick_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    int depth = 0;
+    Py_ssize_t n;
+
+    for (n = right - left; n > 1; n >>= 1)
+        depth += 2;
+    return intro_sort(ls, left, right, depth);
+}
+
+/* A region of unboxed data for threads to sort, or if ks is set, to select
+ * the nk items at the sorted indices ks from */
+typedef struct {
+    Py_ssize_t          left, right;
+    Py_ssize_t          *ks;
+    Py_ssize_t          nk;
+    int                 depth;          /* For sorting, as in intro_sort */
+    Py_ssize_t          work;           /* For selecting, as in select_point */
+} Task;
+
+/* The tasks waiting for a thread. Threads split the big ones as they go,
+ * keeping one part and adding the other here for whichever thread is idle. */
+typedef struct {
+    LSObject            *ls;            /* What the threads copy to work on */
+    unsigned long long  seed;           /* Plus a task's left seeds its rng */
+    Task                *tasks;
+    Py_ssize_t          ntasks;
+    Py_ssize_t          allocated;
+    int                 active;         /* Threads in the middle of a task */
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;           /* Signalled when a task is added or
+                                         * the last active one finishes */
+#endif
+} TaskPool;
+
+static void
+tasks_init(TaskPool *tp, LSObject *ls)
+{
+    tp->ls = ls;
+    tp->seed = ls->rng;
+    tp->tasks = NULL;
+    tp->ntasks = tp->allocated = 0;
+    tp->active = 0;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&tp->mutex, NULL);
+    pthread_cond_init(&tp->cond, NULL);
+#endif
+}
+
+static void
+tasks_clear(TaskPool *tp)
+{
+    free(tp->tasks);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&tp->mutex);
+    pthread_cond_destroy(&tp->cond);
+#endif
+}
+
+/* Adds a task, returning 0 on success or -1 if there's no memory for it, in
+ * which case the caller has to do it. This uses malloc rather than PyMem,
+ * since it runs without the GIL. */
+static int push_task(TaskPool *, Task *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+push_task(TaskPool *tp, Task *task)
+{
+    Task *grown;
+    Py_ssize_t allocated;
+    int res = 0;
+
+    MUTEX_LOCK(&tp->mutex);
+    if (tp->ntasks == tp->allocated) {
+        allocated = tp->allocated ? 2 * tp->allocated : 16;
+        grown = (Task *)realloc(tp->tasks, allocated * sizeof(Task));
+        if (grown == NULL) {
+            res = -1;
+        }
+        else {
+            tp->tasks = grown;
+            tp->allocated = allocated;
+        }
+    }
+    if (res == 0) {
+        tp->tasks[tp->ntasks++] = *task;
+#ifdef HAVE_PTHREADS
+        pthread_cond_signal(&tp->cond);
+#endif
+    }
+    MUTEX_UNLOCK(&tp->mutex);
+    return res;
+}
+
+/* Does a task on ls, a copy of tp->ls with worker set, handing parts of it
+ * back to tp for other threads while they're big enough to be worth it */
+static void
+do_task(TaskPool *tp, LSObject *ls, Task *task)
+{
+    Py_ssize_t left = task->left, right = task->right;
+    Py_ssize_t *ks = task->ks, nk = task->nk;
+    Py_ssize_t split_min = PARALLEL_THRESH / 8 > SORT_THRESH ?
+                           PARALLEL_THRESH / 8 : SORT_THRESH + 1;
+    Py_ssize_t lt, gt, i, j;
+    Task rest;
+
+    ls->rng = rng_seed(tp->seed + (unsigned long long)left);
+
+    if (ks == NULL) {
+        while (right - left >= split_min && task->depth > 0) {
+            if (partition_region(ls, left, right, &lt, &gt) < 0)
+                return;
+            task->depth--;
+            rest = *task;
+            rest.left = gt;
+            rest.right = right;
+            if (push_task(tp, &rest) < 0)
+                do_task(tp, ls, &rest);
+            right = lt;
+        }
+        if (intro_sort(ls, left, right, task->depth) < 0)
+            return;
+        return;
+    }
+
+    while (nk > 0) {
+        if (right - left < SORT_THRESH) {
+            if (insertion_sort(ls, left, right) < 0)
+                return;
+            return;
+        }
+        if (task->work <= 0) {
+            if (fallback_partition(ls, left, right, &lt, &gt) < 0)
+                return;
+        }
+        else {
+            task->work -= right - left;
+            if (partition_region(ls, left, right, &lt, &gt) < 0)
+                return;
+        }
+
+        /* The ks before i are on the left, and the ones from j on the right */
+        for (i = 0; i < nk && ks[i] < lt; i++)
+            ;
+        for (j = i; j < nk && ks[j] < gt; j++)
+            ;
+        if (i > 0 && j < nk) {
+            rest = *task;
+            rest.left = gt;
+            rest.right = right;
+            rest.ks = ks + j;
+            rest.nk = nk - j;
+            if (push_task(tp, &rest) < 0)
+                do_task(tp, ls, &rest);
+        }
+        if (i > 0) {
+            right = lt;
+            nk = i;
+        }
+        else {
+            left = gt;
+            ks += j;
+            nk -= j;
+        }
+    }
+}
+
+static void *
+run_tasks(void *arg)
+{
+    TaskPool *tp = (TaskPool *)arg;
+    LSObject ls = *tp->ls;
+    Task task;
+
+    ls.worker = 1;
+    MUTEX_LOCK(&tp->mutex);
+    for (;;) {
+#ifdef HAVE_PTHREADS
+        while (tp->ntasks == 0 && tp->active > 0)
+            pthread_cond_wait(&tp->cond, &tp->mutex);
+#endif
+        if (tp->ntasks == 0)
+            break;
+        task = tp->tasks[--tp->ntasks];
+        tp->active++;
+        MUTEX_UNLOCK(&tp->mutex);
+        do_task(tp, &ls, &task);
+        MUTEX_LOCK(&tp->mutex);
+        tp->active--;
+#ifdef HAVE_PTHREADS
+        if (tp->active == 0 && tp->ntasks == 0)
+            pthread_cond_broadcast(&tp->cond);
+#endif
+    }
+    MUTEX_UNLOCK(&tp->mutex);
+    return NULL;
+}
+
+/* Splits the biggest tasks with split_parallel until there's one for each
+ * thread, since otherwise the other threads would wait on the first partition
+ * of the first task. Tasks that split badly, as runs of equal items do, are
+ * left to the threads to gather up. */
+static void
+presplit_tasks(TaskPool *tp, LSObject *ls, int nthreads)
+{
+    Py_ssize_t i = 0, piv_idx, j, n;
+    Task *task, rest;
+
+    while (i < tp->ntasks && tp->ntasks < nthreads) {
+        task = &tp->tasks[i];
+        n = task->right - task->left;
+        if (n < PARALLEL_THRESH || (task->ks == NULL && task->depth == 0)) {
+            i++;
+            continue;
+        }
+
+        ls->rng = rng_seed(tp->seed + (unsigned long long)task->left);
+        piv_idx = split_parallel(ls, task->left, task->right, nthreads);
+        if (task->ks == NULL)
+            task->depth--;
+        else
+            task->work -= n;
+        rest = *task;
+        rest.left = piv_idx + 1;
+        task->right = piv_idx;
+        if (task->ks != NULL) {
+            for (j = 0; j < task->nk && task->ks[j] < piv_idx; j++)
+                ;
+            rest.ks = task->ks + j;
+            rest.nk = task->nk - j;
+            if (j < task->nk && task->ks[j] == piv_idx) {
+                rest.ks++;
+                rest.nk--;
+            }
+            task->nk = j;
+        }
+
+        if (task->ks != NULL && task->nk == 0)
+            *task = rest;
+        else if ((rest.ks == NULL || rest.nk > 0) && push_task(tp, &rest) < 0)
+            do_task(tp, ls, &rest);
+        if (piv_idx - task->left < n / 16 || task->right - piv_idx < n / 16)
+            i++;
+    }
+}
+
+/* Does the tasks in tp, which must be on the unboxed data of ls, and clears
+ * tp. total is the number of items in them, which decides whether it's worth
+ * releasing the GIL, and how many threads to use. This can't fail. */
+static void
+finish_tasks(LSObject *ls, TaskPool *tp, Py_ssize_t total)
+{
+    int nthreads = threads_for(total);
+    LSObject copy = *ls;
+
+    copy.worker = 1;
+    if (total < NOGIL_THRESH) {
+        run_tasks(tp);
+    }
+    else {
+        NOGIL(ls, {
+            if (nthreads > 1)
+                presplit_tasks(tp, &copy, nthreads);
+            run_threads(nthreads, run_tasks, tp);
+        });
+    }
+    tasks_clear(tp);
+}
+
+/* Records that the items in [lt, gt), which are between the pivots *left and
+ * *right, are all equal and in their final places, by adding pivots at both
+ * ends of them with the region between marked sorted. If whole, there are no
+ * other items equal to them in the region, and the pivots are marked as the
+ * ends of the run where that shows they are. Then narrows *left and *right to
+ * the region containing index k. Returns 1 if k is in [lt, gt), 0 if not, or
+ * -1 on error. */
+static int narrow(LSObject *, Py_ssize_t, Py_ssize_t, Py_ssize_t, int,
+                  PivotNode **, PivotNode **)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+narrow(LSObject *ls, Py_ssize_t lt, Py_ssize_t gt, Py_ssize_t k, int whole,
+       PivotNode **left, PivotNode **right)
+{
+    PivotNode *first, *last;
+
+    if ((first = add_pivot(ls, lt, *left, *right)) == NULL)
+        return -1;
+    last = first;
+    if (gt - lt > 1) {
+        if ((last = add_pivot(ls, gt - 1, first, *right)) == NULL)
+            return -1;
+        first->flags |= SORTED_LEFT;
+        last->flags |= SORTED_RIGHT;
+    }
+
+    /* The pivots bounding the region might be equal to the run too, unless
+     * there are smaller or bigger items in between */
+    if (whole && ((*left)->idx < 0 || lt > (*left)->idx + 1))
+        first->flags |= RUN_START;
+    if (whole && ((*right)->idx == LS_SIZE(ls) || gt < (*right)->idx))
+        last->flags |= RUN_END;
+
+    if (k < lt)
+        *right = first;
+    else if (k >= gt)
+        *left = last;
+    else
+        return 1;
+    return 0;
+}
+
+/* Sorts the list ls sufficiently such that ls->xs->ob_item[k] is actually the
+ * kth value in sorted order, splitting large regions of objects by sampling if
+ * sample is set. Returns 0 on success and -1 on error. */
+static int select_point(LSObject *, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+select_point(LSObject *ls, Py_ssize_t k, int sample)
+{
+    PREPARE(ls) {
+        return -1;
+    }
+
+    /* Find the best possible bounds */
+    PivotNode *left, *right;
+    if (bound_idx(ls, k, &left, &right) < 0)
+        return -1;
+
+    /* bound_idx never returns k in right, but right might be NULL if
+     * left->idx == k, so check left->idx first. */
+    if (left->idx == k || right->flags & SORTED_RIGHT) {
+        return 0;
+    }
+
+    /* Run quickselect, with median of medians if it's going badly. Python
+     * objects are expensive to compare, so large regions of them are split
+     * by Floyd-Rivest instead, if sample, since it needs fewer comparisons.
+     * Unboxed data is cheap enough to compare that the vectorized partitions
+     * win. Either way, runs of items equal to a pivot are set aside, so this
+     * ends as soon as k is in one. */
+    Py_ssize_t lt, gt, u_idx, v_idx;
+    Py_ssize_t work = WORK_LIMIT * (right->idx - left->idx);
+    int res, whole;
+
+    while (left->idx + 1 + SORT_THRESH <= right->idx) {
+        if (work <= 0) {
+            if (fallback_partition(ls, left->idx + 1, right->idx,
+                                   &lt, &gt) < 0) {
+                return -1;
+            }
+            whole = 1;
+        }
+        else if (sample && ls->ops == NULL &&
+                 right->idx - left->idx - 1 >= FR_THRESH) {
+            work -= right->idx - left->idx;
+            if (floyd_rivest(ls, left->idx + 1, right->idx, k,
+                             &u_idx, &v_idx) < 0) {
+                return -1;
+            }
+
+            /* Everything between the pivots is equal if they are */
+            if ((whole = ordered_items_eq(ls, u_idx, v_idx)) < 0)
+                return -1;
+            if (whole) {
+                lt = u_idx;
+                gt = v_idx + 1;
+            }
+            else {
+                /* Keep both pivots: add the one farther from k first, so
+                 * that the other one is still in the region containing k */
+                lt = k > v_idx ? u_idx : v_idx;
+                if ((res = narrow(ls, lt, lt + 1, k, 0, &left,
+                                  &right)) != 0)
+                    return res < 0 ? -1 : 0;
+                lt = k > v_idx ? v_idx : u_idx;
+                gt = lt + 1;
+            }
+        }
+        else {
+            work -= right->idx - left->idx;
+            if ((whole = partition_region(ls, left->idx + 1, right->idx,
+                                          &lt, &gt)) < 0) {
+                return -1;
+            }
+        }
+
+        if ((res = narrow(ls, lt, gt, k, whole, &left, &right)) != 0)
+            return res < 0 ? -1 : 0;
+    }
+
+    if (insertion_sort(ls, left->idx + 1, right->idx) < 0) {
+        return -1;
+    }
+    left->flags |= SORTED_LEFT;
+    right->flags |= SORTED_RIGHT;
+    depivot(ls, left, right);
+
+    return 0;
+}
+
+/* Sorts the list ls sufficiently such that ls->xs->ob_item[k] is actually the
+ * kth value in sorted order. Returns 0 on success and -1 on error. */
+static int sort_point(LSObject *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_point(LSObject *ls, Py_ssize_t k)
+{
+    int res;
+
+    /* The smallest and biggest items only need a pass over the items, with a
+     * heap of one */
+    if ((k == 0 || k == LS_SIZE(ls) - 1) &&
+        (res = heap_range(ls, k, k + 1)) != 0)
+        return res < 0 ? -1 : 0;
+    return select_point(ls, k, 1);
+}
+
+/* Sorts the list ls sufficiently such that index k holds its sorted value, and
+ * returns the far end of the sorted stretch of items that starts there. Going
+ * forwards, that's the biggest stop such that [k, stop) is sorted, and going
+ * backwards, it's the smallest stop such that (stop, k] is. This is how the
+ * iterators move through the list: a single walk of the tree finds all of the
+ * items they can return before they need to partition again, and partitioning
+ * narrows toward k, so the pivots it leaves further along are the stack of
+ * incremental quicksort. That only takes O(n + m log m) time for the first m
+ * items if the pivots are balanced, though, while Floyd-Rivest puts its pivots
+ * right next to k, leaving most of the region to partition again for k + 1,
+ * so it isn't used here. Returns -2 on error. */
+static Py_ssize_t sorted_stretch(LSObject *, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+sorted_stretch(LSObject *ls, Py_ssize_t k, int backwards)
+{
+    PivotNode *left, *right, *curr;
+
+    assert(0 <= k && k < LS_SIZE(ls));
+    if (select_point(ls, k, 0) < 0)
+        return -2;
+
+    /* Either k is a pivot, or it's in a sorted region between two */
+    if (bound_idx(ls, k, &left, &right) < 0)
+        return -2;
+    if (backwards) {
+        curr = left->idx == k ? left : right;
+        while (curr->flags & SORTED_RIGHT) {
+            if ((curr = prev_pivot(ls, curr)) == NULL)
+                return -2;
+        }
+        return curr->idx < 0 ? -1 : curr->idx - 1;
+    }
+    else {
+        curr = left;
+        while (curr->flags & SORTED_LEFT) {
+            if ((curr = next_pivot(ls, curr)) == NULL)
                 return -2;
+        }
+        return curr->idx < LS_SIZE(ls) ? curr->idx + 1 : LS_SIZE(ls);
+    }
+}
+
+/* Sorts the unsorted regions of unboxed data between the pivot current, whose
+ * next pivot is next, and the first pivot at or after stop, all at once so
+ * that threads can share them. Sorting unboxed data can't fail, so this only
+ * fails for lack of memory, before touching anything, returning -1. */
+static int sort_gaps(LSObject *, PivotNode *, PivotNode *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_gaps(LSObject *ls, PivotNode *current, PivotNode *next, Py_ssize_t stop)
+{
+    TaskPool tp;
+    Task task;
+    PivotNode *a, *b;
+    Py_ssize_t n, total = 0;
+
+    tasks_init(&tp, ls);
+    task.ks = NULL;
+    task.nk = task.work = 0;
+    for (a = current; a->idx < stop; a = b) {
+        if ((b = a == current ? next : next_pivot(ls, a)) == NULL) {
+            tasks_clear(&tp);
+            return -1;
+        }
+        if (a->flags & SORTED_LEFT || b->idx - a->idx <= 2)
+            continue;
+        task.left = a->idx + 1;
+        task.right = b->idx;
+        task.depth = 0;
+        for (n = task.right - task.left; n > 1; n >>= 1)
+            task.depth += 2;
+        if (push_task(&tp, &task) < 0) {
+            tasks_clear(&tp);
+            PyErr_NoMemory();
+            return -1;
+        }
+        total += task.right - task.left;
+    }
+    finish_tasks(ls, &tp, total);
+
+    /* The loop above made all the nodes, so finding them again can't fail */
+    for (a = current; a->idx < stop; a = b) {
+        b = a == current ? next : next_pivot(ls, a);
+        a->flags |= SORTED_LEFT;
+        b->flags |= SORTED_RIGHT;
+    }
+    return 0;
+}
+
+/* Sorts the list ls sufficiently such that everything between indices start
+ * and stop is in sorted order. Returns 0 on success and -1 on error. */
+static int sort_range(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_range(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    /* The xs list is always partially sorted, with pivots partioning up the
+     * space, like in this picture:
+     *
+     * | ~~~~~ | ~~~ | ~~~~~ | ~~ | ~~~~~~~ |
+     *
+     * '|' indicates a pivot and '~~' indicates unsorted data.
+     *
+     * So we iterate through the regions bounding our data, and sort them.
+     */
+    int res;
+
+    assert(0 <= start && start < stop && stop <= LS_SIZE(ls));
+
+    /* Slices off either end of a long region, like the top few items, are
+     * cheapest to pick out with a heap */
+    if ((res = heap_range(ls, start, stop)) != 0)
+        return res < 0 ? -1 : 0;
+
+    /* Bounding the range at stop first leaves less to search for start. The
+     * partitions that find them are reused by the quicksorts in between, so
+     * they don't scan for the smallest or biggest items like sort_point. */
+    if (select_point(ls, stop, 1) < 0)
+        return -1;
+    if (select_point(ls, start, 1) < 0)
+        return -1;
+
+    PivotNode *current, *next, *prev;
+    if (bound_idx(ls, start, &current, &next) < 0)
+        return -1;
+    if (current->idx == start) {
+        if ((next = next_pivot(ls, current)) == NULL ||
+            (prev = prev_pivot(ls, current)) == NULL)
+            return -1;
+        /* An empty region before a pivot at start is trivially sorted, and
+         * saying so lets the pivot go */
+        if (prev->idx == start - 1) {
+            prev->flags |= SORTED_LEFT;
+            current->flags |= SORTED_RIGHT;
+        }
+    }
+
+    /* Unboxed gaps are sorted up front, leaving the loop pivots to remove */
+    if (ls->ops != NULL && !ls->worker &&
+        sort_gaps(ls, current, next, stop) < 0)
+        return -1;
+
+    while (current->idx < stop) {
+        if (current->flags & SORTED_LEFT) {
+            assert(next->flags & SORTED_RIGHT);
+        }
+        else {
+            /* Since we are sorting the entire region, we don't need to keep
+             * track of pivots, and so we can use vanilla quicksort */
+            if (quick_sort(ls, current->idx + 1, next->idx) < 0) {
+                return -1;    
+            }
+            current->flags |= SORTED_LEFT;
+            next->flags |= SORTED_RIGHT;
+        }
+
+        if (current->flags & SORTED_RIGHT) {
+            remove_pivot(ls, current);
+        }
+
+        current = next;
+        if (current->idx < stop && (next = next_pivot(ls, current)) == NULL)
+            return -1;
+    }
+
+    assert(current->flags & SORTED_RIGHT);
+    if (current->flags & SORTED_LEFT) {
+        remove_pivot(ls, current);
+    }
+
+    return 0;
+}
+
+/* Does sort_points for unboxed data big enough to share between threads. The
+ * indices are grouped by the region they're in, and the threads select them
+ * all without the GIL before they become pivots. */
+static int select_parallel(LSObject *, Py_ssize_t *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+select_parallel(LSObject *ls, Py_ssize_t *ks, Py_ssize_t nk)
+{
+    TaskPool tp;
+    Task task;
+    PivotNode *left, *right;
+    Py_ssize_t i, j, total = 0;
+
+    PREPARE(ls) {
+        return -1;
+    }
+
+    tasks_init(&tp, ls);
+    task.depth = 0;
+    for (i = 0; i < nk; i = j) {
+        if (bound_idx(ls, ks[i], &left, &right) < 0) {
+            tasks_clear(&tp);
+            return -1;
+        }
+        j = i + 1;
+        if (left->idx == ks[i])
+            continue;
+        while (j < nk && ks[j] < right->idx)
+            j++;
+        if (right->flags & SORTED_RIGHT)
+            continue;
+        task.left = left->idx + 1;
+        task.right = right->idx;
+        task.ks = ks + i;
+        task.nk = j - i;
+        task.work = WORK_LIMIT * (task.right - task.left);
+        if (push_task(&tp, &task) < 0) {
+            tasks_clear(&tp);
+            PyErr_NoMemory();
+            return -1;
+        }
+        total += task.right - task.left;
+    }
+    finish_tasks(ls, &tp, total);
+
+    /* Each index now holds its sorted item, so can be a pivot */
+    for (i = 0; i < nk; i++) {
+        if (i > 0 && ks[i] == ks[i - 1])
+            continue;
+        if (bound_idx(ls, ks[i], &left, &right) < 0)
+            return -1;
+        if (left->idx == ks[i] || right->flags & SORTED_RIGHT)
+            continue;
+        if (add_pivot(ls, ks[i], left, right) == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/* Sorts the list ls sufficiently such that each of the nk indices in ks, which
+ * must be in increasing order, holds its value in sorted order. This is
+ * multiple quickselect: selecting the middle index first leaves pivots behind
+ * that split the region around it, so the indices on each side only search
+ * their own side, and no region is partitioned more than once. Returns 0 on
+ * success and -1 on error. */
+static int sort_points(LSObject *, Py_ssize_t *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_points(LSObject *ls, Py_ssize_t *ks, Py_ssize_t nk)
+{
+    Py_ssize_t mid;
+
+    if (ls->ops != NULL && !ls->worker && nk > 1 &&
+        threads_for(LS_SIZE(ls)) > 1)
+        return select_parallel(ls, ks, nk);
+
+    while (nk > 0) {
+        mid = nk / 2;
+        if (sort_point(ls, ks[mid]) < 0)
+            return -1;
+        if (sort_points(ls, ks, mid) < 0)
+            return -1;
+        ks += mid + 1;
+        nk -= mid + 1;
+    }
+    return 0;
+}
+
+/* Returns 1 if the item at index i comes before the boundary that find_bound
+ * is looking for, 0 if not, or -1 on error. See find_bound. */
+static int
+key_before(LSObject *ls, Py_ssize_t i, PyObject *key, int after,
+           lessthanfunc lt)
+{
+    int res;
+
+    if (!after)
+        return key_lt_probe(ls, i, key, lt);
+    if ((res = probe_lt_key(ls, key, i, lt)) < 0)
+        return -1;
+    return !res;
+}
+
+/* Like key_before, but for the pivot node, which may be one of the ends */
+static int
+pivot_before(LSObject *ls, PivotNode *node, PyObject *key, int after,
+             lessthanfunc lt)
+{
+    if (node->idx == -1)
+        return 1;
+    if (node->idx == LS_SIZE(ls))
+        return 0;
+    return key_before(ls, node->idx, key, after, lt);
+}
+
+/* Puts the adjacent pivots that the bound for key is between, as in
+ * find_bound, in *left and *right. Returns 0 on success or -1 on error. */
+static int bound_key(LSObject *, PyObject *, int, lessthanfunc, PivotNode **,
+                     PivotNode **)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+bound_key(LSObject *ls, PyObject *key, int after, lessthanfunc lt,
+          PivotNode **left, PivotNode **right)
+{
+    PivotNode *current = ls->root;
+    Py_ssize_t lo, hi, mid, pivot, left_idx, right_idx;
+    int before;
+
+    if (ls->bits.words == NULL) {
+        *left = NULL;
+        *right = NULL;
+        while (current != NULL) {
+            if ((before = pivot_before(ls, current, key, after, lt)) < 0)
+                return -1;
+            if (before) {
+                *left = current;
+                current = current->right;
+            }
+            else {
+                *right = current;
+                current = current->left;
+            }
+        }
+        return 0;
+    }
+
+    /* Binary search on the indices instead, where the only pivots between
+     * left_idx and right_idx are at indices from lo to hi. If there are none
+     * from lo to mid, there's nothing to compare with, and otherwise the last
+     * of them narrows the range at least as much as mid would. The bits give
+     * the pivots' indices, so the nodes are only looked up at the end. */
+    left_idx = -1;
+    right_idx = LS_SIZE(ls);
+    lo = 0;
+    hi = right_idx - 1;
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        pivot = bits_pred(&ls->bits, mid + 1) - 1;
+        if (pivot < lo) {
+            lo = mid + 1;
+            continue;
+        }
+
+        if ((before = key_before(ls, pivot, key, after, lt)) < 0)
+            return -1;
+        if (before) {
+            left_idx = pivot;
+            lo = mid + 1;
+        }
+        else {
+            right_idx = pivot;
+            hi = pivot - 1;
+        }
+    }
+    if ((*left = bits_node(ls, left_idx)) == NULL ||
+        (*right = bits_node(ls, right_idx)) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Returns the number of items that come before key in sorted order if after
+ * is 0, or the number that don't come after it if after is 1, like
+ * bisect_left and bisect_right on the sorted list, or -1 on error. If it turns
+ * up the other bound along the way, it puts it in *other, or else -1.
+ *
+ * The bound is between two adjacent pivots. If the region between them is
+ * sorted, it's found by binary search. Otherwise the region is partitioned,
+ * and since all the items on one side of the pivot's run are on the same side
+ * of the bound as it, only the other side needs to be searched. So this
+ * partitions only as far as needed to pin the bound down. If the pivot turns
+ * out to be equal to key, the items equal to it are gathered, which finds both
+ * bounds at once. */
+static Py_ssize_t find_bound(LSObject *, PyObject *, int, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+find_bound(LSObject *ls, PyObject *key, int after, Py_ssize_t *other)
+{
+    PivotNode *left, *right, *current;
+    Py_ssize_t xs_len = LS_SIZE(ls);
+    Py_ssize_t lo, hi, mid, lt, gt;
+    Py_ssize_t work;
+    int before, whole, eq;
+
+    *other = -1;
+
+    /* The data may be specialized for a kind of key that key isn't */
+    lessthanfunc probe_lt = ls->lt;
+    if (!key_fits(ls, key))
+        probe_lt = ls->reverse ? generic_gt : generic_lt;
+
+    if (bound_key(ls, key, after, probe_lt, &left, &right) < 0)
+        return -1;
+
+    /* If the pivot next to the bound is at the end of a run equal to key, the
+     * bound is right there */
+    current = after ? left : right;
+    if (current->flags & (after ? RUN_END : RUN_START)) {
+        eq = after ? key_lt_probe(ls, current->idx, key, probe_lt)
+                   : probe_lt_key(ls, key, current->idx, probe_lt);
+        if (eq < 0)
+            return -1;
+        if (!eq)
+            return after ? current->idx + 1 : current->idx;
+    }
+
+    work = WORK_LIMIT * (right->idx - left->idx);
+    while (!(left->flags & SORTED_LEFT) &&
+           left->idx + 1 + SORT_THRESH <= right->idx) {
+        if (work > 0) {
+            work -= right->idx - left->idx;
+            if ((whole = partition_region(ls, left->idx + 1, right->idx,
+                                          &lt, &gt)) < 0) {
+                return -1;
+            }
+        }
+        else {
+            if (fallback_partition(ls, left->idx + 1, right->idx,
+                                   &lt, &gt) < 0) {
+                return -1;
+            }
+            whole = 1;
+        }
+
+        /* key_before says which of key < pivot and pivot < key is false,
+         * and if the other one is too, key is equal to the pivot */
+        if ((before = key_before(ls, lt, key, after, probe_lt)) < 0)
+            return -1;
+        if (before == after) {
+            eq = after ? key_lt_probe(ls, lt, key, probe_lt)
+                       : probe_lt_key(ls, key, lt, probe_lt);
+            if (eq < 0)
+                return -1;
+            eq = !eq;
+        }
+        else {
+            eq = 0;
+        }
+
+        if (eq) {
+            if (!whole) {
+                if ((lt = gather_equal(ls, left->idx + 1, lt, lt, 1)) < 0)
+                    return -1;
+                if ((gt = gather_equal(ls, gt, right->idx, lt, 0)) < 0)
+                    return -1;
+            }
+            /* The other bound is at the other end of the run, unless the
+             * pivot bounding the region there might be equal to it too */
+            if (after ? left->idx < 0 || lt > left->idx + 1
+                      : right->idx == xs_len || gt < right->idx)
+                *other = after ? lt : gt;
+            if (narrow(ls, lt, gt, lt, 1, &left, &right) < 0)
+                return -1;
+            return after ? gt : lt;
+        }
+
+        if (narrow(ls, lt, gt, before ? gt : lt - 1, whole, &left,
+                   &right) < 0)
+            return -1;
+    }
+
+    lo = left->idx + 1;
+    hi = right->idx;
+    if (!(left->flags & SORTED_LEFT)) {
+        if (insertion_sort(ls, lo, hi) < 0)
+            return -1;
+        left->flags |= SORTED_LEFT;
+        right->flags |= SORTED_RIGHT;
+        depivot(ls, left, right);
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((before = key_before(ls, mid, key, after, probe_lt)) < 0)
+            return -1;
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns a new reference to the key of item, which is item itself if there's
+ * no key function, or NULL on error */
+static PyObject *probe_key(LSObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static PyObject *
+probe_key(LSObject *ls, PyObject *item)
+{
+    PyObject *busy_res;
+
+    if (ls->keyfunc == NULL) {
+        Py_INCREF(item);
+        return item;
+    }
+    return BUSY(ls, PyObject_CallFunctionObjArgs(ls->keyfunc, item, NULL));
+}
+
+/* Puts the bounds of the items whose keys are equal to item's key in *lo and
+ * *hi, as in find_bound. Either of lo and hi may be NULL if that bound isn't
+ * wanted. Returns 0 on success or -1 on error. */
+static int equal_range(LSObject *, PyObject *, Py_ssize_t *, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+equal_range(LSObject *ls, PyObject *item, Py_ssize_t *lo, Py_ssize_t *hi)
+{
+    PyObject *key;
+    Py_ssize_t other = -1;
+
+    PREPARE(ls) {
+        return -1;
+    }
+    if ((key = probe_key(ls, item)) == NULL)
+        return -1;
+
+    if (lo != NULL && (*lo = find_bound(ls, key, 0, &other)) < 0)
+        goto fail;
+    if (hi != NULL) {
+        if (other >= 0)
+            *hi = other;
+        else if ((*hi = find_bound(ls, key, 1, &other)) < 0)
+            goto fail;
+    }
+    Py_DECREF(key);
+    return 0;
+
+fail:
+    Py_DECREF(key);
+    return -1;
+}
+
+/* Returns the first index of item in the list, or -2 on error, or -1 if item
+ * is not present. Without a key function, that's the first item whose key is
+ * equal to item's, if it's equal to item at all. With one, items with equal
+ * keys needn't be equal, so they're all checked. */
+static Py_ssize_t find_item(LSObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+find_item(LSObject *ls, PyObject *item)
+{
+    Py_ssize_t lo, hi, k;
+    int cmp;
+
+    if (ls->keyfunc == NULL) {
+        if (equal_range(ls, item, &lo, NULL) < 0)
+            return -2;
+        hi = lo < LS_SIZE(ls) ? lo + 1 : lo;
+    }
+    else if (equal_range(ls, item, &lo, &hi) < 0) {
+        return -2;
+    }
+
+    for (k = lo; k < hi; k++) {
+        if ((cmp = item_eq(ls, item, k)) < 0)
+            return -2;
+        if (cmp)
+            return k;
+    }
+    return -1;
+}
+
+/* Mutation. New items go in the gaps between the pivots around their keys, and
+ * the items after them shift up to make room, so the partitioning done so far
+ * still holds. */
+
+/* Sets an error and returns -1 if ls can't add or remove items: if it's in
+ * the middle of calling python code, which mustn't modify it underneath the
+ * call, if a view's buffer points into its items, or if it sorts indices,
+ * which would stop being the indices of anything. Returns 0 if it can. */
+static int
+check_can_change(LSObject *ls)
+{
+    if (ls->perm != NULL && ls->where == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "LazySorted with return_indices can't change");
+        return -1;
+    }
+    if (ls->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted modified during a comparison");
+        return -1;
+    }
+    if (ls->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "LazySorted can't change while a view exports its "
+                        "buffer");
+        return -1;
+    }
+    return 0;
+}
+
+/* Moves count items, and their keys, from index src to index dst */
+static void
+move_items(LSObject *ls, Py_ssize_t dst, Py_ssize_t src, Py_ssize_t count)
+{
+    Py_ssize_t i;
+
+    if (ls->perm != NULL) {
+        memmove(ls->perm + dst, ls->perm + src, count * sizeof(Py_ssize_t));
+        if (ls->where != NULL) {
+            for (i = dst; i < dst + count; i++)
+                ls->where[ls->perm[i]] = i;
+        }
+        return;
+    }
+    if (ls->ops != NULL) {
+        memmove((char *)ls->data + dst * ls->ops->itemsize,
+                (char *)ls->data + src * ls->ops->itemsize,
+                count * ls->ops->itemsize);
+        return;
+    }
+    memmove(ls->xs->ob_item + dst, ls->xs->ob_item + src,
+            count * sizeof(PyObject *));
+    if (ls->keys != NULL)
+        memmove(ls->keys + dst, ls->keys + src, count * sizeof(PyObject *));
+}
+
+/* Builds bitvectors in *pb for n items from those of ls, as they will be once
+ * new items go in before each of the sorted indices in shifts, and the item at
+ * index removed, if it's not -1, comes out, along with its pivot. Returns 0 on
+ * success or -1 on error. */
+static int rebuild_bits(LSObject *, PivotBits *, Py_ssize_t, Py_ssize_t *,
+                        Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+rebuild_bits(LSObject *ls, PivotBits *pb, Py_ssize_t n, Py_ssize_t *shifts,
+             Py_ssize_t n_shifts, Py_ssize_t removed)
+{
+    PivotBits *old = &ls->bits;
+    Py_ssize_t p, q, k = 0;
+
+    if (bits_init(pb, n) < 0)
+        return -1;
+    for (p = 0; p >= 0; p = bits_succ(old, p + 1)) {
+        while (k < n_shifts && shifts[k] <= p - 1)
+            k++;
+        if (p - 1 == removed && removed >= 0)
+            continue;
+        q = p + k - (removed >= 0 && p - 1 > removed);
+        bits_set(pb, q - 1);
+        if (BIT_GET(old->sorted, p))
+            BIT_SET(pb->sorted, q);
+        if (BIT_GET(old->run_start, p))
+            BIT_SET(pb->run_start, q);
+        if (BIT_GET(old->run_end, p))
+            BIT_SET(pb->run_end, q);
+    }
+    return 0;
+}
+
+/* Returns where the pivot at index idx goes when new items go in before each
+ * of the sorted indices in shifts, and the item at index removed, if it's not
+ * -1, comes out */
+static Py_ssize_t
+shifted_idx(Py_ssize_t idx, Py_ssize_t *shifts, Py_ssize_t n_shifts,
+            Py_ssize_t removed)
+{
+    Py_ssize_t lo = 0, hi = n_shifts, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (shifts[mid] <= idx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return idx + lo - (removed >= 0 && idx > removed);
+}
+
+/* Moves the pivots of ls along with the items, as in shifted_idx. A pivot at
+ * removed must be gone already. For big lists, that's the nodes made for
+ * them, while pb, from rebuild_bits, takes the place of the bitvectors. */
+static void
+shift_pivots(LSObject *ls, PivotBits *pb, Py_ssize_t *shifts,
+             Py_ssize_t n_shifts, Py_ssize_t removed)
+{
+    PivotBits *bits = &ls->bits;
+    PivotNode *node, *next, *nodes = NULL;
+    Py_ssize_t i;
+
+    if (bits->words == NULL) {
+        for (node = ls->root; node->left != NULL; node = node->left)
+            ;
+        for (; node != NULL; node = node->next)
+            node->idx = shifted_idx(node->idx, shifts, n_shifts, removed);
+        return;
+    }
+
+    /* The nodes are hashed by index, so they all come out and go back in */
+    for (i = 0; i < bits->n_table; i++) {
+        for (node = bits->table[i]; node != NULL; node = next) {
+            next = node->left;
+            node->left = nodes;
+            nodes = node;
+        }
+        bits->table[i] = NULL;
+    }
+    pb->table = bits->table;
+    pb->n_table = bits->n_table;
+    pb->n_live = 0;
+    PyMem_Free(bits->words);
+    *bits = *pb;
+    for (node = nodes; node != NULL; node = next) {
+        next = node->left;
+        node->idx = shifted_idx(node->idx, shifts, n_shifts, removed);
+        bits_hash(bits, node);
+    }
+}
+
+/* Returns a new reference to the key to compare a new item by, making sure ls
+ * can compare it, or NULL on error. Unboxed items are converted into
+ * values[j] first, and compared as they'll be stored. */
+static PyObject *
+new_key(LSObject *ls, PyObject *item, void *values, Py_ssize_t j)
+{
+    PyObject *key;
+
+    if (ls->ops != NULL) {
+        if (ls->ops->unbox(values, j, item) < 0)
+            return NULL;
+        key = ls->ops->box(values, j);
+    }
+    else {
+        key = probe_key(ls, item);
+    }
+    if (key != NULL)
+        widen_kind(ls, key);
+    return key;
+}
+
+/* Puts the index that a new item with the given key should go before in
+ * *idx, and the pivots around it in *left and *right. An item in an unsorted
+ * region goes at the end of it, and one in a sorted region goes in its place
+ * by binary search, so the region stays sorted. Returns 0 on success or -1 on
+ * error. */
+static int
+place_item(LSObject *ls, PyObject *key, Py_ssize_t *idx, PivotNode **left,
+           PivotNode **right)
+{
+    Py_ssize_t lo, hi, mid;
+    int before;
+
+    if (bound_key(ls, key, 0, ls->lt, left, right) < 0)
+        return -1;
+    lo = (*left)->idx + 1;
+    hi = (*right)->idx;
+    if (!((*left)->flags & SORTED_LEFT))
+        lo = hi;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((before = key_before(ls, mid, key, 0, ls->lt)) < 0)
+            return -1;
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return 0;
+}
+
+/* Where a new item goes: it's the jth one given, and it goes before the item
+ * at index idx, between the pivots left and right */
+typedef struct {
+    Py_ssize_t idx;
+    Py_ssize_t j;
+    PivotNode *left;
+    PivotNode *right;
+} Insertion;
+
+static int
+compare_insertions(const void *a, const void *b)
+{
+    const Insertion *x = (const Insertion *)a;
+    const Insertion *y = (const Insertion *)b;
+    if (x->idx != y->idx)
+        return x->idx < y->idx ? -1 : 1;
+    return x->j < y->j ? -1 : (x->j > y->j ? 1 : 0);
+}
+
+/* Adds the items of seq, which is a list or tuple, to ls. Everything that can
+ * fail happens before anything changes, so on error ls is left as it was.
+ * Returns 0 on success or -1 on error. Sorted regions stay sorted unless two
+ * new items land in the same place. */
+static int insert_items(LSObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+insert_items(LSObject *ls, PyObject *seq)
+{
+    Py_ssize_t m = PySequence_Fast_GET_SIZE(seq);
+    Py_ssize_t n = LS_SIZE(ls);
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    PyObject **keys = NULL;
+    void *values = NULL, *grown;
+    Insertion *ins = NULL;
+    Py_ssize_t *shifts = NULL;
+    PivotBits bits;
+    Py_ssize_t j, k, lo, src_end;
+
+    bits.words = NULL;
+    if (m == 0)
+        return 0;
+    if (check_can_change(ls) < 0)
+        return -1;
+    PREPARE(ls) {
+        return -1;
+    }
+
+    ins = (Insertion *)PyMem_Malloc(m * sizeof(Insertion));
+    shifts = (Py_ssize_t *)PyMem_Malloc(m * sizeof(Py_ssize_t));
+    keys = (PyObject **)PyMem_Malloc(m * sizeof(PyObject *));
+    if (ls->ops != NULL)
+        values = PyMem_Malloc(m * ls->ops->itemsize);
+    if (ins == NULL || shifts == NULL || keys == NULL ||
+        (ls->ops != NULL && values == NULL)) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    memset(keys, 0, m * sizeof(PyObject *));
+
+    /* All the keys come first, so that they're all compared the same way */
+    for (j = 0; j < m; j++) {
+        if ((keys[j] = new_key(ls, items[j], values, j)) == NULL)
+            goto fail;
+    }
+    for (j = 0; j < m; j++) {
+        if (place_item(ls, keys[j], &ins[j].idx, &ins[j].left,
+                       &ins[j].right) < 0)
+            goto fail;
+        ins[j].j = j;
+    }
+    qsort(ins, m, sizeof(Insertion), compare_insertions);
+    for (k = 0; k < m; k++)
+        shifts[k] = ins[k].idx;
+
+    if (ls->bits.words != NULL &&
+        rebuild_bits(ls, &bits, n + m, shifts, m, -1) < 0)
+        goto fail;
+    if (ls->keys != NULL) {
+        grown = PyMem_Realloc(ls->keys, (n + m) * sizeof(PyObject *));
+        if (grown == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        ls->keys = (PyObject **)grown;
+    }
+    if (ls->ops != NULL) {
+        grown = PyMem_Realloc(ls->data, (n + m) * ls->ops->itemsize);
+        if (grown == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        ls->data = grown;
+    }
+    /* The list holds the new references, at the end for now */
+    else if (PyList_SetSlice((PyObject *)ls->xs, n, n, seq) < 0) {
+        goto fail;
+    }
+
+    /* Nothing fails from here on. Regions that get new items are only still
+     * sorted if no two of them went in the same place, and the pivots after
+     * new items might now be equal to an item before them. */
+    for (k = 0; k < m; k++) {
+        if ((k > 0 && ins[k - 1].idx == ins[k].idx) ||
+            (k + 1 < m && ins[k + 1].idx == ins[k].idx)) {
+            ins[k].left->flags &= ~SORTED_LEFT;
+            ins[k].right->flags &= ~SORTED_RIGHT;
+        }
+        ins[k].right->flags &= ~RUN_START;
+    }
+
+    /* Fill in from the back, so that each old item moves only once */
+    src_end = n;
+    for (k = m - 1; k >= 0; k--) {
+        lo = ins[k].idx;
+        j = ins[k].j;
+        move_items(ls, lo + k + 1, lo, src_end - lo);
+        src_end = lo;
+        if (ls->ops != NULL) {
+            memcpy((char *)ls->data + (lo + k) * ls->ops->itemsize,
+                   (char *)values + j * ls->ops->itemsize,
+                   ls->ops->itemsize);
+        }
+        else {
+            ls->xs->ob_item[lo + k] = items[j];
+            if (ls->keys != NULL) {
+                ls->keys[lo + k] = keys[j];
+                keys[j] = NULL;
+            }
+        }
+    }
+
+    shift_pivots(ls, &bits, shifts, m, -1);
+    if (ls->ops != NULL)
+        ls->data_len += m;
+    /* An empty list has no kind to keep, so the next query picks one */
+    else if (n == 0)
+        ls->prepared = 0;
+    if (ls->shared_len >= 0) {
+        ls->shared_len += m;
+        ls->shared_items = ls->xs->ob_item;
+    }
+    ls->version++;
+    assert_flags(ls, ins[0].left);
+
+    for (j = 0; j < m; j++)
+        Py_XDECREF(keys[j]);
+    PyMem_Free(keys);
+    PyMem_Free(values);
+    PyMem_Free(shifts);
+    PyMem_Free(ins);
+    return 0;
+
+fail:
+    bits_clear(&bits);
+    if (keys != NULL) {
+        for (j = 0; j < m; j++)
+            Py_XDECREF(keys[j]);
+    }
+    PyMem_Free(keys);
+    PyMem_Free(values);
+    PyMem_Free(shifts);
+    PyMem_Free(ins);
+    return -1;
+}
+
+/* Removes the item at index k. Removing an item never puts any others out of
+ * place, so only a pivot at k needs special care: the regions on either side
+ * of it merge, and stay sorted only if both were. Returns 0 on success or -1
+ * on error, in which case ls is unchanged. */
+static int delete_at(LSObject *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+delete_at(LSObject *ls, Py_ssize_t k)
+{
+    Py_ssize_t n = LS_SIZE(ls);
+    PivotNode *left, *right, *node = NULL;
+    PyObject *item = NULL, *key = NULL;
+    PivotBits bits;
+
+    bits.words = NULL;
+    if (check_can_change(ls) < 0)
+        return -1;
+
+    if (bound_idx(ls, k, &left, &right) < 0)
+        return -1;
+    if (left->idx == k) {
+        node = left;
+        if ((left = prev_pivot(ls, node)) == NULL ||
+            (right = next_pivot(ls, node)) == NULL)
+            return -1;
+    }
+    if (ls->bits.words != NULL &&
+        rebuild_bits(ls, &bits, n - 1, NULL, 0, k) < 0)
+        return -1;
+
+    /* The item is released last, since that can run arbitrary code */
+    if (ls->ops == NULL) {
+        item = ls->xs->ob_item[k];
+        Py_INCREF(item);
+        if (PyList_SetSlice((PyObject *)ls->xs, k, k + 1, NULL) < 0) {
+            Py_DECREF(item);
+            bits_clear(&bits);
+            return -1;
+        }
+        if (ls->keys != NULL) {
+            key = ls->keys[k];
+            memmove(ls->keys + k, ls->keys + k + 1,
+                    (n - k - 1) * sizeof(PyObject *));
+        }
+        if (ls->shared_len >= 0) {
+            ls->shared_len--;
+            ls->shared_items = ls->xs->ob_item;
+        }
+    }
+    else {
+        move_items(ls, k, k + 1, n - k - 1);
+        ls->data_len--;
+    }
+
+    if (node != NULL) {
+        if (!(left->flags & SORTED_LEFT) || !(node->flags & SORTED_LEFT)) {
+            left->flags &= ~SORTED_LEFT;
+            right->flags &= ~SORTED_RIGHT;
+        }
+        remove_pivot(ls, node);
+    }
+    shift_pivots(ls, &bits, NULL, 0, k);
+    ls->version++;
+    assert_flags(ls, right);
+
+    Py_XDECREF(key);
+    Py_XDECREF(item);
+    return 0;
+}
+
+/* Makes the nodes for the pivots of a big list from the last one before
+ * index lo to the first one after index hi, or the last pivot, so that
+ * replace_at can walk them without failing. Returns 0 on success or -1 on
+ * error. */
+static int make_nodes(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+make_nodes(LSObject *ls, Py_ssize_t lo, Py_ssize_t hi)
+{
+    Py_ssize_t p = bits_pred(&ls->bits, lo);
+
+    while (1) {
+        if (bits_node(ls, p - 1) == NULL)
+            return -1;
+        if (p - 1 > hi || p - 1 == LS_SIZE(ls))
+            return 0;
+        p = bits_succ(&ls->bits, p + 1);
+    }
+}
+
+/* Moves the hole left by an item at index hole to index to in the same gap.
+ * The items of a sorted gap shift over to keep their order, but those of an
+ * unsorted one can go anywhere, so only the item at to moves. */
+static void
+move_hole(LSObject *ls, Py_ssize_t hole, Py_ssize_t to, int sorted)
+{
+    if (hole == to)
+        return;
+    if (!sorted)
+        move_items(ls, hole, to, 1);
+    else if (hole < to)
+        move_items(ls, hole, hole + 1, to - hole);
+    else
+        move_items(ls, to + 1, to, hole - to);
+}
+
+/* Replaces the item at index k with item, which goes wherever it belongs.
+ * This is like delete_at and then insert_items, but the old item leaves a
+ * hole that travels to the new one's place a gap at a time. Crossing an
+ * unsorted gap takes one item from its far end, and crossing a pivot moves it
+ * over by one, so only the items of sorted gaps shift, and each step of a
+ * rolling window costs about the number of pivots in between. A window sorts
+ * indices, and the new item takes the old one's index. Returns 0 on success or
+ * -1 on error, in which case ls is unchanged. */
+static int replace_at(LSObject *, Py_ssize_t, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+replace_at(LSObject *ls, Py_ssize_t k, PyObject *item)
+{
+    Py_ssize_t d, hole, dst, slot;
+    PyObject *key, *old = NULL, *old_key = NULL;
+    unsigned long long value[2];    /* Room for any unboxed type */
+    PivotNode *left, *right, *node, *next, *gone = NULL;
+    int sorted;
+
+    if (check_can_change(ls) < 0)
+        return -1;
+    PREPARE(ls) {
+        return -1;
+    }
+    if ((key = new_key(ls, item, value, 0)) == NULL)
+        return -1;
+    if (place_item(ls, key, &d, &left, &right) < 0)
+        goto fail;
+    if (bound_idx(ls, k, &node, &next) < 0)
+        goto fail;
+    if (node->idx == k) {
+        gone = node;
+        if ((node = prev_pivot(ls, gone)) == NULL ||
+            (next = next_pivot(ls, gone)) == NULL)
+            goto fail;
+    }
+
+    /* Making nodes for the pivots the hole crosses takes memory, so big lists
+     * make them up front */
+    if (ls->bits.words != NULL &&
+        make_nodes(ls, d < k ? d : k, d < k ? k : d) < 0)
+        goto fail;
+
+    /* Nothing fails from here on. The flags change as in insert_items and
+     * delete_at. */
+    right->flags &= ~RUN_START;
+    if (gone != NULL) {
+        if (!(node->flags & SORTED_LEFT) || !(gone->flags & SORTED_LEFT)) {
+            node->flags &= ~SORTED_LEFT;
+            next->flags &= ~SORTED_RIGHT;
+        }
+        remove_pivot(ls, gone);
+    }
+
+    slot = ls->perm != NULL ? ls->perm[k] : k;
+    if (ls->ops == NULL) {
+        old = ls->xs->ob_item[slot];
+        if (ls->keys != NULL)
+            old_key = ls->keys[slot];
+    }
+    hole = k;
+    sorted = node->flags & SORTED_LEFT;
+    if (d > k) {
+        /* The pivots in between shift down, each into the end of the gap
+         * before it */
+        for (node = next; node->idx < d; node = next_pivot(ls, node)) {
+            move_hole(ls, hole, node->idx - 1, sorted);
+            move_items(ls, node->idx - 1, node->idx, 1);
+            hole = node->idx;
+            if (ls->bits.words != NULL)
+                bits_move(&ls->bits, node, hole - 1);
+            else
+                node->idx--;
+            sorted = node->flags & SORTED_LEFT;
+        }
+        dst = d - 1;
+    }
+    else {
+        /* Or up, into the start of the gap after them */
+        for (; node->idx >= d; node = prev_pivot(ls, node)) {
+            move_hole(ls, hole, node->idx + 1, sorted);
+            move_items(ls, node->idx + 1, node->idx, 1);
+            hole = node->idx;
+            if (ls->bits.words != NULL)
+                bits_move(&ls->bits, node, hole + 1);
+            else
+                node->idx++;
+            sorted = prev_pivot(ls, node)->flags & SORTED_LEFT;
+        }
+        dst = d;
+    }
+
+    /* The new item can go anywhere in an unsorted gap */
+    if (sorted)
+        move_hole(ls, hole, dst, 1);
+    else
+        dst = hole;
+    if (ls->ops != NULL) {
+        memcpy((char *)ls->data + dst * ls->ops->itemsize, value,
+               ls->ops->itemsize);
+    }
+    else {
+        if (ls->perm != NULL) {
+            ls->perm[dst] = slot;
+            ls->where[slot] = dst;
+        }
+        else {
+            slot = dst;
+        }
+        Py_INCREF(item);
+        ls->xs->ob_item[slot] = item;
+        if (ls->keys != NULL) {
+            ls->keys[slot] = key;
+            key = NULL;
+        }
+    }
+
+    ls->version++;
+    assert_flags(ls, next);
+
+    Py_XDECREF(key);
+    Py_XDECREF(old_key);
+    Py_XDECREF(old);
+    return 0;
+
+fail:
+    Py_DECREF(key);
+    return -1;
+}
+
+/* Public facing LazySorted methods */
+
+/* Made when the module is loaded, so threads never race to make it */
+static PyObject *idxerr = NULL;
+
+/* Sets an IndexError for an index out of range, and returns NULL */
+static PyObject *
+index_error(void)
+{
+    PyErr_SetObject(PyExc_IndexError, idxerr);
+    return NULL;
+}
+
+static int
+compare_ssize(const void *a, const void *b)
+{
+    Py_ssize_t x = *(const Py_ssize_t *)a;
+    Py_ssize_t y = *(const Py_ssize_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Returns 1 if the items from index start up to stop are all in their sorted
+ * places, or 0 if some might not be. This is for readers that don't hold ls,
+ * so it doesn't make nodes for the pivots of big lists, and reads their flags
+ * from the bitvectors, which only hold them all once the nodes made since ls
+ * was last unlocked are gone. */
+static int
+in_place(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    PivotBits *pb = &ls->bits;
+    PivotNode *left, *right;
+    Py_ssize_t p;
+
+    assert(ls->depth == 0);
+    if (pb->n_live > 0)
+        return 0;
+    while (start < stop) {
+        if (pb->words != NULL) {
+            p = bits_pred(pb, start + 1);
+            if (p - 1 == start)
+                start++;
+            else if (BIT_GET(pb->sorted, p))
+                start = bits_succ(pb, p + 1) - 1;
+            else
+                return 0;
+        }
+        else {
+            if (bound_idx(ls, start, &left, &right) < 0)
+                return 0;
+            if (left->idx == start)
+                start++;
+            else if (left->flags & SORTED_LEFT)
+                start = right->idx;
+            else
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the item at index k if it's in its sorted place already and can be
+ * read without the lock, or NULL with no exception set if not */
+static PyObject *
+read_item(LSObject *ls, Py_ssize_t k)
+{
+    if (!CAN_READ(ls))
+        return NULL;
+    if (k < 0)
+        k += LS_SIZE(ls);
+    if (0 <= k && k < LS_SIZE(ls) && in_place(ls, k, k + 1))
+        return ls_item(ls, k);
+    return NULL;
+}
+
+/* Like read_item, but for a slice */
+static PyObject *
+read_slice(LSObject *ls, PyObject *slice)
+{
+    Py_ssize_t xs_len = LS_SIZE(ls);
+    Py_ssize_t start, stop, step, slicelength, lo, hi, k, j;
+    PyListObject *result;
+
+    if (!CAN_READ(ls))
+        return NULL;
+    if (PySlice_GetIndicesEx(slice, xs_len,
+                             &start, &stop, &step, &slicelength) < 0)
+        return NULL;
+    lo = step > 0 ? start : start + (slicelength - 1) * step;
+    hi = lo + (slicelength - 1) * (step > 0 ? step : -step) + 1;
+    if (slicelength <= 0 || !in_place(ls, lo, hi))
+        return NULL;
+
+    /* Making the list may run the garbage collector, which may run python
+     * code that uses ls, so it's checked again afterwards */
+    result = (PyListObject *)PyList_New(slicelength);
+    if (result == NULL)
+        return NULL;
+    if (!CAN_READ(ls) || LS_SIZE(ls) != xs_len || !in_place(ls, lo, hi)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    for (k = start, j = 0; j < slicelength; k += step, j++) {
+        if ((result->ob_item[j] = ls_item(ls, k)) == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+    return (PyObject *)result;
+}
+
+/* Does ls_subscript once self is locked, for the index i if item is NULL, or
+ * else for the slice item */
+static PyObject *
+subscript(LSObject* self, PyObject* item, Py_ssize_t i)
+{
+    Py_ssize_t xs_len = LS_SIZE(self);
+
+    if (item == NULL) {
+        if (i < 0)
+            i += xs_len;
+
+        if (i < 0 || i >= xs_len) {
+            return index_error();
+        }
+
+        if (sort_point(self, i) < 0)
+            return NULL;
+
+        return ls_item(self, i);
+    }
+    else {
+        Py_ssize_t start, stop, step, slicelength;
+
+        if (PySlice_GetIndicesEx(item, xs_len,
+                         &start, &stop, &step, &slicelength) < 0) {
+            return NULL;
+        }
+
+        if (slicelength <= 0) {
+            return PyList_New(0);
+        }
+        else if (-CONTIG_THRESH <= step && step <= CONTIG_THRESH) {
+            Py_ssize_t left = start < stop ? start : stop;
+            Py_ssize_t right = start < stop ? stop : start;
+
+            if (step < 0) {
+                left++;
+                right++;
+            }
+
+            if (sort_range(self, left, right) < 0) {
+                return NULL;
+            }
+
+            PyListObject *result = (PyListObject *)PyList_New(slicelength);
+            if (result == NULL)
+                return NULL;
+
+            Py_ssize_t k, j;
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                if ((result->ob_item[j] = ls_item(self, k)) == NULL) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+            }
+
+            return (PyObject *)result;
+        }
+        else {
+            /* Select all the indices at once, in increasing order */
+            Py_ssize_t *ks = (Py_ssize_t *)PyMem_Malloc(slicelength *
+                                                        sizeof(Py_ssize_t));
+            if (ks == NULL)
+                return PyErr_NoMemory();
+
+            Py_ssize_t k, j;
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                ks[step > 0 ? j : slicelength - 1 - j] = k;
+            }
+            if (sort_points(self, ks, slicelength) < 0) {
+                PyMem_Free(ks);
+                return NULL;
+            }
+            PyMem_Free(ks);
+
+            PyListObject *result = (PyListObject *)PyList_New(slicelength);
+            if (result == NULL)
+                return NULL;
+
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                if ((result->ob_item[j] = ls_item(self, k)) == NULL) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+            }
+
+            return (PyObject *)result;
+        }
+    }
+}
+
+static PyObject *
+ls_subscript(LSObject* self, PyObject* item)
+{
+    PyObject *res;
+    Py_ssize_t k = 0;
+
+    if (PyIndex_Check(item)) {
+        k = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if (k == -1 && PyErr_Occurred())
+            return NULL;
+        if ((res = read_item(self, k)) != NULL || PyErr_Occurred())
+            return res;
+        item = NULL;
+    }
+    else if (PySlice_Check(item)) {
+        if ((res = read_slice(self, item)) != NULL || PyErr_Occurred())
+            return res;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "list indices must be integers, not %.200s",
+                     item->ob_type->tp_name);
+        return NULL;
+    }
+
+    if (ls_enter(self) < 0)
+        return NULL;
+    res = subscript(self, item, k);
+    ls_unlock(self);
+    return res;
+}
+
+/* Returns a new list of the items from index left up to right, in their
+ * current order, or NULL on error */
+static PyObject *items_between(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static PyObject *
+items_between(LSObject *self, Py_ssize_t left, Py_ssize_t right)
+{
+    PyListObject *result = (PyListObject *)PyList_New(right - left);
+    if (result == NULL)
+        return NULL;
+
+    Py_ssize_t k;
+    for (k = left; k < right; k++) {
+        if ((result->ob_item[k - left] = ls_item(self, k)) == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+
+    return (PyObject *)result;
+}
+
+/* Clamps the indices *left and *right to the list, like a slice, and
+ * partitions around them so that the items in between are the ones that
+ * belong there. Returns 1 on success, 0 if the range is empty, or -1 on error.
+ */
+static int
+clamp_range(LSObject *self, Py_ssize_t *left, Py_ssize_t *right)
+{
+    Py_ssize_t xlen = LS_SIZE(self);
+    if (*left < 0) {
+        *left += xlen;
+        if (*left < 0)
+            *left = 0;
+    }
+    else if (*left > xlen) {
+        *left = xlen;
+    }
+
+    if (*right < 0) {
+        *right += xlen;
+    }
+    else if (*right > xlen) {
+        *right = xlen;
+    }
+
+    if (*left >= *right || *right <= 0) {
+        return 0;
+    }
+
+    if (*left != 0 && sort_point(self, *left) < 0)
+        return -1;
+    if (*right != xlen && sort_point(self, *right) < 0)
+        return -1;
+    return 1;
+}
+
+/* Parses the arguments of between and the like into *left and *right, and
+ * clamps the range they give */
+static int
+between_bounds(LSObject *self, PyObject *args, const char *format,
+               Py_ssize_t *left, Py_ssize_t *right)
+{
+    if (!PyArg_ParseTuple(args, format, left, right))
+        return -1;
+    return clamp_range(self, left, right);
+}
+
+/* Aggregates over ranges of ranks. These read the items in place, once the
+ * range is partitioned off, without making a list of them. */
+
+/* Neumaier's compensated addition of x to the sum *s, whose lost low-order
+ * bits are *c. Unlike Kahan's, it's exact when x is much bigger than *s. */
+static void
+fsum_add(double *s, double *c, double x)
+{
+    double t = *s + x;
+
+    if (fabs(*s) >= fabs(x))
+        *c += (*s - t) + x;
+    else
+        *c += (x - t) + *s;
+    *s = t;
+}
+
+/* Returns the item at index k, as a borrowed reference, which is the item the
+ * index refers to if ls sorts indices */
+static PyObject *
+value_at(LSObject *ls, Py_ssize_t k)
+{
+    return ls->xs->ob_item[ls->perm != NULL ? ls->perm[k] : k];
+}
+
+/* Returns the item at index k as a double, setting *x, or -1 on error */
+static int
+value_as_double(LSObject *ls, Py_ssize_t k, double *x)
+{
+    PyObject *item = value_at(ls, k);
+    double busy_res;
+
+    if (PyFloat_CheckExact(item)) {
+        *x = PyFloat_AS_DOUBLE(item);
+        return 0;
+    }
+    *x = BUSY(ls, PyFloat_AsDouble(item));
+    return *x == -1.0 && PyErr_Occurred() ? -1 : 0;
+}
+
+/* Puts the sums of x - shift and of its square, over the items x from left up
+ * to right, in sums[0] and sums[1]. Returns 0 on success and -1 on error. */
+static int range_moments(LSObject *, Py_ssize_t, Py_ssize_t, double, double *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+range_moments(LSObject *ls, Py_ssize_t left, Py_ssize_t right, double shift,
+              double *sums)
+{
+    double s = 0.0, c = 0.0, q = 0.0, cq = 0.0, d;
+    Py_ssize_t k;
+
+    if (ls->ops != NULL) {
+        if (ls->worker || right - left < NOGIL_THRESH)
+            ls->ops->moments(ls->data, left, right, shift, sums);
+        else
+            NOGIL(ls, ls->ops->moments(ls->data, left, right, shift, sums));
+        return 0;
+    }
+
+    for (k = left; k < right; k++) {
+        if (value_as_double(ls, k, &d) < 0)
+            return -1;
+        d -= shift;
+        fsum_add(&s, &c, d);
+        fsum_add(&q, &cq, d * d);
+    }
+    sums[0] = s + c;
+    sums[1] = q + cq;
+    return 0;
+}
+
+/* Adds hi * 2^32 + lo to the python number *total, replacing it. Returns 0
+ * on success and -1 on error. */
+static int
+add_halves(PyObject **total, long long hi, unsigned long long lo)
+{
+    PyObject *h = NULL, *l = NULL, *shift = NULL, *part = NULL, *sum = NULL;
+    int res = -1;
+
+    if ((h = PyLong_FromLongLong(hi)) == NULL ||
+        (l = PyLong_FromUnsignedLongLong(lo)) == NULL ||
+        (shift = PyInt_FromLong(32)) == NULL ||
+        (part = PyNumber_Lshift(h, shift)) == NULL ||
+        (sum = PyNumber_Add(part, l)) == NULL)
+        goto done;
+    Py_DECREF(part);
+    if ((part = PyNumber_Add(*total, sum)) == NULL)
+        goto done;
+#if PY_MAJOR_VERSION < 3
+    /* Sums of python 2 ints stay ints while they fit, as in sum(.) */
+    Py_DECREF(sum);
+    sum = part;
+    if ((part = PyNumber_Int(sum)) == NULL)
+        goto done;
+#endif
+    Py_DECREF(*total);
+    *total = part;
+    part = NULL;
+    res = 0;
+
+done:
+    Py_XDECREF(h);
+    Py_XDECREF(l);
+    Py_XDECREF(shift);
+    Py_XDECREF(part);
+    Py_XDECREF(sum);
+    return res;
+}
+
+/* Adds the exact sum of the unboxed integers from left up to right to *total,
+ * a chunk at a time so that int_sum can't overflow. Returns 0 on success, 1
+ * if they aren't integers, and -1 on error. */
+static int
+native_int_sum(LSObject *ls, Py_ssize_t left, Py_ssize_t right,
+               PyObject **total)
+{
+    const Py_ssize_t chunk = (Py_ssize_t)1 << 30;
+    long long hi;
+    unsigned long long lo;
+    Py_ssize_t stop;
+    int is_int;
+
+    for (; left < right; left = stop) {
+        stop = right - left > chunk ? left + chunk : right;
+        if (ls->worker || stop - left < NOGIL_THRESH)
+            is_int = ls->ops->int_sum(ls->data, left, stop, &hi, &lo);
+        else
+            NOGIL(ls, is_int = ls->ops->int_sum(ls->data, left, stop,
+                                                &hi, &lo));
+        if (!is_int)
+            return 1;
+        if (add_halves(total, hi, lo) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns (possibly unsorted) data in a specified contiguous range */
+static PyObject *
+between(LSObject *self, PyObject *args)
+{
+    Py_ssize_t left, right;
+    int res;
+
+    if ((res = between_bounds(self, args, "nn:list", &left, &right)) <= 0)
+        return res < 0 ? NULL : PyList_New(0);
+    return items_between(self, left, right);
+}
+
+/* Sets *x to the value of item and returns 1 if it's an int small enough to
+ * add up in a long long, or returns 0 if not */
+static int
+small_int(PyObject *item, long long *x)
+{
+    const long long limit = (long long)1 << 62;
+#if PY_MAJOR_VERSION >= 3
+    int overflow;
+
+    if (!PyLong_CheckExact(item))
+        return 0;
+    *x = PyLong_AsLongAndOverflow(item, &overflow);
+    if (overflow)
+        return 0;
+#else
+    if (!PyInt_CheckExact(item))
+        return 0;
+    *x = PyInt_AS_LONG(item);
+#endif
+    return -limit < *x && *x < limit;
+}
+
+/* Returns the sum of the items from left up to right, like sum(.) of them but
+ * more accurate: floats are added up with compensation, and integers exactly,
+ * in C while they fit. Anything else is added with python's addition. */
+static PyObject *
+range_sum(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    const long long limit = (long long)1 << 62;
+    PyObject *total = NULL, *ints, *item, *next, *busy_res;
+    double s = 0.0, c = 0.0, sums[2];
+    long long isum = 0, x;
+    int floats = 0, res;
+    Py_ssize_t k;
+
+    /* The ints add up by themselves, so that no python code can run */
+    if ((ints = PyInt_FromLong(0)) == NULL)
+        return NULL;
+
+    if (ls->ops != NULL) {
+        if ((res = native_int_sum(ls, left, right, &ints)) <= 0) {
+            if (res < 0)
+                Py_CLEAR(ints);
+            return ints;
+        }
+        Py_DECREF(ints);
+        if (range_moments(ls, left, right, 0.0, sums) < 0)
+            return NULL;
+        return PyFloat_FromDouble(sums[0]);
+    }
+
+    if ((total = PyInt_FromLong(0)) == NULL)
+        goto fail;
+    for (k = left; k < right; k++) {
+        item = value_at(ls, k);
+        if (PyFloat_CheckExact(item)) {
+            fsum_add(&s, &c, PyFloat_AS_DOUBLE(item));
+            floats = 1;
+        }
+        else if (small_int(item, &x)) {
+            if (isum <= -limit || isum >= limit) {
+                if (add_halves(&ints, isum >> 32, isum & 0xffffffffU) < 0)
+                    goto fail;
+                isum = 0;
             }
-            IFLT(ls->xs->ob_item[piv_idx], item) {
-                if (left->right == NULL) {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-                }
-                else {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-                }
-                if (middle == NULL)
-                    return -2;
+            isum += x;
+        }
+        else {
+            next = BUSY(ls, PyNumber_Add(total, item));
+            Py_DECREF(total);
+            if ((total = next) == NULL)
+                goto fail;
+        }
+    }
+
+    if (add_halves(&ints, isum >> 32, isum & 0xffffffffU) < 0)
+        goto fail;
+    if (floats) {
+        if ((item = PyFloat_FromDouble(s + c)) == NULL)
+            goto fail;
+        next = PyNumber_Add(ints, item);
+        Py_DECREF(item);
+        Py_DECREF(ints);
+        if ((ints = next) == NULL)
+            goto fail;
+    }
+    next = BUSY(ls, PyNumber_Add(total, ints));
+    Py_DECREF(total);
+    Py_DECREF(ints);
+    return next;
+
+fail:
+    Py_XDECREF(total);
+    Py_XDECREF(ints);
+    return NULL;
+}
+
+/* Returns the mean of the items from left up to right, which mustn't be empty
+ */
+static PyObject *
+range_mean(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject *sum, *count, *result;
+
+    if ((sum = range_sum(ls, left, right)) == NULL)
+        return NULL;
+    if ((count = PyInt_FromSsize_t(right - left)) == NULL) {
+        Py_DECREF(sum);
+        return NULL;
+    }
+    result = PyNumber_TrueDivide(sum, count);
+    Py_DECREF(sum);
+    Py_DECREF(count);
+    return result;
+}
+
+/* Returns the sum of the items between two indices */
+static PyObject *
+ls_sum_between(LSObject *self, PyObject *args)
+{
+    Py_ssize_t left, right;
+    int res;
+
+    if ((res = between_bounds(self, args, "nn:sum_between",
+                              &left, &right)) <= 0)
+        return res < 0 ? NULL : PyInt_FromLong(0);
+    return range_sum(self, left, right);
+}
+
+/* Returns the mean of the items between two indices */
+static PyObject *
+ls_mean_between(LSObject *self, PyObject *args)
+{
+    Py_ssize_t left, right;
+    int res;
+
+    if ((res = between_bounds(self, args, "nn:mean_between",
+                              &left, &right)) < 0)
+        return NULL;
+    if (res == 0) {
+        PyErr_SetString(PyExc_ValueError, "mean of an empty range");
+        return NULL;
+    }
+    return range_mean(self, left, right);
+}
+
+/* Returns the variance of the items between two indices, as a float. It's
+ * computed in two passes, the second adding up the squares of the distances
+ * from the mean, which loses much less precision than subtracting the square
+ * of the mean from the mean of the squares. */
+static PyObject *
+ls_var_between(LSObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *sum;
+    Py_ssize_t left, right, n, ddof = 0;
+    double mean, var, sums[2];
+    int res;
+    static char *kwdlist[] = {"i", "j", "ddof", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "nn|n:var_between", kwdlist,
+                                     &left, &right, &ddof))
+        return NULL;
+    if ((res = clamp_range(self, &left, &right)) < 0)
+        return NULL;
+    n = res ? right - left : 0;
+    if (n - ddof <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "variance needs more items than ddof");
+        return NULL;
+    }
+
+    if ((sum = range_sum(self, left, right)) == NULL)
+        return NULL;
+    mean = PyFloat_AsDouble(sum);
+    Py_DECREF(sum);
+    if (mean == -1.0 && PyErr_Occurred())
+        return NULL;
+    mean /= n;
+
+    /* The distances from the mean add up to about zero, and any difference
+     * corrects for rounding in the mean */
+    if (range_moments(self, left, right, mean, sums) < 0)
+        return NULL;
+    var = (sums[1] - sums[0] * sums[0] / n) / (n - ddof);
+    return PyFloat_FromDouble(var > 0.0 ? var : 0.0);
+}
+
+/* Returns the mean of the items from the alpha to the 1 - alpha quantiles */
+static PyObject *
+ls_trimmed_mean(LSObject *self, PyObject *arg)
+{
+    Py_ssize_t xs_len = LS_SIZE(self);
+    Py_ssize_t left, right;
+    double alpha;
+    int res;
+
+    alpha = PyFloat_AsDouble(arg);
+    if (alpha == -1.0 && PyErr_Occurred())
+        return NULL;
+    if (!(0.0 <= alpha && alpha < 0.5)) {
+        PyErr_SetString(PyExc_ValueError, "alpha must be in [0, 0.5)");
+        return NULL;
+    }
+    if (xs_len == 0) {
+        PyErr_SetString(PyExc_ValueError, "mean of an empty LazySorted");
+        return NULL;
+    }
+
+    left = (Py_ssize_t)floor(xs_len * alpha);
+    right = (Py_ssize_t)ceil(xs_len * (1 - alpha));
+    if ((res = clamp_range(self, &left, &right)) < 0)
+        return NULL;
+    return range_mean(self, left, right);
+}
+
+/* Returns the (possibly unsorted) items whose values are between lo and hi */
+static PyObject *
+ls_values_between(LSObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *lo, *hi, *lo_key, *hi_key;
+    PyObject *inclusive = NULL;
+    Py_ssize_t start, stop;
+    int incl;
+    static char *kwlist[] = {"lo", "hi", "inclusive", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O:values_between",
+                                     kwlist, &lo, &hi, &inclusive))
+        return NULL;
+    if ((incl = inclusive == NULL ? 0 : PyObject_IsTrue(inclusive)) < 0)
+        return NULL;
+
+    PREPARE(self) {
+        return NULL;
+    }
+    if ((lo_key = probe_key(self, lo)) == NULL)
+        return NULL;
+    if ((hi_key = probe_key(self, hi)) == NULL) {
+        Py_DECREF(lo_key);
+        return NULL;
+    }
+
+    /* The items from lo up to hi are the ones that come before hi, (or
+     * don't come after it, if inclusive), but not before lo. If the order is
+     * reversed, they're the ones that come after hi but not after lo. */
+    if (self->reverse) {
+        start = find_bound(self, hi_key, !incl, &stop);
+        stop = start < 0 ? -1 : find_bound(self, lo_key, 1, &stop);
+    }
+    else {
+        start = find_bound(self, lo_key, 0, &stop);
+        stop = start < 0 ? -1 : find_bound(self, hi_key, incl, &stop);
+    }
+    Py_DECREF(lo_key);
+    Py_DECREF(hi_key);
+    if (start < 0 || stop < 0)
+        return NULL;
+
+    if (start >= stop)
+        return PyList_New(0);
+    return items_between(self, start, stop);
+}
+
+/* Selects the items at the indices in ks, in any order, and returns them in a
+ * new list in the same order, or returns NULL on error */
+static PyObject *
+select_indices(LSObject *self, Py_ssize_t *ks, Py_ssize_t nk)
+{
+    PyListObject *result;
+    Py_ssize_t *sorted_ks, j;
+
+    sorted_ks = (Py_ssize_t *)PyMem_Malloc((nk ? nk : 1) * sizeof(Py_ssize_t));
+    if (sorted_ks == NULL)
+        return PyErr_NoMemory();
+    memcpy(sorted_ks, ks, nk * sizeof(Py_ssize_t));
+    qsort(sorted_ks, nk, sizeof(Py_ssize_t), compare_ssize);
+    if (sort_points(self, sorted_ks, nk) < 0) {
+        PyMem_Free(sorted_ks);
+        return NULL;
+    }
+    PyMem_Free(sorted_ks);
+
+    result = (PyListObject *)PyList_New(nk);
+    if (result == NULL)
+        return NULL;
+    for (j = 0; j < nk; j++) {
+        if ((result->ob_item[j] = ls_item(self, ks[j])) == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+    return (PyObject *)result;
+}
+
+/* Returns the first k items in sorted order, or the last k in reverse order
+ * if last, for any k up to the number of items */
+static PyObject *
+first_items(LSObject *self, PyObject *arg, int last)
+{
+    PyListObject *result;
+    Py_ssize_t xs_len = LS_SIZE(self);
+    Py_ssize_t k, j;
+
+    if ((k = PyNumber_AsSsize_t(arg, PyExc_OverflowError)) == -1 &&
+        PyErr_Occurred())
+        return NULL;
+    if (k < 0) {
+        PyErr_SetString(PyExc_ValueError, "k must be at least 0");
+        return NULL;
+    }
+    if (k > xs_len)
+        k = xs_len;
+
+    if (k > 0 && sort_range(self, last ? xs_len - k : 0,
+                            last ? xs_len : k) < 0)
+        return NULL;
+
+    if ((result = (PyListObject *)PyList_New(k)) == NULL)
+        return NULL;
+    for (j = 0; j < k; j++) {
+        result->ob_item[j] = ls_item(self, last ? xs_len - 1 - j : j);
+        if (result->ob_item[j] == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+    return (PyObject *)result;
+}
+
+static PyObject *
+ls_nsmallest(LSObject *self, PyObject *arg)
+{
+    return first_items(self, arg, 0);
+}
+
+static PyObject *
+ls_nlargest(LSObject *self, PyObject *arg)
+{
+    return first_items(self, arg, 1);
+}
+
+/* Returns the items at each of an iterable of indices */
+static PyObject *
+ls_select_many(LSObject *self, PyObject *ranks)
+{
+    PyObject *seq, *result = NULL;
+    Py_ssize_t *ks, nk, j;
+    Py_ssize_t xs_len = LS_SIZE(self);
+
+    seq = PySequence_Fast(ranks, "select_many expects an iterable of ints");
+    if (seq == NULL)
+        return NULL;
+    nk = PySequence_Fast_GET_SIZE(seq);
+
+    ks = (Py_ssize_t *)PyMem_Malloc((nk ? nk : 1) * sizeof(Py_ssize_t));
+    if (ks == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    for (j = 0; j < nk; j++) {
+        PyObject *rank = PySequence_Fast_GET_ITEM(seq, j);
+        if (!PyIndex_Check(rank)) {
+            PyErr_Format(PyExc_TypeError,
+                         "list indices must be integers, not %.200s",
+                         rank->ob_type->tp_name);
+            goto done;
+        }
+        ks[j] = PyNumber_AsSsize_t(rank, PyExc_IndexError);
+        if (ks[j] == -1 && PyErr_Occurred())
+            goto done;
+        if (ks[j] < 0)
+            ks[j] += xs_len;
+        if (ks[j] < 0 || ks[j] >= xs_len) {
+            index_error();
+            goto done;
+        }
+    }
+
+    result = select_indices(self, ks, nk);
+
+done:
+    PyMem_Free(ks);
+    Py_DECREF(seq);
+    return result;
+}
+
+#define INTERP_LINEAR 0
+#define INTERP_LOWER 1
+#define INTERP_HIGHER 2
+#define INTERP_NEAREST 3
+#define INTERP_MIDPOINT 4
+
+static const char *interpolations[] = {"linear", "lower", "higher", "nearest",
+                                       "midpoint", NULL};
+
+/* Returns the value a fraction frac of the way from a to b, where frac is
+ * strictly between 0 and 1 and lo is the index of a, by the given
+ * interpolation, or NULL on error */
+static PyObject *
+interpolate(PyObject *a, PyObject *b, double frac, Py_ssize_t lo,
+            int interpolation)
+{
+    PyObject *diff, *scale, *scaled, *sum, *two, *result;
+
+    switch (interpolation) {
+    case INTERP_LOWER:
+        Py_INCREF(a);
+        return a;
+    case INTERP_HIGHER:
+        Py_INCREF(b);
+        return b;
+    case INTERP_NEAREST:
+        /* Ties go to the even index, as in numpy */
+        if (frac < 0.5 || (frac == 0.5 && lo % 2 == 0)) {
+            Py_INCREF(a);
+            return a;
+        }
+        Py_INCREF(b);
+        return b;
+    case INTERP_MIDPOINT:
+        if ((sum = PyNumber_Add(a, b)) == NULL)
+            return NULL;
+        if ((two = PyFloat_FromDouble(2.0)) == NULL) {
+            Py_DECREF(sum);
+            return NULL;
+        }
+        result = PyNumber_TrueDivide(sum, two);
+        Py_DECREF(sum);
+        Py_DECREF(two);
+        return result;
+    default:
+        /* a + (b - a) * frac */
+        if ((diff = PyNumber_Subtract(b, a)) == NULL)
+            return NULL;
+        if ((scale = PyFloat_FromDouble(frac)) == NULL) {
+            Py_DECREF(diff);
+            return NULL;
+        }
+        scaled = PyNumber_Multiply(diff, scale);
+        Py_DECREF(diff);
+        Py_DECREF(scale);
+        if (scaled == NULL)
+            return NULL;
+        result = PyNumber_Add(a, scaled);
+        Py_DECREF(scaled);
+        return result;
+    }
+}
+
+/* Returns the INTERP_* called name, or sets a ValueError and returns -1 */
+static int
+parse_interpolation(const char *name)
+{
+    int interpolation;
+
+    for (interpolation = 0; interpolations[interpolation] != NULL;
+         interpolation++) {
+        if (strcmp(name, interpolations[interpolation]) == 0)
+            return interpolation;
+    }
+    PyErr_Format(PyExc_ValueError, "interpolation must be 'linear', "
+                 "'lower', 'higher', 'nearest', or 'midpoint', not '%s'",
+                 name);
+    return -1;
+}
+
+/* Returns a new array of the probabilities in the iterable ps, putting their
+ * number in *np, or returns NULL on error. The array is freed with
+ * PyMem_Free. */
+static double *
+parse_probabilities(PyObject *ps, Py_ssize_t *np)
+{
+    PyObject *seq;
+    double *probs;
+    Py_ssize_t j;
+
+    seq = PySequence_Fast(ps, "quantiles expects an iterable of floats");
+    if (seq == NULL)
+        return NULL;
+    *np = PySequence_Fast_GET_SIZE(seq);
+    probs = (double *)PyMem_Malloc((*np + 1) * sizeof(double));
+    if (probs == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (j = 0; j < *np; j++) {
+        probs[j] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, j));
+        if (probs[j] == -1.0 && PyErr_Occurred())
+            goto fail;
+        if (!(0.0 <= probs[j] && probs[j] <= 1.0)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "quantiles must be between 0 and 1");
+            goto fail;
+        }
+    }
+    Py_DECREF(seq);
+    return probs;
+
+fail:
+    PyMem_Free(probs);
+    Py_DECREF(seq);
+    return NULL;
+}
+
+/* Returns a list of the quantiles of ls at each of the np probabilities, or
+ * NULL on error */
+static PyObject *
+quantiles_at(LSObject *ls, const double *probs, Py_ssize_t np,
+             int interpolation)
+{
+    PyObject *items, *result = NULL;
+    Py_ssize_t *ks = NULL;
+    double *fracs = NULL;
+    double pos;
+    Py_ssize_t j;
+    Py_ssize_t xs_len = LS_SIZE(ls);
+
+    if (np > 0 && xs_len == 0) {
+        PyErr_SetString(PyExc_ValueError, "quantiles of an empty LazySorted");
+        return NULL;
+    }
+
+    /* Each quantile needs the items at the indices on either side of it */
+    ks = (Py_ssize_t *)PyMem_Malloc((2 * np + 1) * sizeof(Py_ssize_t));
+    fracs = (double *)PyMem_Malloc((np + 1) * sizeof(double));
+    if (ks == NULL || fracs == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (j = 0; j < np; j++) {
+        pos = probs[j] * (xs_len - 1);
+        ks[2 * j] = (Py_ssize_t)floor(pos);
+        ks[2 * j + 1] = (Py_ssize_t)ceil(pos);
+        fracs[j] = pos - ks[2 * j];
+    }
+
+    if ((items = select_indices(ls, ks, 2 * np)) == NULL)
+        goto done;
+
+    if ((result = PyList_New(np)) == NULL) {
+        Py_DECREF(items);
+        goto done;
+    }
+    for (j = 0; j < np; j++) {
+        PyObject *a = PyList_GET_ITEM(items, 2 * j);
+        PyObject *b = PyList_GET_ITEM(items, 2 * j + 1);
+        PyObject *q;
+        if (ks[2 * j] == ks[2 * j + 1]) {
+            Py_INCREF(a);
+            q = a;
+        }
+        else if ((q = interpolate(a, b, fracs[j], ks[2 * j],
+                                  interpolation)) == NULL) {
+            Py_DECREF(items);
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, j, q);
+    }
+    Py_DECREF(items);
+
+done:
+    PyMem_Free(ks);
+    PyMem_Free(fracs);
+    return result;
+}
+
+/* Returns the quantiles at each of an iterable of probabilities */
+static PyObject *
+ls_quantiles(LSObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ps, *result;
+    /* Indices can't be averaged, so the quantiles of them are items */
+    const char *interp_name = self->perm != NULL ? "lower" : "linear";
+    int interpolation;
+    double *probs;
+    Py_ssize_t np;
+    static char *kwdlist[] = {"ps", "interpolation", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s:quantiles", kwdlist,
+                                     &ps, &interp_name))
+        return NULL;
+    if ((interpolation = parse_interpolation(interp_name)) < 0)
+        return NULL;
+    if (self->perm != NULL && (interpolation == INTERP_LINEAR ||
+                                 interpolation == INTERP_MIDPOINT)) {
+        PyErr_SetString(PyExc_ValueError, "quantiles of indices need "
+                        "interpolation 'lower', 'higher', or 'nearest'");
+        return NULL;
+    }
+    if ((probs = parse_probabilities(ps, &np)) == NULL)
+        return NULL;
+
+    result = quantiles_at(self, probs, np, interpolation);
+    PyMem_Free(probs);
+    return result;
+}
+
+/* Returns the items split into m groups of nearly equal size, in order */
+static PyObject *
+ls_buckets(LSObject *self, PyObject *args)
+{
+    Py_ssize_t m, i, k;
+    Py_ssize_t xs_len = LS_SIZE(self);
+    Py_ssize_t *bounds;
+    PyObject *result, *bucket, *item;
+
+    if (!PyArg_ParseTuple(args, "n:buckets", &m))
+        return NULL;
+    if (m < 1) {
+        PyErr_SetString(PyExc_ValueError, "need at least one bucket");
+        return NULL;
+    }
+
+    /* The first xs_len % m buckets get one extra item. Only the boundaries
+     * between buckets need to be selected */
+    bounds = (Py_ssize_t *)PyMem_Malloc((m + 1) * sizeof(Py_ssize_t));
+    if (bounds == NULL)
+        return PyErr_NoMemory();
+    for (i = 0; i <= m; i++) {
+        bounds[i] = i * (xs_len / m) + (i < xs_len % m ? i : xs_len % m);
+    }
+    for (k = 1; k < m && bounds[k] < xs_len; k++)
+        ;
+    if (sort_points(self, bounds + 1, k - 1) < 0) {
+        PyMem_Free(bounds);
+        return NULL;
+    }
 
-                if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-                left = middle;
-            }
-            else {
-                if (left->right == NULL) {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-                }
-                else {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-                }
-                if (middle == NULL)
-                    return -2;
+    if ((result = PyList_New(m)) == NULL) {
+        PyMem_Free(bounds);
+        return NULL;
+    }
+    for (i = 0; i < m; i++) {
+        if ((bucket = PyList_New(bounds[i + 1] - bounds[i])) == NULL)
+            goto fail;
+        PyList_SET_ITEM(result, i, bucket);
+        for (k = bounds[i]; k < bounds[i + 1]; k++) {
+            if ((item = ls_item(self, k)) == NULL)
+                goto fail;
+            PyList_SET_ITEM(bucket, k - bounds[i], item);
+        }
+    }
+    PyMem_Free(bounds);
+    return result;
+
+fail:
+    PyMem_Free(bounds);
+    Py_DECREF(result);
+    return NULL;
+}
+
+/* Sets a ValueError for an item that isn't there, and returns NULL */
+static PyObject *
+not_in_list(PyObject *item)
+{
+    PyObject *err_format, *err_string, *format_tuple;
+    err_format = PyString_FromString("%r is not in list");
+    if (err_format == NULL)
+        return NULL;
+    format_tuple = PyTuple_Pack(1, item);
+    if (format_tuple == NULL)
+        return NULL;
+    err_string = PyString_Format(err_format, format_tuple);
+    Py_DECREF(format_tuple);
+    if (err_string == NULL)
+        return NULL;
+    PyErr_SetObject(PyExc_ValueError, err_string);
+    Py_DECREF(err_string);
+    return NULL;
+}
+
+static PyObject *
+ls_index(LSObject *self, PyObject *args)
+{
+    PyObject *item;
+    if (!PyArg_ParseTuple(args, "O:list", &item))
+        return NULL;
+
+    Py_ssize_t index = find_item(self, item);
+    if (index == -2) {
+        return NULL;
+    }
+    else if (index == -1) {
+        return not_in_list(item);
+    }
+    else {
+        return PyInt_FromSsize_t(index);
+    }
+}
+
+static PyObject *
+ls_count(LSObject *self, PyObject *args)
+{
+    PyObject *item;
+    Py_ssize_t lo, hi, k, count;
+    int cmp;
+
+    if (!PyArg_ParseTuple(args, "O:list", &item))
+        return NULL;
+
+    if (equal_range(self, item, &lo, &hi) < 0)
+        return NULL;
+
+    /* Items with equal keys needn't be equal if there's a key function */
+    if (self->keyfunc == NULL)
+        return PyInt_FromSsize_t(hi - lo);
+
+    count = 0;
+    for (k = lo; k < hi; k++) {
+        if ((cmp = item_eq(self, item, k)) < 0)
+            return NULL;
+        count += cmp;
+    }
+    return PyInt_FromSsize_t(count);
+}
+
+static PyObject *
+ls_add(LSObject *self, PyObject *item)
+{
+    PyObject *seq = PyTuple_Pack(1, item);
+    if (seq == NULL)
+        return NULL;
+    int res = insert_items(self, seq);
+    Py_DECREF(seq);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ls_extend(LSObject *self, PyObject *iterable)
+{
+    /* A copy, since the key function or comparisons could change a list we
+     * were handed while insert_items holds on to its items */
+    PyObject *seq = PySequence_List(iterable);
+    if (seq == NULL)
+        return NULL;
+    int res = insert_items(self, seq);
+    Py_DECREF(seq);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ls_remove(LSObject *self, PyObject *item)
+{
+    Py_ssize_t index = find_item(self, item);
+    if (index == -2)
+        return NULL;
+    if (index == -1)
+        return not_in_list(item);
+    if (delete_at(self, index) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Replaces the ith smallest item with a new one. The new one goes wherever it
+ * belongs, which needn't be index i. */
+static PyObject *
+ls_replace(LSObject *self, PyObject *args)
+{
+    Py_ssize_t i;
+    PyObject *item;
+    Py_ssize_t xs_len = LS_SIZE(self);
+
+    if (!PyArg_ParseTuple(args, "nO:replace", &i, &item))
+        return NULL;
+    if (i < 0)
+        i += xs_len;
+    if (i < 0 || i >= xs_len)
+        return index_error();
+
+    if (sort_point(self, i) < 0 || replace_at(self, i, item) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Implements bisect_left if after is 0, or bisect_right if it's 1 */
+static PyObject *
+bisect(LSObject *self, PyObject *item, int after)
+{
+    Py_ssize_t bound;
+
+    if (equal_range(self, item, after ? NULL : &bound,
+                    after ? &bound : NULL) < 0)
+        return NULL;
+    return PyInt_FromSsize_t(bound);
+}
+
+static PyObject *
+ls_bisect_left(LSObject *self, PyObject *item)
+{
+    return bisect(self, item, 0);
+}
+
+static PyObject *
+ls_bisect_right(LSObject *self, PyObject *item)
+{
+    return bisect(self, item, 1);
+}
+
+static PyObject *
+ls_equal_range(LSObject *self, PyObject *item)
+{
+    Py_ssize_t lo, hi;
+
+    if (equal_range(self, item, &lo, &hi) < 0)
+        return NULL;
+    return Py_BuildValue("(nn)", lo, hi);
+}
+
+static int
+ls_contains(LSObject *self, PyObject *item)
+{
+    Py_ssize_t idx = find_item(self, item);
+    if (idx == -2) {
+        return -1;
+    }
+    else if (idx == -1) {
+        return 0;
+    }
+    else {
+        return 1;
+    }
+}
+
+static PyObject *
+ls_pivots(LSObject *self)
+{
+    PyObject *result = PyList_New(0);
+    if (result == NULL) 
+        return NULL;
+
+    PyObject *unsorted = PyString_FromString("UNSORTED");
+    if (unsorted == NULL)
+        return NULL;
+    PyObject *sortedright = PyString_FromString("SORTED_RIGHT");
+    if (sortedright == NULL)
+        return NULL;
+    PyObject *sortedleft = PyString_FromString("SORTED_LEFT");
+    if (sortedleft == NULL)
+        return NULL;
+    PyObject *sortedboth = PyString_FromString("SORTED_BOTH");
+    if (sortedboth == NULL)
+        return NULL;
+
+    PyObject *flags[4] = {unsorted, sortedright, sortedleft, sortedboth};
+
+    PivotNode *curr, *next;
+    if (bound_idx(self, -1, &curr, &next) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    Py_ssize_t i;
+    PyObject *index;
+    PyObject *tuple;
+    for (i = 0; curr != NULL; i++, curr = next) {
+        if (curr->idx == LS_SIZE(self))
+            next = NULL;
+        else if ((next = next_pivot(self, curr)) == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        index = PyInt_FromSsize_t(curr->idx);
+        if (index == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        tuple = PyTuple_Pack(2, index, flags[curr->flags & SORTED_BOTH]);
+        if (tuple == NULL) {
+            Py_DECREF(index);
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_Append(result, tuple);
+    }
+
+    return (PyObject*)result;
+}
+
+static Py_ssize_t
+ls_length(LSObject *self)
+{
+    /* A caller's list looks empty while a comparison runs */
+    if (self->shared_len >= 0) {
+        if (!self->busy && check_shared(self) < 0)
+            return -1;
+        return self->shared_len;
+    }
+    return LS_SIZE(self);
+}
+
+/* The LazySorted iterator object. It remembers how far the sorted stretch it
+ * is in goes, so it only looks at the pivots once per stretch. Queries never
+ * unsort sorted items, so that stays true even if other calls change the
+ * pivots in between, but adding or removing items ends the iteration. */
+typedef struct {
+    PyObject_HEAD
+    LSObject            *ls;            /* The referenced lazysorted object */
+    Py_ssize_t          i;              /* The next location to check */
+    Py_ssize_t          stop;           /* The end of i's sorted stretch */
+    int                 backwards;      /* 1 for the __reversed__ iterator */
+    unsigned long       version;        /* The version of ls when created */
+} LSIterObject;
+
+static PyTypeObject LSIter_Type;
+#define LSIterObject_Check(v)      (Py_TYPE(v) == &LSIter_Type)
+
+static PyObject *
+LSIterObject_length_hint(LSIterObject *it)
+{
+    Py_ssize_t len = it->backwards ? it->i + 1 : LS_SIZE(it->ls) - it->i;
+    return PyInt_FromSsize_t(len > 0 ? len : 0);
+}
+
+static PyMethodDef LSIterObject_methods[] = {
+    {"__length_hint__", (PyCFunction)LSIterObject_length_hint, METH_NOARGS,
+        PyDoc_STR("Private method returning the number of items left.")},
+    {NULL, NULL}           /* sentinel */
+};
+
+/* Returns a new iterator over ls, going backwards from the end if backwards */
+static PyObject *
+new_iter(PyObject *self, int backwards)
+{
+    LSIterObject *it;
+
+    if (!LSObject_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    it = PyObject_New(LSIterObject, &LSIter_Type);
+    if (it == NULL)
+        return NULL;
+    it->backwards = backwards;
+    it->i = backwards ? LS_SIZE((LSObject *)self) - 1 : 0;
+    it->stop = it->i;
+    it->version = ((LSObject *)self)->version;
+    Py_INCREF(self);
+    it->ls = (LSObject *)self;
+
+    return (PyObject *)it;
+}
+
+PyObject*
+LSObject_iter(PyObject *self)
+{
+    return new_iter(self, 0);
+}
+
+static PyObject *
+ls_reversed(PyObject *self)
+{
+    return new_iter(self, 1);
+}
 
-                if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-                right = middle;
+static void
+LSIterObject_dealloc(LSIterObject *it)
+{
+    Py_XDECREF(it->ls);
+    PyObject_Del(it);
+}
+
+/* Does LSObject_iternext once the LazySorted is locked */
+static PyObject *
+iter_next(LSIterObject *lsi)
+{
+    if (lsi->version != lsi->ls->version) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted changed during iteration");
+        return NULL;
+    }
+    if (lsi->backwards) {
+        if (lsi->i >= 0) {
+            if (lsi->i <= lsi->stop &&
+                    (lsi->stop = sorted_stretch(lsi->ls, lsi->i, 1)) < -1) {
+                return NULL;
             }
+            return ls_item(lsi->ls, (lsi->i)--);
+        }
+    }
+    else if (lsi->i < ls_length(lsi->ls)) {
+        if (lsi->i >= lsi->stop &&
+                (lsi->stop = sorted_stretch(lsi->ls, lsi->i, 0)) < 0) {
+            return NULL;
+        }
+        return ls_item(lsi->ls, (lsi->i)++);
+    }
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+PyObject*
+LSObject_iternext(PyObject *self)
+{
+    LSIterObject *lsi = (LSIterObject *)self;
+    LSObject *ls = lsi->ls;
+    PyObject *res;
+    Py_ssize_t i = lsi->i;
+
+    /* The stretch found last time is still in place unless ls has changed */
+    if (CAN_READ(ls) && lsi->version == ls->version &&
+        (lsi->backwards ? i > lsi->stop : i < lsi->stop)) {
+        lsi->i = lsi->backwards ? i - 1 : i + 1;
+        return ls_item(ls, i);
+    }
+
+    if (ls_enter(ls) < 0)
+        return NULL;
+    res = iter_next(lsi);
+    ls_unlock(ls);
+    return res;
+}
+
+/* Returns a sorted list of all the items */
+static PyObject *
+ls_tolist(LSObject *self)
+{
+    Py_ssize_t xs_len = LS_SIZE(self);
+
+    /* sort_range doesn't leave pivots behind in the regions it sorts */
+    if (xs_len > 0 && sort_range(self, 0, xs_len) < 0)
+        return NULL;
+    return items_between(self, 0, xs_len);
+}
+
+/* Pickling. A LazySorted is pickled with its items in their partially sorted
+ * order, so that the copy carries on where the original left off, along with
+ * the items its indices point to, the keys its key function has computed, its
+ * random generator and its pivots. The pivots are written as the gaps between
+ * their indices, seven bits to a byte, and their flags four bits each, so they
+ * take a few bytes apiece, and restoring them takes time in proportion to
+ * their number, with no comparisons. Unboxed items are written as raw bytes,
+ * with their format and byte order. */
+
+/* Returns '<' if this machine is little endian, or '>' if it's big endian */
+static char
+byte_order(void)
+{
+    const unsigned short one = 1;
+    return *(const unsigned char *)&one ? '<' : '>';
+}
+
+/* Clears the run flags of the count pivots in fl that don't mark the ends of
+ * a run the way narrow leaves them: a pivot that starts a run without ending
+ * it must be on the left of a sorted region, and the pivot on its right must
+ * end the run without starting another. The pivots at -1 and n have no items
+ * to compare, so they never have run flags. Returns whether it cleared any. */
+static int
+pair_runs(int *fl, Py_ssize_t count)
+{
+    Py_ssize_t i;
+    int cleared = 0, lone;
+
+    for (i = 0; i < count; i++) {
+        if (!(fl[i] & (RUN_START | RUN_END)))
+            continue;
+        if (i == 0 || i == count - 1)
+            lone = 1;
+        else if ((fl[i] & (RUN_START | RUN_END)) == RUN_START)
+            lone = !(fl[i] & SORTED_LEFT) || i + 1 == count - 1 ||
+                   (fl[i + 1] & (RUN_START | RUN_END)) != RUN_END;
+        else if ((fl[i] & (RUN_START | RUN_END)) == RUN_END)
+            lone = !(fl[i] & SORTED_RIGHT) ||
+                   (fl[i - 1] & (RUN_START | RUN_END)) != RUN_START;
+        else
+            lone = 0;
+        if (lone) {
+            fl[i] &= ~(RUN_START | RUN_END);
+            cleared = 1;
         }
+    }
+    return cleared;
+}
 
-        left_idx = left->idx + 1;
-        right_idx = right->idx == xs_len ? xs_len : right->idx + 1;
+/* Sets *gaps and *flags to new bytes objects encoding the pivots of ls.
+ * Run flags that no longer pair up are left out, since they are only hints.
+ * Returns 0 on success or -1 on error. */
+static int
+dump_pivots(LSObject *ls, PyObject **gaps, PyObject **flags)
+{
+    PivotNode *first, *node;
+    Py_ssize_t count = 0, size = 0, prev = -2, i;
+    unsigned char *g, *f;
+    int *fl;
+    size_t gap;
 
-        if (insertion_sort(ls, left->idx + 1, right->idx) < 0) {
-           return -2;
+    if (bound_idx(ls, -1, &first, &node) < 0)
+        return -1;
+    for (node = first; node->idx < LS_SIZE(ls); count++) {
+        if ((node = next_pivot(ls, node)) == NULL)
+            return -1;
+    }
+    count++;
+
+    /* A gap takes at most ten bytes, seven bits at a time */
+    g = (unsigned char *)PyMem_Malloc(10 * count);
+    f = (unsigned char *)PyMem_Malloc((count + 1) / 2);
+    fl = (int *)PyMem_Malloc(count * sizeof(int));
+    if (g == NULL || f == NULL || fl == NULL) {
+        PyMem_Free(g);
+        PyMem_Free(f);
+        PyMem_Free(fl);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(f, 0, (count + 1) / 2);
+
+    /* The nodes were all made above, so finding them again can't fail */
+    for (i = 0, node = first; i < count; i++) {
+        if (i > 0)
+            node = next_pivot(ls, node);
+        gap = (size_t)(node->idx - prev);
+        prev = node->idx;
+        while (gap >= 0x80) {
+            g[size++] = (unsigned char)(gap | 0x80);
+            gap >>= 7;
         }
-        left->flags |= SORTED_LEFT;
-        right->flags |= SORTED_RIGHT;
-        depivot(left, right, &ls->root);
+        g[size++] = (unsigned char)gap;
+        fl[i] = node->flags;
     }
-
-    /* TODO: Do binary search now */
-    Py_ssize_t k;
-    int cmp = 0;
-    for (k = left_idx; cmp == 0 && k < right_idx; k++) {
-        cmp = PyObject_RichCompareBool(item, ls->xs->ob_item[k], Py_EQ);
+    pair_runs(fl, count);
+    for (i = 0; i < count; i++)
+        f[i / 2] |= (unsigned char)(fl[i] << (4 * (i % 2)));
+
+    *gaps = PyBytes_FromStringAndSize((char *)g, size);
+    *flags = PyBytes_FromStringAndSize((char *)f, (count + 1) / 2);
+    PyMem_Free(g);
+    PyMem_Free(f);
+    PyMem_Free(fl);
+    if (*gaps == NULL || *flags == NULL) {
+        Py_CLEAR(*gaps);
+        Py_CLEAR(*flags);
+        return -1;
     }
+    return 0;
+}
 
-    if (cmp < 0) {
-        return -2;
+/* Decodes the pivots that dump_pivots wrote for n items into new arrays of
+ * their indices and flags, and their number into *count. With no gaps, there
+ * are just the pivots at -1 and n. Checks that they go from -1 to n in order,
+ * that each sorted region is marked at both ends, and that the run flags pair
+ * up as pair_runs wants, so that a bad state can't send a query outside the
+ * items. Returns 0 on success, or sets an error and returns -1. */
+static int
+load_pivots(PyObject *gaps, PyObject *flags, Py_ssize_t n, Py_ssize_t **idxs,
+            int **fl, Py_ssize_t *count)
+{
+    const unsigned char *g, *f;
+    Py_ssize_t size, i, k = 0, prev = -2;
+    size_t gap = 0;
+    int shift = 0;
+
+    if (gaps == Py_None) {
+        *idxs = (Py_ssize_t *)PyMem_Malloc(2 * sizeof(Py_ssize_t));
+        *fl = (int *)PyMem_Malloc(2 * sizeof(int));
+        if (*idxs == NULL || *fl == NULL)
+            goto nomemory;
+        (*idxs)[0] = -1;
+        (*idxs)[1] = n;
+        (*fl)[0] = (*fl)[1] = UNSORTED;
+        *count = 2;
+        return 0;
     }
-    else if (cmp == 0) {
-        return -1;
+    if (!PyBytes_Check(gaps) || !PyBytes_Check(flags))
+        goto bad;
+
+    size = PyBytes_GET_SIZE(gaps);
+    g = (const unsigned char *)PyBytes_AS_STRING(gaps);
+    *idxs = (Py_ssize_t *)PyMem_Malloc((size + 1) * sizeof(Py_ssize_t));
+    *fl = (int *)PyMem_Malloc((size + 1) * sizeof(int));
+    if (*idxs == NULL || *fl == NULL)
+        goto nomemory;
+
+    for (i = 0; i < size; i++) {
+        if (shift > 8 * (int)sizeof(size_t) - 7)
+            goto bad;
+        gap |= (size_t)(g[i] & 0x7f) << shift;
+        shift += 7;
+        if (g[i] & 0x80)
+            continue;
+        if (gap == 0 || gap > (size_t)(n - prev))
+            goto bad;
+        prev += (Py_ssize_t)gap;
+        (*idxs)[k++] = prev;
+        gap = 0;
+        shift = 0;
     }
-    else {
-        return k - 1;  /* -1 since incremented in for loop */
+    if (shift != 0 || k < 2 || (*idxs)[0] != -1 || prev != n)
+        goto bad;
+
+    if (PyBytes_GET_SIZE(flags) != (k + 1) / 2)
+        goto bad;
+    f = (const unsigned char *)PyBytes_AS_STRING(flags);
+    for (i = 0; i < k; i++)
+        (*fl)[i] = (f[i / 2] >> (4 * (i % 2))) & 0xf;
+    if (((*fl)[0] & SORTED_RIGHT) || ((*fl)[k - 1] & SORTED_LEFT))
+        goto bad;
+    for (i = 0; i + 1 < k; i++) {
+        if (!((*fl)[i] & SORTED_LEFT) != !((*fl)[i + 1] & SORTED_RIGHT))
+            goto bad;
     }
+    if (pair_runs(*fl, k))
+        goto bad;
+    *count = k;
+    return 0;
 
+bad:
+    PyErr_SetString(PyExc_ValueError, "bad pivots in LazySorted state");
+    goto fail;
+nomemory:
+    PyErr_NoMemory();
 fail:
-    return -2;
+    PyMem_Free(*idxs);
+    PyMem_Free(*fl);
+    *idxs = NULL;
+    *fl = NULL;
+    return -1;
 }
 
-/* Public facing LazySorted methods */
-
-static PyObject *idxerr = NULL;
+/* Builds the index of the count pivots in idxs and fl, for n items, into
+ * root, pool and bits, which start out empty. Returns 0 on success or -1 on
+ * error, leaving what it built for the caller to free. */
+static int build_pivots(Py_ssize_t, Py_ssize_t *, int *, Py_ssize_t,
+                        PivotNode **, NodePool *, PivotBits *,
+                        unsigned long long *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
 
-static PyObject *
-ls_subscript(LSObject* self, PyObject* item)
+static int
+build_pivots(Py_ssize_t n, Py_ssize_t *idxs, int *fl, Py_ssize_t count,
+             PivotNode **root, NodePool *pool, PivotBits *bits,
+             unsigned long long *rng)
 {
-    Py_ssize_t xs_len = Py_SIZE(self->xs);
+    PivotNode *node = NULL;
+    Py_ssize_t i;
 
-    if (PyIndex_Check(item)) {
-        Py_ssize_t k;
-        k = PyNumber_AsSsize_t(item, PyExc_IndexError);
-        if (k == -1 && PyErr_Occurred())
-            return NULL;
-        if (k < 0)
-            k += xs_len;
+    if (n >= BITS_THRESH && bits_init(bits, n) < 0)
+        return -1;
 
-        if (k < 0 || k >= xs_len) {
-            if (idxerr == NULL) {
-                idxerr = PyString_FromString("LazySorted index out of range");
-                if (idxerr == NULL)
-                    return NULL;
-            }
-            PyErr_SetObject(PyExc_IndexError, idxerr);
-            return NULL;
+    for (i = 0; i < count; i++) {
+        if (bits->words == NULL) {
+            /* Each pivot is the biggest so far, so it goes right under the
+             * last one, and rotates up the right edge of the tree at most */
+            node = insert_pivot(idxs[i], UNSORTED, root, node, pool, rng);
+            if (node == NULL)
+                return -1;
+            continue;
         }
 
-        if (sort_point(self, k) < 0)
-            return NULL;
+        bits_set(bits, idxs[i]);
+        if (fl[i] & SORTED_LEFT)
+            BIT_SET(bits->sorted, idxs[i] + 1);
+        if (fl[i] & RUN_START)
+            BIT_SET(bits->run_start, idxs[i] + 1);
+        if (fl[i] & RUN_END)
+            BIT_SET(bits->run_end, idxs[i] + 1);
+    }
+    if (bits->words != NULL)
+        return 0;
+
+    /* The flags are only consistent once every pivot is in */
+    for (i = count - 1; node != NULL; i--, node = node->prev)
+        node->flags = fl[i];
+    return 0;
+}
+
+/* Returns a new reference to the state of ls for pickling, leaving out the
+ * pivots unless pivots is nonzero, or NULL on error */
+static PyObject *
+get_state(LSObject *ls, int pivots)
+{
+    Py_ssize_t n = LS_SIZE(ls), i;
+    PyObject *items = NULL, *perm = NULL, *keys = NULL, *rng = NULL;
+    PyObject *gaps = NULL, *flags = NULL, *state = NULL, *index;
 
-        Py_INCREF(self->xs->ob_item[k]);
-        return self->xs->ob_item[k];
+    if (ls->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted pickled during a comparison");
+        return NULL;
     }
-    else if (PySlice_Check(item)) {
-        Py_ssize_t start, stop, step, slicelength;
+    if (check_shared(ls) < 0)
+        return NULL;
 
-        if (PySlice_GetIndicesEx(item, Py_SIZE(self->xs),
-                         &start, &stop, &step, &slicelength) < 0) {
-            return NULL;
+    if (ls->ops != NULL) {
+        char format[3] = {byte_order(), ls->ops->format, '\0'};
+        PyObject *data = PyBytes_FromStringAndSize((char *)ls->data,
+                                                   n * ls->ops->itemsize);
+        if (data == NULL)
+            goto fail;
+        items = Py_BuildValue("(snO)", format, ls->ops->itemsize, data);
+        Py_DECREF(data);
+    }
+    else {
+        items = PyList_GetSlice((PyObject *)ls->xs, 0, n);
+    }
+    if (items == NULL)
+        goto fail;
+
+    if (ls->perm != NULL) {
+        if ((perm = PyList_New(n)) == NULL)
+            goto fail;
+        for (i = 0; i < n; i++) {
+            if ((index = PyInt_FromSsize_t(ls->perm[i])) == NULL)
+                goto fail;
+            PyList_SET_ITEM(perm, i, index);
         }
+    }
 
-        if (slicelength <= 0) {
-            return PyList_New(0);
+    /* Keys that are just the items aren't worth the space, but ones from a
+     * key function save calling it again */
+    if (ls->keyfunc != NULL && ls->prepared) {
+        if ((keys = PyList_New(n)) == NULL)
+            goto fail;
+        for (i = 0; i < n; i++) {
+            Py_INCREF(ls->keys[i]);
+            PyList_SET_ITEM(keys, i, ls->keys[i]);
         }
-        else if (-CONTIG_THRESH <= step && step <= CONTIG_THRESH) {
-            Py_ssize_t left = start < stop ? start : stop;
-            Py_ssize_t right = start < stop ? stop : start;
-
-            if (step < 0) {
-                left++;
-                right++;
-            }
-
-            if (sort_range(self, left, right) < 0) {
-                return NULL;
-            }
+    }
 
-            PyListObject *result = (PyListObject *)PyList_New(slicelength);
-            if (result == NULL)
-                return NULL;
+    if ((rng = PyLong_FromUnsignedLongLong(ls->rng)) == NULL)
+        goto fail;
+    if (pivots && dump_pivots(ls, &gaps, &flags) < 0)
+        goto fail;
 
-            Py_ssize_t k, j;
-            for (k = start, j = 0; j < slicelength; k += step, j++) {
-                Py_INCREF(self->xs->ob_item[k]);
-                result->ob_item[j] = self->xs->ob_item[k];
-            }
+    state = PyTuple_Pack(6, items, perm ? perm : Py_None,
+                         keys ? keys : Py_None, rng, gaps ? gaps : Py_None,
+                         flags ? flags : Py_None);
 
-            return (PyObject *)result;
-        }
-        else {
-            PyListObject *result = (PyListObject *)PyList_New(slicelength);
-            if (result == NULL)
-                return NULL;
+fail:
+    Py_XDECREF(items);
+    Py_XDECREF(perm);
+    Py_XDECREF(keys);
+    Py_XDECREF(rng);
+    Py_XDECREF(gaps);
+    Py_XDECREF(flags);
+    return state;
+}
 
-            Py_ssize_t k, j;
-            for (k = start, j = 0; j < slicelength; k += step, j++) {
-                if (sort_point(self, k) < 0)
-                    return NULL;
-                Py_INCREF(self->xs->ob_item[k]);
-                result->ob_item[j] = self->xs->ob_item[k];
-            }
+static PyObject *
+ls_getstate(LSObject *self, PyObject *args, PyObject *kwds)
+{
+    int pivots = 1;
+    static char *kwdlist[] = {"pivots", 0};
 
-            return (PyObject *)result;
-        }
-    }
-    else {
-        PyErr_Format(PyExc_TypeError,
-                     "list indices must be integers, not %.200s",
-                     item->ob_type->tp_name);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:__getstate__", kwdlist,
+                                     &pivots))
         return NULL;
-    }
+    return get_state(self, pivots);
 }
 
-/* Returns (possibly unsorted) data in a specified contiguous range */
 static PyObject *
-between(LSObject *self, PyObject *args)
+ls_reduce(LSObject *self)
 {
-    Py_ssize_t left;
-    Py_ssize_t right;
+    PyObject *state, *res;
 
-    if (!PyArg_ParseTuple(args, "nn:list", &left, &right))
+    if ((state = get_state(self, 1)) == NULL)
         return NULL;
 
-    Py_ssize_t xlen = Py_SIZE(self->xs);
-    if (left < 0) {
-        left += xlen;
-    }
-    else if (left > xlen) {
-        left = xlen;
-    }
+    /* An empty LazySorted with the same options, which the state fills */
+    res = Py_BuildValue("O(()OiOii)O", (PyObject *)Py_TYPE(self),
+                        self->keyfunc != NULL ? self->keyfunc : Py_None,
+                        self->reverse, Py_None, 1, self->perm != NULL,
+                        state);
+    Py_DECREF(state);
+    return res;
+}
 
-    if (right < 0) {
-        right += xlen;
-    }
-    else if (right > xlen) {
-        right = xlen;
+/* Copies unboxed items out of a state's (format, itemsize, bytes) into
+ * *data, in this machine's byte order, returning their kernels, or NULL with
+ * an error set */
+static const NativeOps *
+load_data(LSObject *ls, PyObject *items, void **data, Py_ssize_t *n)
+{
+    const char *format;
+    Py_ssize_t itemsize, len, i, j;
+    PyObject *bytes;
+    size_t k;
+    char *p;
+
+    if (!PyArg_ParseTuple(items, "snO:__setstate__", &format, &itemsize,
+                          &bytes))
+        return NULL;
+    if (!PyBytes_Check(bytes) || strlen(format) != 2 ||
+        (format[0] != '<' && format[0] != '>') || itemsize <= 0 ||
+        PyBytes_GET_SIZE(bytes) % itemsize != 0)
+        goto bad;
+    for (k = 0; k < sizeof(native_ops) / sizeof(NativeOps); k += 2) {
+        if (native_ops[k].format == format[1] &&
+            native_ops[k].itemsize == itemsize)
+            break;
     }
+    if (k == sizeof(native_ops) / sizeof(NativeOps))
+        goto bad;
 
-    if (left >= right || right <= 0) {
-        return PyList_New(0);
+    len = PyBytes_GET_SIZE(bytes);
+    if ((*data = PyMem_Malloc(len > 0 ? len : 1)) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(*data, PyBytes_AS_STRING(bytes), len);
+    *n = len / itemsize;
+
+    if (format[0] != byte_order()) {
+        for (p = (char *)*data; p < (char *)*data + len; p += itemsize) {
+            for (i = 0, j = itemsize - 1; i < j; i++, j--) {
+                char c = p[i];
+                p[i] = p[j];
+                p[j] = c;
+            }
+        }
     }
+    return &native_ops[k + (ls->reverse ? 1 : 0)];
 
-    if (left != 0 && sort_point(self, left) < 0)
-        return NULL;
-    if (right != xlen && sort_point(self, right) < 0)
-        return NULL;
+bad:
+    PyErr_SetString(PyExc_ValueError, "bad items in LazySorted state");
+    return NULL;
+}
 
-    PyListObject *result = (PyListObject *)PyList_New(right - left);
-    if (result == NULL)
-        return NULL;
+/* Returns a new array of the n indices in the list perm, which must hold
+ * each of 0 to n - 1 once, or NULL with an error set */
+static Py_ssize_t *
+load_perm(PyObject *perm, Py_ssize_t n)
+{
+    Py_ssize_t *idxs = NULL;
+    char *seen = NULL;
+    Py_ssize_t i, k;
+    PyObject *index;
 
-    Py_ssize_t k;
-    for (k = left; k < right; k++) {
-        Py_INCREF(self->xs->ob_item[k]);
-        result->ob_item[k - left] = self->xs->ob_item[k];
+    if (!PyList_Check(perm) || PyList_GET_SIZE(perm) != n)
+        goto bad;
+    idxs = (Py_ssize_t *)PyMem_Malloc((n > 0 ? n : 1) * sizeof(Py_ssize_t));
+    seen = (char *)PyMem_Malloc(n > 0 ? n : 1);
+    if (idxs == NULL || seen == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    memset(seen, 0, n > 0 ? n : 1);
+    for (i = 0; i < n; i++) {
+        index = PyList_GET_ITEM(perm, i);
+#if PY_MAJOR_VERSION >= 3
+        if (!PyLong_Check(index))
+            goto bad;
+#else
+        if (!PyInt_Check(index) && !PyLong_Check(index))
+            goto bad;
+#endif
+        k = PyInt_AsSsize_t(index);
+        if (k == -1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            goto bad;
+        }
+        if (k < 0 || k >= n || seen[k])
+            goto bad;
+        seen[k] = 1;
+        idxs[i] = k;
     }
+    PyMem_Free(seen);
+    return idxs;
 
-    return (PyObject *)result;
+bad:
+    PyErr_SetString(PyExc_ValueError, "bad indices in LazySorted state");
+fail:
+    PyMem_Free(idxs);
+    PyMem_Free(seen);
+    return NULL;
 }
 
 static PyObject *
-ls_index(LSObject *self, PyObject *args)
+ls_setstate(LSObject *self, PyObject *state)
 {
-    PyObject *item;
-    if (!PyArg_ParseTuple(args, "O:list", &item))
+    PyObject *items, *perm, *keys, *rng, *gaps, *flags;
+    PyListObject *xs = NULL;
+    Py_ssize_t *new_perm = NULL;
+    PyObject **new_keys = NULL;
+    void *data = NULL;
+    const NativeOps *ops = NULL;
+    Py_ssize_t n = 0, i, count;
+    Py_ssize_t *idxs = NULL;
+    int *fl = NULL;
+    unsigned long long seed, priorities;
+    PivotNode *root = NULL;
+    NodePool pool = {NULL, 0, NULL};
+    PivotBits bits;
+
+    bits.words = NULL;
+
+    if (!PyTuple_Check(state)) {
+        PyErr_SetString(PyExc_TypeError, "LazySorted state must be a tuple");
         return NULL;
-
-    Py_ssize_t index = find_item(self, item);
-    if (index == -2) {
+    }
+    if (!PyArg_ParseTuple(state, "OOOOOO:__setstate__", &items, &perm,
+                          &keys, &rng, &gaps, &flags))
+        return NULL;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted modified during a comparison");
         return NULL;
     }
-    else if (index == -1) {
-        PyObject *err_format, *err_string, *format_tuple;
-        err_format = PyString_FromString("%r is not in list");
-        if (err_format == NULL)
-            return NULL;
-        format_tuple = PyTuple_Pack(1, item);
-        if (format_tuple == NULL)
-            return NULL;
-        err_string = PyString_Format(err_format, format_tuple);
-        Py_DECREF(format_tuple);
-        if (err_string == NULL)
-            return NULL;
-        PyErr_SetObject(PyExc_ValueError, err_string);
-        Py_DECREF(err_string);
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "LazySorted can't change while a view exports its "
+                        "buffer");
+        return NULL;
+    }
+
+    seed = PyInt_AsUnsignedLongLongMask(rng);
+    if (seed == (unsigned long long)-1 && PyErr_Occurred())
         return NULL;
+
+    /* Build everything first, so that a bad state leaves self as it was */
+    if (PyList_Check(items)) {
+        n = PyList_GET_SIZE(items);
+        if ((xs = (PyListObject *)PyList_GetSlice(items, 0, n)) == NULL)
+            goto fail;
+    }
+    else if (PyTuple_Check(items) && self->keyfunc == NULL &&
+             perm == Py_None) {
+        if ((ops = load_data(self, items, &data, &n)) == NULL)
+            goto fail;
     }
     else {
-        return PyInt_FromSsize_t(index);
+        PyErr_SetString(PyExc_ValueError, "bad items in LazySorted state");
+        goto fail;
+    }
+
+    if (perm != Py_None && (new_perm = load_perm(perm, n)) == NULL)
+        goto fail;
+
+    if (keys != Py_None && (self->keyfunc == NULL || !PyList_Check(keys) ||
+                            PyList_GET_SIZE(keys) != n)) {
+        PyErr_SetString(PyExc_ValueError, "bad keys in LazySorted state");
+        goto fail;
+    }
+    if (self->keyfunc != NULL) {
+        new_keys = (PyObject **)PyMem_Malloc((n > 0 ? n : 1) *
+                                             sizeof(PyObject *));
+        if (new_keys == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        for (i = 0; i < n; i++) {
+            new_keys[i] = keys != Py_None ? PyList_GET_ITEM(keys, i) : NULL;
+            Py_XINCREF(new_keys[i]);
+        }
+    }
+
+    /* The treap priorities come from a generator of their own, so the copy
+     * goes on to pick the same pivots as the original would have */
+    if (seed == 0)
+        seed = rng_seed(0);
+    priorities = rng_seed(seed);
+    if (load_pivots(gaps, flags, n, &idxs, &fl, &count) < 0 ||
+        build_pivots(n, idxs, fl, count, &root, &pool, &bits,
+                     &priorities) < 0)
+        goto fail;
+    PyMem_Free(idxs);
+    PyMem_Free(fl);
+
+    clear_items(self);
+    self->xs = xs;
+    self->perm = new_perm;
+    self->keys = new_keys;
+    self->data = data;
+    self->data_len = ops != NULL ? n : 0;
+    self->ops = ops;
+    self->root = root;
+    self->pool = pool;
+    self->bits = bits;
+    self->rng = seed;
+    self->prepared = 0;
+    self->shared_len = -1;
+    self->shared_ok = 1;
+    self->version++;
+    Py_RETURN_NONE;
+
+fail:
+    if (new_keys != NULL) {
+        for (i = 0; i < n; i++)
+            Py_XDECREF(new_keys[i]);
+        PyMem_Free(new_keys);
     }
+    Py_XDECREF(xs);
+    PyMem_Free(new_perm);
+    PyMem_Free(data);
+    PyMem_Free(idxs);
+    PyMem_Free(fl);
+    bits_clear(&bits);
+    pool_clear(&pool);
+    return NULL;
 }
 
+static PyTypeObject LSIter_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "LazySortedIterator",                       /* tp_name */
+    sizeof(LSIterObject),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor)LSIterObject_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)LSObject_iternext,            /* tp_iternext */
+    LSIterObject_methods,                       /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+
+/* Views are read-only windows onto the items at the positions [start, stop)
+ * of a LazySorted, made by between_view and by slicing ls.view. They hold no
+ * items of their own, just reading them from the LazySorted's storage, where
+ * the partitioning that made the view keeps them: more sorting only reorders
+ * the items within an unsorted view, and never touches a sorted one. Adding
+ * or removing items invalidates them, as it does iterators, and views of
+ * unboxed data export it with the buffer protocol, which pins the storage by
+ * refusing to add or remove items until the buffer is released. */
+
+typedef struct {
+    PyObject_HEAD
+    LSObject            *ls;
+    Py_ssize_t          start;
+    Py_ssize_t          len;            /* The number of items */
+    unsigned long       version;        /* ls->version when it was made */
+    char                format[2];      /* For the buffer, if it's unboxed */
+} ViewObject;
+
+static PyTypeObject View_Type;
+
 static PyObject *
-ls_count(LSObject *self, PyObject *args)
+view_new(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
 {
-    PyObject *item;
-    if (!PyArg_ParseTuple(args, "O:list", &item))
+    ViewObject *view = PyObject_New(ViewObject, &View_Type);
+    if (view == NULL)
         return NULL;
 
-    Py_ssize_t k = find_item(self, item);
-    if (k == -2) {
-        return NULL;
-    }
+    Py_INCREF(ls);
+    view->ls = ls;
+    view->start = start;
+    view->len = stop > start ? stop - start : 0;
+    view->version = ls->version;
+    view->format[0] = ls->ops != NULL ? ls->ops->format : 'O';
+    view->format[1] = '\0';
+    return (PyObject *)view;
+}
 
-    if (k == -1) {
-        return PyInt_FromSsize_t(0);
-    }
-    else {
-        /* Figure out where items may be */
-        PivotNode *left, *right;
-        bound_idx(k, self->root, &left, &right);
-        if (right == NULL) {
-            right = next_pivot(left);
-        }
-
-        int xs_len = Py_SIZE(self->xs);
-        int cmp;
-        for (cmp = 1; right->idx < xs_len && cmp; right = next_pivot(right)) {
-            cmp = PyObject_RichCompareBool(item,
-                                           self->xs->ob_item[right->idx],
-                                           Py_EQ);
-            if (cmp < 0) {
-                return NULL;
-            }
-        }
+static void
+view_dealloc(ViewObject *view)
+{
+    Py_DECREF(view->ls);
+    PyObject_Del(view);
+}
 
-        /* TODO: do some additional sorting here to take advantage of the
-         * compares. Or refactor the code substantially or something. */
-        Py_ssize_t count = 1;
-        for (k++; k < right->idx; k++) {
-            cmp = PyObject_RichCompareBool(item, self->xs->ob_item[k], Py_EQ);
-            if (cmp < 0) {
-                return NULL;
-            }
-            else if (cmp) {
-                count++;
-            }
+/* Sets a RuntimeError and returns -1 if the view's items have moved, which
+ * the caller must have locked its LazySorted to check, or returns 0 if not */
+static int
+view_check(ViewObject *view)
+{
+    LSObject *ls = view->ls;
+
+    if (view->version != ls->version) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "LazySorted changed since the view was made");
+        return -1;
+    }
+    /* A caller's list could have changed under us too */
+    if (ls->shared_len >= 0) {
+        PREPARE(ls) {
+            return -1;
         }
-        return PyInt_FromSsize_t(count);
     }
+    return 0;
 }
 
-static int
-ls_contains(LSObject *self, PyObject *item)
+static Py_ssize_t
+view_length(ViewObject *view)
 {
-    Py_ssize_t idx = find_item(self, item);
-    if (idx == -2) {
-        return -1;
+    return view->len;
+}
+
+static PyObject *
+view_item(ViewObject *view, Py_ssize_t i)
+{
+    LSObject *ls = view->ls;
+    PyObject *res = NULL;
+
+    if (i < 0 || i >= view->len) {
+        PyErr_SetString(PyExc_IndexError, "view index out of range");
+        return NULL;
     }
-    else if (idx == -1) {
-        return 0;
+
+    /* Reading an item doesn't move any, so it only has to wait for threads
+     * that might be */
+    if (CAN_READ(ls)) {
+        if (view_check(view) < 0)
+            return NULL;
+        return ls_item(ls, view->start + i);
     }
-    else {
-        return 1;
+    if (ls_enter(ls) < 0)
+        return NULL;
+    if (view_check(view) == 0)
+        res = ls_item(ls, view->start + i);
+    ls_unlock(ls);
+    return res;
+}
+
+/* Slices with a step of one give views of part of the view, and others, lists
+ * of its items */
+static PyObject *
+view_subscript(ViewObject *view, PyObject *item)
+{
+    Py_ssize_t start, stop, step, slicelength, k, j;
+    PyObject *res, *x;
+
+    if (PyIndex_Check(item)) {
+        k = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if (k == -1 && PyErr_Occurred())
+            return NULL;
+        return view_item(view, k < 0 ? k + view->len : k);
+    }
+    if (!PySlice_Check(item)) {
+        PyErr_Format(PyExc_TypeError,
+                     "view indices must be integers, not %.200s",
+                     item->ob_type->tp_name);
+        return NULL;
     }
-}
 
-static PyObject *
-ls_pivots(LSObject *self)
-{
-    PyObject *result = PyList_New(0);
-    if (result == NULL) 
+    if (PySlice_GetIndicesEx(item, view->len,
+                             &start, &stop, &step, &slicelength) < 0)
         return NULL;
+    if (step == 1)
+        return view_new(view->ls, view->start + start,
+                        view->start + start + slicelength);
 
-    PyObject *unsorted = PyString_FromString("UNSORTED");
-    if (unsorted == NULL)
-        return NULL;
-    PyObject *sortedright = PyString_FromString("SORTED_RIGHT");
-    if (sortedright == NULL)
-        return NULL;
-    PyObject *sortedleft = PyString_FromString("SORTED_LEFT");
-    if (sortedleft == NULL)
-        return NULL;
-    PyObject *sortedboth = PyString_FromString("SORTED_BOTH");
-    if (sortedboth == NULL)
+    if ((res = PyList_New(slicelength)) == NULL)
         return NULL;
+    for (k = start, j = 0; j < slicelength; k += step, j++) {
+        if ((x = view_item(view, k)) == NULL) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyList_SET_ITEM(res, j, x);
+    }
+    return res;
+}
 
-    PyObject *flags[4] = {unsorted, sortedright, sortedleft, sortedboth};
+static PyObject *
+view_iter(PyObject *view)
+{
+    return PySeqIter_New(view);
+}
 
-    PivotNode *curr = self->root;
-    while (curr->left != NULL)
-        curr = curr->left;
+#ifdef HAVE_NEWBUFFER
+static int
+view_getbuffer(ViewObject *view, Py_buffer *buf, int flags)
+{
+    LSObject *ls = view->ls;
+    int res = -1;
 
-    Py_ssize_t i;
-    PyObject *index;
-    PyObject *tuple;
-    for (i = 0; curr != NULL; i++, curr = next_pivot(curr)) {
-        index = PyInt_FromSsize_t(curr->idx);
-        if (index == NULL) {
-            Py_DECREF(result);
-            return NULL;
-        }
-        tuple = PyTuple_Pack(2, index, flags[curr->flags]);
-        if (tuple == NULL) {
-            Py_DECREF(index);
-            Py_DECREF(result);
-            return NULL;
-        }
-        PyList_Append(result, tuple);
+    if (ls->ops == NULL) {
+        PyErr_SetString(PyExc_BufferError,
+                        "only views of unboxed numbers have a buffer");
+        return -1;
+    }
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "views are read-only");
+        return -1;
     }
 
-    return (PyObject*)result;
+    if (ls_enter(ls) < 0)
+        return -1;
+    if (view_check(view) == 0) {
+        buf->buf = (char *)ls->data + view->start * ls->ops->itemsize;
+        buf->obj = (PyObject *)view;
+        Py_INCREF(view);
+        buf->len = view->len * ls->ops->itemsize;
+        buf->readonly = 1;
+        buf->itemsize = ls->ops->itemsize;
+        buf->format = (flags & PyBUF_FORMAT) ? view->format : NULL;
+        buf->ndim = 1;
+        buf->shape = (flags & PyBUF_ND) ? &view->len : NULL;
+        buf->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+                       &buf->itemsize : NULL;
+        buf->suboffsets = NULL;
+        buf->internal = NULL;
+        ls->exports++;
+        res = 0;
+    }
+    ls_unlock(ls);
+    return res;
 }
 
-static Py_ssize_t
-ls_length(LSObject *self)
+static void
+view_releasebuffer(ViewObject *view, Py_buffer *buf)
 {
-    return Py_SIZE(self->xs);
+    (void)buf;
+    ls_lock(view->ls);
+    view->ls->exports--;
+    ls_unlock(view->ls);
 }
 
-/* The LazySorted iterator object */
-/* TODO: Be a little smarter here, (keep track of pivots, etc) */
-typedef struct {
-    PyObject_HEAD
-    LSObject            *ls;            /* The referenced lazysorted object */
-    Py_ssize_t          i;              /* The next location to check */
-} LSIterObject;
+static PyBufferProcs view_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0, 0, 0, 0,
+#endif
+    (getbufferproc)view_getbuffer,
+    (releasebufferproc)view_releasebuffer,
+};
+#endif
 
-static PyTypeObject LSIter_Type;
-#define LSIterObject_Check(v)      (Py_TYPE(v) == &LSIter_Type)
+static PySequenceMethods view_as_sequence = {
+    (lenfunc)view_length,                       /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    (ssizeargfunc)view_item,                    /* sq_item */
+};
 
-static PyMethodDef LSIterObject_methods[] = {
-    {NULL, NULL}           /* sentinel */
+static PyMappingMethods view_as_mapping = {
+    (lenfunc)view_length,
+    (binaryfunc)view_subscript,
 };
 
-PyObject*
-LSObject_iter(PyObject *self)
-{
-    LSIterObject *it;
+static PyTypeObject View_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "LazySortedView",                           /* tp_name */
+    sizeof(ViewObject),                         /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor)view_dealloc,                   /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    &view_as_sequence,                          /* tp_as_sequence */
+    &view_as_mapping,                           /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+#ifdef HAVE_NEWBUFFER
+    &view_as_buffer,                            /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+#else
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+#endif
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    view_iter,                                  /* tp_iter */
+};
 
-    if (!LSObject_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
-    }
-    it = PyObject_GC_New(LSIterObject, &LSIter_Type);
-    if (it == NULL)
-        return NULL;
-    it->i = 0;
-    Py_INCREF(self);
-    it->ls = (LSObject *)self;
+/* ls.view is a ViewMaker, whose slices are sorted views of ls */
 
-    return (PyObject *)it;
-}
+typedef struct {
+    PyObject_HEAD
+    LSObject            *ls;
+} ViewMakerObject;
 
 static void
-LSIterObject_dealloc(LSIterObject *it)
+view_maker_dealloc(ViewMakerObject *maker)
 {
-    Py_XDECREF(it->ls);
-    PyObject_GC_Del(it);
+    Py_DECREF(maker->ls);
+    PyObject_Del(maker);
 }
 
-PyObject*
-LSObject_iternext(PyObject *self)
+static PyObject *
+view_maker_subscript(ViewMakerObject *maker, PyObject *item)
 {
-    LSIterObject *lsi = (LSIterObject *)self;
-    if (lsi->i < ls_length(lsi->ls)) {
-        if (sort_point(lsi->ls, lsi->i) < 0) {
-            return NULL;    
-        }
-        PyObject *res = lsi->ls->xs->ob_item[lsi->i];
-        Py_INCREF(res);
-        (lsi->i)++;
-        return res;
-    } else {
-        PyErr_SetNone(PyExc_StopIteration);
+    LSObject *ls = maker->ls;
+    Py_ssize_t start, stop, step, slicelength;
+    PyObject *res = NULL;
+
+    if (!PySlice_Check(item)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "views are made by slicing, like ls.view[i:j]");
+        return NULL;
+    }
+
+    if (ls_enter(ls) < 0)
         return NULL;
+    if (PySlice_GetIndicesEx(item, LS_SIZE(ls),
+                             &start, &stop, &step, &slicelength) < 0)
+        goto done;
+    if (step != 1) {
+        PyErr_SetString(PyExc_ValueError, "views need a step of 1");
+        goto done;
     }
+    if (slicelength > 0 && sort_range(ls, start, stop) < 0)
+        goto done;
+    res = view_new(ls, start, stop);
+
+done:
+    ls_unlock(ls);
+    return res;
 }
 
-static PyTypeObject LSIter_Type = {
+static PyMappingMethods view_maker_as_mapping = {
+    0,
+    (binaryfunc)view_maker_subscript,
+};
+
+static PyTypeObject ViewMaker_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "LazySortedIterator",                       /* tp_name */
-    sizeof(LSIterObject),                       /* tp_basicsize */
+    "LazySortedViewMaker",                      /* tp_name */
+    sizeof(ViewMakerObject),                    /* tp_basicsize */
     0,                                          /* tp_itemsize */
     /* methods */
-    (destructor)LSIterObject_dealloc,           /* tp_dealloc */
+    (destructor)view_maker_dealloc,             /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -1403,7 +8033,7 @@ static PyTypeObject LSIter_Type = {
     0,                                          /* tp_repr */
     0,                                          /* tp_as_number */
     0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
+    &view_maker_as_mapping,                     /* tp_as_mapping */
     0,                                          /* tp_hash */
     0,                                          /* tp_call */
     0,                                          /* tp_str */
@@ -1411,17 +8041,89 @@ static PyTypeObject LSIter_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT,                         /* tp_flags */
-    0,                                          /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)LSObject_iternext,            /* tp_iternext */
-    LSIterObject_methods,                       /* tp_methods */
-    0,                                          /* tp_members */
 };
 
+static PyObject *
+ls_get_view(LSObject *self, void *closure)
+{
+    ViewMakerObject *maker;
+
+    (void)closure;
+    maker = PyObject_New(ViewMakerObject, &ViewMaker_Type);
+    if (maker == NULL)
+        return NULL;
+    Py_INCREF(self);
+    maker->ls = self;
+    return (PyObject *)maker;
+}
+
+/* Returns a view of the items in a contiguous range, as between returns them
+ */
+static PyObject *
+between_view(LSObject *self, PyObject *args)
+{
+    Py_ssize_t left, right;
+    int res;
+
+    if ((res = between_bounds(self, args, "nn:between_view",
+                              &left, &right)) < 0)
+        return NULL;
+    if (res == 0)
+        return view_new(self, 0, 0);
+    return view_new(self, left, right);
+}
+
+/* The methods that read or change ls take turns at it */
+LOCKED(PyObject *, ls_tolist, self, (LSObject *self), (self))
+LOCKED(PyObject *, ls_pivots, self, (LSObject *self), (self))
+LOCKED(PyObject *, ls_select_many, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_nsmallest, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_nlargest, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_add, self, (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_extend, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_remove, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_bisect_left, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_bisect_right, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_equal_range, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, between, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, between_view, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_buckets, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_replace, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_index, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_count, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_sum_between, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_mean_between, self,
+       (LSObject *self, PyObject *args), (self, args))
+LOCKED(PyObject *, ls_var_between, self,
+       (LSObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+LOCKED(PyObject *, ls_trimmed_mean, self,
+       (LSObject *self, PyObject *arg), (self, arg))
+LOCKED(PyObject *, ls_values_between, self,
+       (LSObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+LOCKED(PyObject *, ls_quantiles, self,
+       (LSObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+LOCKED(PyObject *, ls_getstate, self,
+       (LSObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+LOCKED(PyObject *, ls_reduce, self, (LSObject *self), (self))
+LOCKED(PyObject *, ls_setstate, self,
+       (LSObject *self, PyObject *state), (self, state))
+LOCKED_OR(-1, int, ls_contains, self,
+          (LSObject *self, PyObject *item), (self, item))
 
 /* TODO: This documentation sucks */
 static PyMethodDef LS_methods[] = {
@@ -1444,35 +8146,337 @@ static PyMethodDef LS_methods[] = {
 "    >>> ls[::20]\n"
 "    [0, 20, 40, 60, 80]"
 )},
-    {"between", (PyCFunction)between, METH_VARARGS,
+    {"__reversed__", (PyCFunction)ls_reversed, METH_NOARGS,
+        PyDoc_STR(
+"__reversed__() returns an iterator over the items from last to first in\n"
+"sorted order. Like iterating forwards, it only sorts as it goes.\n"
+)},
+    {"tolist", (PyCFunction)ls_tolist_locked, METH_NOARGS,
+        PyDoc_STR(
+"tolist() returns a list of all the items in sorted order. It's faster than\n"
+"list(LS), since it sorts everything at once.\n"
+"\n"
+"Examples:\n\n"
+"    >>> LazySorted([3, 1, 2]).tolist()\n"
+"    [1, 2, 3]"
+)},
+    {"between", (PyCFunction)between_locked, METH_VARARGS,
+        PyDoc_STR(
+"between allows you to access all points that are between particular\n"
+"indices. The order of the points it returns, however, is undefined. This is\n"
+"useful if you want to throw away outliers in some data set, for example.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(100)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> set(ls.between(5, 95)) == set(range(5, 95))\n"
+"    True"
+)},
+    {"between_view", (PyCFunction)between_view_locked, METH_VARARGS,
+        PyDoc_STR(
+"between_view is like between, but returns a view of the items, which reads\n"
+"them from the LazySorted instead of copying them out. The view stops\n"
+"working if items are added or removed, and a view of unboxed numbers\n"
+"exports them with the buffer protocol, as for numpy or memoryview.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted(range(100))\n"
+"    >>> v = ls.between_view(5, 95)\n"
+"    >>> len(v), set(v) == set(range(5, 95))\n"
+"    (90, True)"
+)},
+    {"sum_between", (PyCFunction)ls_sum_between_locked, METH_VARARGS,
+        PyDoc_STR(
+"sum_between(i, j) returns the sum of the items that between(i, j) would\n"
+"return, without making a list of them. Floats are added up with\n"
+"compensation, so the sum is more accurate than the builtin sum's, and\n"
+"integers are added up exactly.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted(range(100))\n"
+"    >>> ls.sum_between(5, 95)\n"
+"    4500"
+)},
+    {"mean_between", (PyCFunction)ls_mean_between_locked, METH_VARARGS,
+        PyDoc_STR(
+"mean_between(i, j) returns the mean of the items that between(i, j) would\n"
+"return, which mustn't be empty.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted(range(100))\n"
+"    >>> ls.mean_between(5, 95)\n"
+"    50.0"
+)},
+    {"var_between", (PyCFunction)ls_var_between_locked,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(
+"var_between(i, j, ddof=0) returns the variance of the items that\n"
+"between(i, j) would return, as a float, dividing by their number minus\n"
+"ddof, as in numpy.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([1, 2, 3, 4, 100])\n"
+"    >>> ls.var_between(0, 4), ls.var_between(0, 4, ddof=1)\n"
+"    (1.25, 1.6666666666666667)"
+)},
+    {"trimmed_mean", (PyCFunction)ls_trimmed_mean_locked, METH_O,
+        PyDoc_STR(
+"trimmed_mean(alpha) returns the mean of the items from the alpha to the\n"
+"1 - alpha quantiles, for alpha in [0, 0.5), throwing away the outliers at\n"
+"either end. It only partitions the data around the two quantiles, so it\n"
+"takes expected linear time.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([1, 2, 3, 4, 5, 6, 7, 8, 9, 1000])\n"
+"    >>> ls.trimmed_mean(0.1)\n"
+"    5.5"
+)},
+    {"values_between", (PyCFunction)ls_values_between_locked,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(
+"values_between(lo, hi, inclusive=False) returns all the items x with\n"
+"lo <= x < hi, or lo <= x <= hi if inclusive, in no particular order. If\n"
+"there's a key function, it's applied to lo and hi, and the items' keys are\n"
+"compared with them. Only the regions containing the boundaries are\n"
+"partitioned, and the boundaries are kept as pivots, so repeated queries of\n"
+"nearby ranges get faster.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(100)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> sorted(ls.values_between(20, 25))\n"
+"    [20, 21, 22, 23, 24]\n"
+"    >>> sorted(ls.values_between(20, 25, inclusive=True))\n"
+"    [20, 21, 22, 23, 24, 25]"
+)},
+    {"select_many", (PyCFunction)ls_select_many_locked, METH_O,
+        PyDoc_STR(
+"select_many(ranks) returns a list of the items at each of the indices in\n"
+"ranks, which may be in any order. Selecting them all at once is much faster\n"
+"than one at a time, since each partition of the data is shared by all the\n"
+"indices it separates.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(100)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> ls.select_many([90, 10, -1, 50])\n"
+"    [90, 10, 99, 50]"
+)},
+    {"nsmallest", (PyCFunction)ls_nsmallest_locked, METH_O,
+        PyDoc_STR(
+"nsmallest(k) returns the first k items in sorted order, like ls[:k], or all\n"
+"of them if there are fewer than k. When k is small next to the number of\n"
+"items, it finds them in one pass over the items with a heap of k, like the\n"
+"heapq module does. With reverse=True, these are the largest items.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 3, 8, 1, 9, 2])\n"
+"    >>> ls.nsmallest(3)\n"
+"    [1, 2, 3]"
+)},
+    {"nlargest", (PyCFunction)ls_nlargest_locked, METH_O,
+        PyDoc_STR(
+"nlargest(k) returns the last k items in sorted order, from the last one\n"
+"back, like ls[:-k - 1:-1], or all of them if there are fewer than k. It\n"
+"picks them out the same way as nsmallest.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 3, 8, 1, 9, 2])\n"
+"    >>> ls.nlargest(3)\n"
+"    [9, 8, 5]"
+)},
+    {"quantiles", (PyCFunction)ls_quantiles_locked,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(
+"quantiles(ps, interpolation='linear') returns a list of the quantiles at\n"
+"each of the probabilities in ps, which must be between 0 and 1. When a\n"
+"quantile falls between two items, interpolation says which value to use:\n"
+"'linear', 'lower', 'higher', 'nearest', or 'midpoint', as in numpy. The\n"
+"quantiles are selected all at once, like in select_many.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(101)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> ls.quantiles([0.1, 0.5, 0.9])\n"
+"    [10, 50, 90]\n"
+"    >>> ls.quantiles([0.125], interpolation='lower')\n"
+"    [12]"
+)},
+    {"buckets", (PyCFunction)ls_buckets_locked, METH_VARARGS,
+        PyDoc_STR(
+"buckets(m) splits the items into m groups of nearly equal size, where\n"
+"every item in a group is no greater than any item in the next, and returns\n"
+"them as a list of lists. The items within each group are in no particular\n"
+"order. This is an equal-depth histogram.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(10)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> [sorted(bucket) for bucket in ls.buckets(3)]\n"
+"    [[0, 1, 2, 3], [4, 5, 6], [7, 8, 9]]"
+)},
+    {"add", (PyCFunction)ls_add_locked, METH_O,
+        PyDoc_STR(
+"add(x) adds x to the LazySorted. It goes between the pivots around its\n"
+"value, so the partial sorting done so far is kept, but the items after it\n"
+"have to shift over, which takes linear time. Adding or removing items stops\n"
+"any iterations over the LazySorted.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3])\n"
+"    >>> ls.add(2)\n"
+"    >>> ls[1]\n"
+"    2"
+)},
+    {"extend", (PyCFunction)ls_extend_locked, METH_O,
+        PyDoc_STR(
+"extend(iterable) adds all the items of iterable, like add. The items after\n"
+"them are shifted just once, so it's much faster than adding them one at a\n"
+"time."
+)},
+    {"remove", (PyCFunction)ls_remove_locked, METH_O,
+        PyDoc_STR(
+"remove(x) removes an item equal to x, or raises a ValueError if there\n"
+"isn't one.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3])\n"
+"    >>> ls.remove(3)\n"
+"    >>> ls[1]\n"
+"    5"
+)},
+    {"replace", (PyCFunction)ls_replace_locked, METH_VARARGS,
+        PyDoc_STR(
+"replace(i, x) replaces the item at index i in sorted order with x, which\n"
+"then goes wherever it belongs.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3])\n"
+"    >>> ls.replace(0, 4)\n"
+"    >>> ls[:]\n"
+"    [3, 4, 5]"
+)},
+    {"index", (PyCFunction)ls_index_locked, METH_VARARGS,
+        PyDoc_STR(
+"Returns the first index of item in the list, or raises a ValueError if it\n"
+"isn't present"
+)},
+    {"count", (PyCFunction)ls_count_locked, METH_VARARGS,
+        PyDoc_STR(
+"Returns the number of times the item appears in the list"
+)},
+    {"bisect_left", (PyCFunction)ls_bisect_left_locked, METH_O,
+        PyDoc_STR(
+"bisect_left(x) returns the index where x would be inserted to keep the list\n"
+"sorted, before any items equal to it. This is the number of items that come\n"
+"before x, like bisect.bisect_left on the sorted list. If there's a key\n"
+"function, it's applied to x too. Only the regions that the index might be\n"
+"in get partitioned.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3, 3, 7])\n"
+"    >>> ls.bisect_left(3)\n"
+"    1\n"
+"    >>> ls.bisect_left(4)\n"
+"    3"
+)},
+    {"bisect_right", (PyCFunction)ls_bisect_right_locked, METH_O,
+        PyDoc_STR(
+"bisect_right(x) returns the index where x would be inserted to keep the\n"
+"list sorted, after any items equal to it, like bisect.bisect_right on the\n"
+"sorted list. See bisect_left.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3, 3, 7])\n"
+"    >>> ls.bisect_right(3)\n"
+"    3"
+)},
+    {"rank", (PyCFunction)ls_bisect_left_locked, METH_O,
+        PyDoc_STR(
+"rank(x) returns the number of items that come before x in sorted order, and\n"
+"so the index x has or would have in the sorted list. It's the same as\n"
+"bisect_left(x).\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted(range(0, 100, 10))\n"
+"    >>> ls.rank(35)\n"
+"    4"
+)},
+    {"equal_range", (PyCFunction)ls_equal_range_locked, METH_O,
+        PyDoc_STR(
+"equal_range(x) returns the pair (bisect_left(x), bisect_right(x)), the\n"
+"range of indices of the items equal to x.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 1, 3, 3, 7])\n"
+"    >>> ls.equal_range(3)\n"
+"    (1, 3)"
+)},
+    {"__reduce__", (PyCFunction)ls_reduce_locked, METH_NOARGS,
         PyDoc_STR(
-"between allows you to access all points that are between particular\n"
-"indices. The order of the points it returns, however, is undefined. This is\n"
-"useful if you want to throw away outliers in some data set, for example.\n"
+"__reduce__() lets LazySorted objects be pickled and copied. The copy has\n"
+"the items in the same partially sorted order, and the same pivots, so it\n"
+"carries on where the original left off, without redoing its partitioning.\n"
+"A key function has to be picklable too, like a function from a module.\n"
 "\n"
 "Examples:\n\n"
-"    >>> xs = range(100)\n"
-"    >>> random.shuffle(xs)\n"
-"    >>> ls = LazySorted(xs)\n"
-"    >>> set(ls.between(5, 95)) == set(range(5, 95))\n"
+"    >>> import pickle\n"
+"    >>> ls = LazySorted([5, 3, 8, 1, 9, 2, 7])\n"
+"    >>> ls[3]\n"
+"    5\n"
+"    >>> copy = pickle.loads(pickle.dumps(ls))\n"
+"    >>> copy._pivots() == ls._pivots()\n"
 "    True"
 )},
-    {"index", (PyCFunction)ls_index, METH_VARARGS,
+    {"__getstate__", (PyCFunction)ls_getstate_locked,
+     METH_VARARGS | METH_KEYWORDS,
         PyDoc_STR(
-"Returns the first index of item in the list, or raises a ValueError if it\n"
-"isn't present"
+"__getstate__(pivots=True) returns the state that pickling saves: the items\n"
+"in their current order, the items that indices point to, the keys of a\n"
+"key function, the random generator, and the pivots, as the bytes of their\n"
+"gaps and of their flags. With pivots=False, it leaves out the pivots, for\n"
+"just the data, which __setstate__ then starts over on."
 )},
-    {"count", (PyCFunction)ls_count, METH_VARARGS,
+    {"__setstate__", (PyCFunction)ls_setstate_locked, METH_O,
         PyDoc_STR(
-"Returns the number of times the item appears in the list"
+"__setstate__(state) replaces the items and pivots with those of a state\n"
+"from __getstate__, keeping the key function and the reverse flag.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 3, 8, 1, 9])\n"
+"    >>> state = ls.__getstate__(pivots=False)\n"
+"    >>> copy = LazySorted([])\n"
+"    >>> copy.__setstate__(state)\n"
+"    >>> copy[-1], len(copy)\n"
+"    (9, 5)"
 )},
-    {"_pivots", (PyCFunction)ls_pivots, METH_NOARGS,
+    {"_pivots", (PyCFunction)ls_pivots_locked, METH_NOARGS,
         PyDoc_STR(
 "Returns the list of pivot indices, for debugging"
 )},
     {NULL,              NULL}           /* sentinel */
 };
 
+static PyGetSetDef LS_getset[] = {
+    {"view", (getter)ls_get_view, NULL,
+        PyDoc_STR(
+"Slicing ls.view sorts the slice, like ls[i:j], and returns a view of the\n"
+"sorted items, like between_view, instead of a list of them.\n"
+"\n"
+"Examples:\n\n"
+"    >>> ls = LazySorted([5, 3, 8, 1, 9, 2])\n"
+"    >>> v = ls.view[1:4]\n"
+"    >>> list(v), v[-1], list(v[1:])\n"
+"    ([2, 3, 5], 5, [3, 5])"
+), NULL},
+    {NULL}                                      /* sentinel */
+};
+
 static PySequenceMethods ls_as_sequence = {
     (lenfunc)ls_length,                         /* sq_length */
     0,                                          /* sq_concat */
@@ -1481,7 +8485,7 @@ static PySequenceMethods ls_as_sequence = {
     0,                                          /* sq_slice */
     0,                                          /* sq_ass_item */
     0,                                          /* sq_ass_slice */
-    (objobjproc)ls_contains,                    /* sq_contains */
+    (objobjproc)ls_contains_locked,             /* sq_contains */
     0,                                          /* sq_inplace_concat */
     0,                                          /* sq_inplace_repeat */
 };
@@ -1526,7 +8530,7 @@ static PyTypeObject LS_Type = {
     0,                      /*tp_iternext*/
     LS_methods,             /*tp_methods*/
     0,                      /*tp_members*/
-    0,                      /*tp_getset*/
+    LS_getset,              /*tp_getset*/
     0,                      /*tp_base*/
     0,                      /*tp_dict*/
     0,                      /*tp_descr_get*/
@@ -1539,8 +8543,600 @@ static PyTypeObject LS_Type = {
     0,                      /*tp_is_gc*/
 };
 
+/* RollingLazySorted objects keep the quantiles of a sliding window over a
+ * stream. The window is a LazySorted whose list is a ring of the items in
+ * order of arrival, and which sorts their indices, keeping track of where each
+ * one is. A new item takes the place of the item it pushes out, wherever that
+ * is, and travels to the gap between the pivots around its value, so the
+ * partitioning done for earlier quantiles carries over, and each step only has
+ * to partition near the quantiles again. */
+
+typedef struct {
+    PyObject_HEAD
+    LSObject            *ls;            /* The items in the window */
+    Py_ssize_t          window;         /* The size of the window */
+    Py_ssize_t          oldest;         /* The index of the oldest in ls->xs */
+    double              *probs;         /* The quantiles to track */
+    Py_ssize_t          np;             /* The number of them */
+    int                 interpolation;  /* The INTERP_* to use */
+} RollingObject;
+
+static PyTypeObject Rolling_Type;
+
+static void
+Rolling_dealloc(RollingObject *self)
+{
+    PyMem_Free(self->probs);
+    Py_XDECREF(self->ls);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+newRollingObject(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    RollingObject *self;
+    Py_ssize_t window;
+    PyObject *ps = NULL, *seed = Py_None, *empty;
+    const char *interp_name = "linear";
+    static char *kwdlist[] = {"window", "quantiles", "interpolation", "seed",
+                              0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|OsO:RollingLazySorted",
+        kwdlist, &window, &ps, &interp_name, &seed))
+        return NULL;
+    if (window < 1) {
+        PyErr_SetString(PyExc_ValueError, "window must be at least 1");
+        return NULL;
+    }
+
+    self = (RollingObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->ls = NULL;
+    self->window = window;
+    self->oldest = 0;
+    self->probs = NULL;
+    self->np = 1;
+
+    if ((self->interpolation = parse_interpolation(interp_name)) < 0)
+        goto fail;
+    if (ps != NULL) {
+        if ((self->probs = parse_probabilities(ps, &self->np)) == NULL)
+            goto fail;
+    }
+    else {
+        /* The median by default */
+        if ((self->probs = (double *)PyMem_Malloc(sizeof(double))) == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        self->probs[0] = 0.5;
+    }
+
+    if ((empty = PyList_New(0)) == NULL)
+        goto fail;
+    self->ls = (LSObject *)PyObject_CallFunction((PyObject *)&LS_Type,
+                                                 "OOiO", empty, Py_None, 0,
+                                                 seed);
+    Py_DECREF(empty);
+    if (self->ls == NULL)
+        goto fail;
+
+    /* rolling_push grows the window by moving the last pivot, which only a
+     * treap can do, so it gets one however low BITS_THRESH is */
+    if (self->ls->bits.words != NULL) {
+        bits_clear(&self->ls->bits);
+        pool_reset(&self->ls->pool);
+        self->ls->root = NULL;
+        if (insert_pivot(-1, UNSORTED, &self->ls->root, NULL,
+                         &self->ls->pool, &self->ls->rng) == NULL ||
+            insert_pivot(0, UNSORTED, &self->ls->root, self->ls->root,
+                         &self->ls->pool, &self->ls->rng) == NULL)
+            goto fail;
+    }
+    self->ls->perm = (Py_ssize_t *)PyMem_Malloc(window * sizeof(Py_ssize_t));
+    self->ls->where = (Py_ssize_t *)PyMem_Malloc(window * sizeof(Py_ssize_t));
+    if (self->ls->perm == NULL || self->ls->where == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    return (PyObject *)self;
+
+fail:
+    Py_DECREF(self);
+    return NULL;
+}
+
+/* Sets a ValueError and returns -1 if item isn't equal to itself, like a NaN,
+ * which compares neither less nor greater than anything and so would throw
+ * off the order of the window, or returns 0 if it is */
+static int
+check_self_equal(PyObject *item)
+{
+    PyObject *res;
+    int eq;
+
+    switch (key_kind(item)) {
+    case KIND_FLOAT:
+        eq = !Py_IS_NAN(PyFloat_AS_DOUBLE(item));
+        break;
+    case KIND_INT:
+    case KIND_STR:
+        eq = 1;
+        break;
+    default:
+        if ((res = PyObject_RichCompare(item, item, Py_EQ)) == NULL)
+            return -1;
+        eq = PyObject_IsTrue(res);
+        Py_DECREF(res);
+        if (eq < 0)
+            return -1;
+    }
+    if (!eq) {
+        PyErr_SetString(PyExc_ValueError,
+                        "RollingLazySorted items must equal themselves");
+        return -1;
+    }
+    return 0;
+}
+
+/* Adds item to the window, pushing out the oldest item if it's full. Returns
+ * 0 on success or -1 on error, leaving the window as it was. */
+static int
+rolling_push(RollingObject *self, PyObject *item)
+{
+    LSObject *ls = self->ls;
+    Py_ssize_t n = LS_SIZE(ls);
+    PivotNode *last;
+
+    if (check_self_equal(item) < 0)
+        return -1;
+
+    /* The new item takes the place of the oldest */
+    if (n == self->window) {
+        if (replace_at(ls, ls->where[self->oldest], item) < 0)
+            return -1;
+        self->oldest = (self->oldest + 1) % self->window;
+        return 0;
+    }
+
+    /* Or it goes in at the end of the last region, which the last pivot moves
+     * over for, and replace_at moves it from there. newRollingObject put the
+     * pivots in a treap. */
+    assert(ls->bits.words == NULL);
+    if (PyList_Append((PyObject *)ls->xs, item) < 0)
+        return -1;
+    ls->perm[n] = n;
+    ls->where[n] = n;
+    for (last = ls->root; last->right != NULL; last = last->right)
+        ;
+    last->idx = n + 1;
+    /* An empty list has no kind to keep, so the item picks one */
+    if (n == 0)
+        ls->prepared = 0;
+    if (replace_at(ls, n, item) < 0) {
+        last->idx = n;
+        Py_SET_SIZE(ls->xs, n);
+        Py_DECREF(item);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+rolling_push_method(RollingObject *self, PyObject *item)
+{
+    if (rolling_push(self, item) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+rolling_quantiles(RollingObject *self)
+{
+    return quantiles_at(self->ls, self->probs, self->np,
+                        self->interpolation);
+}
+
+static PyObject *
+rolling_feed(RollingObject *self, PyObject *iterable)
+{
+    PyObject *it, *item, *qs, *result;
+    int res;
+
+    if ((result = PyList_New(0)) == NULL)
+        return NULL;
+    if ((it = PyObject_GetIter(iterable)) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    while ((item = PyIter_Next(it)) != NULL) {
+        if (rolling_push(self, item) < 0)
+            goto fail;
+        Py_DECREF(item);
+        if ((qs = rolling_quantiles(self)) == NULL) {
+            item = NULL;
+            goto fail;
+        }
+        res = PyList_Append(result, qs);
+        Py_DECREF(qs);
+        if (res < 0) {
+            item = NULL;
+            goto fail;
+        }
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+
+fail:
+    Py_XDECREF(item);
+    Py_DECREF(it);
+    Py_DECREF(result);
+    return NULL;
+}
+
+static Py_ssize_t
+rolling_length(RollingObject *self)
+{
+    return LS_SIZE(self->ls);
+}
+
+LOCKED(PyObject *, rolling_push_method, self->ls,
+       (RollingObject *self, PyObject *item), (self, item))
+LOCKED(PyObject *, rolling_quantiles, self->ls, (RollingObject *self), (self))
+LOCKED(PyObject *, rolling_feed, self->ls,
+       (RollingObject *self, PyObject *item), (self, item))
+
+static PyMethodDef Rolling_methods[] = {
+    {"push", (PyCFunction)rolling_push_method_locked, METH_O,
+        PyDoc_STR(
+"push(x) adds x to the window, and pushes the oldest item out of it if it's\n"
+"full. Items that aren't equal to themselves, like NaN, raise ValueError,\n"
+"since they can't be ordered."
+)},
+    {"quantiles", (PyCFunction)rolling_quantiles_locked, METH_NOARGS,
+        PyDoc_STR(
+"quantiles() returns a list of the current quantiles of the window.\n"
+"\n"
+"Examples:\n\n"
+"    >>> r = RollingLazySorted(3, quantiles=[0.5, 1.0])\n"
+"    >>> for x in [5, 1, 3, 7]:\n"
+"    ...     r.push(x)\n"
+"    >>> r.quantiles()\n"
+"    [3, 7]"
+)},
+    {"feed", (PyCFunction)rolling_feed_locked, METH_O,
+        PyDoc_STR(
+"feed(iterable) pushes each item of iterable, and returns a list of the\n"
+"quantiles after each one.\n"
+"\n"
+"Examples:\n\n"
+"    >>> RollingLazySorted(3).feed([5, 1, 3, 7, 2])\n"
+"    [[5], [3.0], [3], [3], [3]]"
+)},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PySequenceMethods rolling_as_sequence = {
+    (lenfunc)rolling_length,                    /* sq_length */
+};
+
+PyDoc_STRVAR(rolling_doc,
+"RollingLazySorted(window, quantiles=[0.5], interpolation='linear',\n"
+"seed=None) keeps the quantiles of the last window items pushed into it, as\n"
+"in LazySorted.quantiles. A push moves one item of each unsorted region\n"
+"between where the oldest item was and where the new one goes, and every\n"
+"item of each sorted one. That's a few items for streams that stay in the\n"
+"same range, but trending streams or long runs of equal values can make it\n"
+"a good part of the window."
+);
+
+static PyTypeObject Rolling_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lazysorted.RollingLazySorted",/*tp_name*/
+    sizeof(RollingObject),  /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)Rolling_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &rolling_as_sequence,   /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_BASETYPE,    /*tp_flags*/
+    rolling_doc,            /*tp_doc*/
+    0,                      /*tp_traverse*/
+    0,                      /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    Rolling_methods,        /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    0,                      /*tp_init*/
+    PyType_GenericAlloc,    /*tp_alloc*/
+    newRollingObject,       /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* Module level functions. These select once from a sequence, so rather than
+ * make a LazySorted, they run on an LSObject that lives on the stack and is
+ * never seen by python, and leave no pivots behind. */
+
+/* Sets up ls to hold no items yet, and no keys */
+static void
+scratch_init(LSObject *ls, PyObject *keyfunc)
+{
+    memset(ls, 0, sizeof(LSObject));
+    ls->keyfunc = keyfunc;
+    ls->rng = rng_seed(entropy + unseeded_count++);
+    ls->shared_len = -1;
+    ls->shared_ok = 1;
+}
+
+/* Gives ls a copy of the items of seq, unboxed if they're a numeric buffer
+ * and there's no key function. Returns 0 on success or -1 on error. */
+static int
+scratch_copy(LSObject *ls, PyObject *seq)
+{
+#ifdef HAVE_NEWBUFFER
+    int res;
+
+    if (ls->keyfunc == NULL && (res = native_init(ls, seq)) != 0)
+        return res < 0 ? -1 : 0;
+#endif
+    if ((ls->xs = (PyListObject *)PySequence_List(seq)) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Moves the kth smallest of the items in ls, counting from the end if k is
+ * negative, to its sorted place, and returns its index, or -1 on error. name
+ * is the function to blame for a bad index. */
+static Py_ssize_t
+scratch_select(LSObject *ls, Py_ssize_t k, const char *name)
+{
+    Py_ssize_t n = LS_SIZE(ls);
+
+    if (k < 0)
+        k += n;
+    if (k < 0 || k >= n) {
+        PyErr_Format(PyExc_IndexError, "%s index out of range", name);
+        return -1;
+    }
+
+    if (ls->keyfunc != NULL) {
+        ls->keys = (PyObject **)PyMem_Malloc(n * sizeof(PyObject *));
+        if (ls->keys == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(ls->keys, 0, n * sizeof(PyObject *));
+    }
+    if (prepare(ls) < 0 || select_nth(ls, 0, n, k) < 0)
+        return -1;
+    return k;
+}
+
+/* Frees everything scratch_init and the functions after it gave ls */
+static void
+scratch_clear(LSObject *ls)
+{
+    Py_ssize_t i;
+
+    if (ls->keys != NULL) {
+        for (i = 0; i < LS_SIZE(ls); i++)
+            Py_XDECREF(ls->keys[i]);
+        PyMem_Free(ls->keys);
+    }
+    PyMem_Free(ls->data);
+    Py_XDECREF(ls->xs);
+}
+
+/* Swaps the items of two lists, as list.sort does to take the items out of
+ * the list it's sorting while it works on them */
+static void
+swap_lists(PyListObject *a, PyListObject *b)
+{
+    PyObject **ob_item = a->ob_item;
+    Py_ssize_t size = Py_SIZE(a);
+    Py_ssize_t allocated = a->allocated;
+
+    a->ob_item = b->ob_item;
+    Py_SET_SIZE(a, Py_SIZE(b));
+    a->allocated = b->allocated;
+    b->ob_item = ob_item;
+    Py_SET_SIZE(b, size);
+    b->allocated = allocated;
+}
+
+static PyObject *
+lazysorted_nth_element(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    PyObject *seq, *keyfunc = NULL;
+    PyListObject *items;
+    Py_ssize_t k;
+    LSObject ls;
+    int res;
+    static char *kwdlist[] = {"xs", "k", "key", 0};
+
+    (void)module;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|O:nth_element",
+        kwdlist, &seq, &k, &keyfunc))
+        return NULL;
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+    if (keyfunc != NULL && !PyCallable_Check(keyfunc)) {
+        PyErr_SetString(PyExc_TypeError, "key must be callable");
+        return NULL;
+    }
+    scratch_init(&ls, keyfunc);
+
+#ifdef HAVE_NEWBUFFER
+    /* Writable numeric buffers are partitioned unboxed, where they are */
+    Py_buffer view;
+    if (keyfunc == NULL &&
+        (ls.ops = native_view(seq, &view, PyBUF_WRITABLE, 0)) != NULL) {
+        ls.data = view.buf;
+        ls.data_len = view.len / view.itemsize;
+        res = scratch_select(&ls, k, "nth_element") < 0 ? -1 : 0;
+        ls.data = NULL;
+        scratch_clear(&ls);
+        PyBuffer_Release(&view);
+        if (res < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+#endif
+
+    if (!PyList_Check(seq)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "nth_element expects a list or a writable buffer");
+        return NULL;
+    }
+
+    /* The caller's list is empty while we work on its items, so that the
+     * comparisons and the key function can't change them under us */
+    if ((items = (PyListObject *)PyList_New(0)) == NULL)
+        return NULL;
+    swap_lists(items, (PyListObject *)seq);
+    Py_INCREF(items);
+    ls.xs = items;
+    res = scratch_select(&ls, k, "nth_element") < 0 ? -1 : 0;
+    scratch_clear(&ls);
+    swap_lists(items, (PyListObject *)seq);
+    if (res == 0 && items->ob_item != NULL) {
+        PyErr_SetString(PyExc_ValueError, "list modified during nth_element");
+        res = -1;
+    }
+    Py_DECREF(items);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+lazysorted_select(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    PyObject *seq, *keyfunc = NULL, *result = NULL;
+    Py_ssize_t k;
+    LSObject ls;
+    static char *kwdlist[] = {"xs", "k", "key", 0};
+
+    (void)module;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|O:select",
+        kwdlist, &seq, &k, &keyfunc))
+        return NULL;
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+    if (keyfunc != NULL && !PyCallable_Check(keyfunc)) {
+        PyErr_SetString(PyExc_TypeError, "key must be callable");
+        return NULL;
+    }
+    scratch_init(&ls, keyfunc);
+
+    if (scratch_copy(&ls, seq) < 0)
+        goto done;
+    if ((k = scratch_select(&ls, k, "select")) < 0)
+        goto done;
+    result = ls_item(&ls, k);
+
+done:
+    scratch_clear(&ls);
+    return result;
+}
+
+static PyObject *
+lazysorted_median(PyObject *module, PyObject *seq)
+{
+    PyObject *a, *b, *result = NULL;
+    Py_ssize_t n;
+    LSObject ls;
+
+    (void)module;
+    scratch_init(&ls, NULL);
+    if (scratch_copy(&ls, seq) < 0)
+        goto done;
+    if ((n = LS_SIZE(&ls)) == 0) {
+        PyErr_SetString(PyExc_ValueError, "median of an empty sequence");
+        goto done;
+    }
+    if (scratch_select(&ls, n / 2, "median") < 0)
+        goto done;
+    if (n % 2 == 1) {
+        result = ls_item(&ls, n / 2);
+        goto done;
+    }
+
+    /* The other middle item is the biggest of the ones before this one */
+    if (select_nth(&ls, 0, n / 2, n / 2 - 1) < 0)
+        goto done;
+    if ((a = ls_item(&ls, n / 2 - 1)) == NULL)
+        goto done;
+    if ((b = ls_item(&ls, n / 2)) == NULL) {
+        Py_DECREF(a);
+        goto done;
+    }
+    result = interpolate(a, b, 0.5, n / 2 - 1, INTERP_MIDPOINT);
+    Py_DECREF(a);
+    Py_DECREF(b);
+
+done:
+    scratch_clear(&ls);
+    return result;
+}
+
 /* List of functions defined in the module */
 static PyMethodDef ls_methods[] = {
+    {"nth_element", (PyCFunction)lazysorted_nth_element,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(
+"nth_element(xs, k, key=None) rearranges the list xs in place so that xs[k]\n"
+"is the item that would be there if xs were sorted, with no bigger items\n"
+"before it and no smaller ones after, like C++'s std::nth_element. xs may\n"
+"also be a writable numeric buffer, such as an array, if there's no key.\n"
+"This takes expected linear time and, unlike LazySorted, no extra memory.\n"
+"\n"
+"Example:\n\n"
+"    >>> xs = [5, 1, 4, 2, 3]\n"
+"    >>> nth_element(xs, 2)\n"
+"    >>> xs[2]\n"
+"    3"
+)},
+    {"select", (PyCFunction)lazysorted_select, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(
+"select(xs, k, key=None) returns the kth smallest item of the iterable xs,\n"
+"which is left alone, counting from the end if k is negative. This is\n"
+"LazySorted(xs, key=key)[k] without the LazySorted."
+)},
+    {"median", (PyCFunction)lazysorted_median, METH_O,
+        PyDoc_STR(
+"median(xs) returns the median of the iterable xs, which is left alone.\n"
+"If there's an even number of items, that's the mean of the middle two."
+)},
     {NULL,              NULL}           /* sentinel */
 };
 
@@ -1553,7 +9149,14 @@ PyDoc_STRVAR(module_doc,
 "\n"
 "The LazySorted object has a constructor that implements the same interface\n"
 "as the builtin `sorted(...)` function, and it supports most of the non-\n"
-"mutating methods of a python list.\n"
+"mutating methods of a python list. With return_indices=True, it sorts the\n"
+"indices of the items instead, like an argsort.\n"
+"\n"
+"The RollingLazySorted object keeps the quantiles of a sliding window over a\n"
+"stream of items.\n"
+"\n"
+"The nth_element, select and median functions select once from a sequence,\n"
+"without making a LazySorted.\n"
 );
 
 /* Initialization function for the module */
@@ -1561,15 +9164,25 @@ PyDoc_STRVAR(module_doc,
 PyMODINIT_FUNC
 PyInit_lazysorted(void)
 {
-    srand(time(NULL));
+    entropy_init();
+    simd_init();
+    threads_init();
 
     PyObject *m;
 
     /* Finalize the type object including setting type of the new type
      * object; doing it here is required for portability, too. */
 
+    if ((idxerr = PyString_FromString("LazySorted index out of range")) == NULL)
+        return NULL;
     if (PyType_Ready(&LS_Type) < 0)
         return NULL;
+    if (PyType_Ready(&Rolling_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&View_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&ViewMaker_Type) < 0)
+        return NULL;
 
     /* Create the module and add the functions */
     static struct PyModuleDef moduledef = {
@@ -1586,23 +9199,43 @@ PyInit_lazysorted(void)
     m = PyModule_Create(&moduledef);
     if (m == NULL)
         return NULL;
+#ifdef Py_GIL_DISABLED
+    /* A thread partitioning any part of a LazySorted holds all of it, so
+     * free-threading wouldn't let readers of other parts in anyway. The GIL
+     * stays on, as for any module that doesn't say it can do without. */
+    if (PyUnstable_Module_SetGIL(m, Py_MOD_GIL_USED) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+#endif
 
     PyModule_AddObject(m, "LazySorted", (PyObject *)&LS_Type);
+    PyModule_AddObject(m, "RollingLazySorted", (PyObject *)&Rolling_Type);
     return m;
 }
 #else
 PyMODINIT_FUNC
 initlazysorted(void)
 {
-    srand(time(NULL));
+    entropy_init();
+    simd_init();
+    threads_init();
 
     PyObject *m;
 
     /* Finalize the type object including setting type of the new type
      * object; doing it here is required for portability, too. */
 
+    if ((idxerr = PyString_FromString("LazySorted index out of range")) == NULL)
+        return;
     if (PyType_Ready(&LS_Type) < 0)
         return;
+    if (PyType_Ready(&Rolling_Type) < 0)
+        return;
+    if (PyType_Ready(&View_Type) < 0)
+        return;
+    if (PyType_Ready(&ViewMaker_Type) < 0)
+        return;
 
     /* Create the module and add the functions */
     m = Py_InitModule3("lazysorted", ls_methods, module_doc);
@@ -1610,6 +9243,7 @@ initlazysorted(void)
         return;
 
     PyModule_AddObject(m, "LazySorted", (PyObject *)&LS_Type);
+    PyModule_AddObject(m, "RollingLazySorted", (PyObject *)&Rolling_Type);
     return;
 }
 #endif
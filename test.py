@@ -1,13 +1,51 @@
 """test.py"""
 
 import unittest
+import sys
+import os
+import subprocess
 import random
+import array
+import math
+import bisect
+import threading
+import time
 from itertools import islice
 import doctest
+import pickle
 import lazysorted
 from lazysorted import LazySorted
 
 
+class Counted(object):
+    """An item that counts the comparisons made with it, in Counted.lts and
+    Counted.eqs"""
+    lts = 0
+    eqs = 0
+
+    def __init__(self, x):
+        self.x = x
+
+    def __lt__(self, other):
+        Counted.lts += 1
+        return self.x < other.x
+
+    def __eq__(self, other):
+        Counted.eqs += 1
+        return self.x == other.x
+
+
+class ListMeddler(object):
+    """An item that appends to the list xs whenever it's compared"""
+    def __init__(self, x, xs):
+        self.x = x
+        self.xs = xs
+
+    def __lt__(self, other):
+        self.xs.append(None)
+        return self.x < other.x
+
+
 class TestLazySorted(unittest.TestCase):
     test_lengths = range(18) + [31, 32, 33, 63, 64, 65, 127, 128, 129]
 
@@ -228,6 +266,584 @@ class TestLazySorted(unittest.TestCase):
             ls = LazySorted([0] * n)
             self.assertEqual(ls.count(0), n)
 
+    def test_select_duplicates(self):
+        """Selection should work with items equal to the pivots"""
+        for n in TestLazySorted.test_lengths + [200, 1000, 4099]:
+            for m in [1, 2, 3, 10]:
+                xs = [random.randrange(m) for _ in xrange(n)]
+                ys = sorted(xs)
+                ls = LazySorted(xs)
+                ks = range(n)
+                random.shuffle(ks)
+                for k in ks[:50]:
+                    self.assertEqual(ls[k], ys[k])
+                self.assertEqual(list(ls), ys)
+
+    def test_equal_runs(self):
+        """Runs of items equal to a pivot should be set aside in one go"""
+        n = 5000
+        for m in [1, 2, 3, 50]:
+            xs = [random.randrange(m) for _ in xrange(n)]
+            ys = sorted(xs)
+            for data in [xs, array.array("i", xs)]:
+                ls = LazySorted(data)
+                k = random.randrange(n)
+                self.assertEqual(ls[k], ys[k])
+                if m == 1:
+                    # Just the ends of the list and of at most two runs
+                    self.assertTrue(len(ls._pivots()) <= 6)
+                self.assertEqual(ls.index(ys[k]), ys.index(ys[k]))
+                self.assertEqual(ls.count(ys[k]), ys.count(ys[k]))
+                self.assertEqual(list(ls), ys)
+
+            # Selection finds equal items by ordering alone
+            Counted.eqs = 0
+            ls = LazySorted([Counted(x) for x in xs])
+            for k in [0, n // 2, n - 1]:
+                self.assertEqual(ls[k].x, ys[k])
+            self.assertEqual(Counted.eqs, 0)
+
+    def test_large_select(self):
+        """Selection from large lists should work at any rank"""
+        for n in [2000, 2001, 5000, 20000]:
+            for m in [3, n]:
+                xs = [random.randrange(m) for _ in xrange(n)]
+                ys = sorted(xs)
+                for k in [0, 1, n // 100, n // 3, n // 2, n - 2, n - 1]:
+                    ls = LazySorted(xs)
+                    self.assertEqual(ls[k], ys[k])
+                    self.assertEqual(ls[k:k + 10], ys[k:k + 10])
+                    self.assertEqual(ls.index(ys[k]), ys.index(ys[k]))
+
+        xs = [float(x) for x in xrange(20000)]
+        random.shuffle(xs)
+        ls = LazySorted(xs)
+        self.assertEqual(ls[10000], 10000)
+        pivots = [idx for idx, flags in ls._pivots()]
+        self.assertTrue(len(pivots) > 3)
+        for idx in pivots[1:-1]:
+            self.assertEqual(ls[idx], idx)
+
+    def test_many_pivots(self):
+        """Big lists, whose pivots are kept in a bitvector rather than a
+        treap, should work through any mix of queries"""
+        for n in [4095, 4096, 20000]:
+            xs = [random.randrange(n // 4) for _ in xrange(n)]
+            ys = sorted(xs)
+            for data in [xs, array.array("i", xs)]:
+                ls = LazySorted(data)
+                for rep in xrange(300):
+                    k = random.randrange(n)
+                    op = random.randrange(4)
+                    if op == 0:
+                        self.assertEqual(ls[k], ys[k])
+                    elif op == 1:
+                        self.assertEqual(ls.bisect_left(ys[k]),
+                                         bisect.bisect_left(ys, ys[k]))
+                    elif op == 2:
+                        self.assertEqual(sorted(ls.between(k, k + 50)),
+                                         ys[k:k + 50])
+                    else:
+                        self.assertEqual(ls[k:k + 20], ys[k:k + 20])
+                for idx, flags in ls._pivots()[1:-1]:
+                    self.assertEqual(ls[idx], ys[idx])
+                self.assertEqual(list(ls), ys)
+                self.assertEqual(ls.tolist(), ys)
+                self.assertEqual(len(ls._pivots()), 2)
+
+    def test_mutation(self):
+        """add, extend, remove, and replace should keep the LazySorted
+        equivalent to a sorted list, whatever it has partitioned so far"""
+        for n in [0, 10, 1000, 5000]:
+            xs = [random.randrange(n // 3 + 1) for _ in xrange(n)]
+            for data, key, reverse in [(xs, None, False),
+                                       (array.array("i", xs), None, False),
+                                       (array.array("d", xs), None, True),
+                                       (xs, lambda x: -x, False)]:
+                ls = LazySorted(data, key=key, reverse=reverse)
+                ys = sorted(data, key=key, reverse=reverse)
+                for rep in xrange(200):
+                    op = random.randrange(6)
+                    if op == 0:
+                        x = random.randrange(n // 3 + 2)
+                        ls.add(x)
+                        ys.append(x)
+                    elif op == 1:
+                        new = [random.randrange(n // 3 + 2)
+                               for _ in xrange(random.randrange(10))]
+                        ls.extend(new)
+                        ys.extend(new)
+                    elif op == 2 and ys:
+                        x = random.choice(ys)
+                        ls.remove(x)
+                        ys.remove(x)
+                    elif op == 3 and ys:
+                        i = random.randrange(-len(ys), len(ys))
+                        x = random.randrange(n // 3 + 2)
+                        ls.replace(i, x)
+                        del ys[i]
+                        ys.append(x)
+                    elif ys:
+                        k = random.randrange(len(ys))
+                        self.assertEqual(ls[k], ys[k])
+                        continue
+                    ys.sort(key=key, reverse=reverse)
+                    self.assertEqual(len(ls), len(ys))
+                self.assertEqual(list(ls), ys)
+
+    def test_mutation_errors(self):
+        """Bad mutations should raise the same errors as lists, and leave the
+        LazySorted unchanged"""
+        ls = LazySorted([3, 1, 2])
+        self.assertRaises(ValueError, ls.remove, 4)
+        self.assertRaises(IndexError, ls.replace, 3, 0)
+        self.assertRaises(IndexError, ls.replace, -4, 0)
+        self.assertRaises(TypeError, ls.extend, 5)
+        self.assertEqual(list(ls), [1, 2, 3])
+
+        # python2 arrays don't have the new buffer interface, so they're kept
+        # as lists and take anything
+        ls = LazySorted(array.array("b", [1, 2]))
+        if sys.version_info[0] >= 3:
+            self.assertRaises(OverflowError, ls.add, 1000)
+            self.assertRaises(TypeError, ls.add, 1.5)
+            self.assertRaises(OverflowError, ls.extend, [3, 1000])
+            self.assertEqual(list(ls), [1, 2])
+
+        # Iterators stop working once the items change
+        it = iter(ls)
+        next(it)
+        ls.add(0)
+        self.assertRaises(RuntimeError, next, it)
+
+        # Comparisons can't change the LazySorted they're sorting
+        class Meddler(object):
+            ls = None
+
+            def __init__(self, x):
+                self.x = x
+
+            def __lt__(self, other):
+                if Meddler.ls is not None:
+                    Meddler.ls.add(Meddler(0))
+                return self.x < other.x
+        ls = LazySorted([Meddler(x) for x in xrange(100)])
+        Meddler.ls = ls
+        self.assertRaises(RuntimeError, ls.__getitem__, 50)
+        Meddler.ls = None
+        self.assertEqual([m.x for m in ls], range(100))
+
+    def test_reentrant_queries(self):
+        """Comparisons can't query the LazySorted they're sorting either"""
+        class Nosy(object):
+            query = None
+
+            def __init__(self, x):
+                self.x = x
+
+            def __lt__(self, other):
+                query, Nosy.query = Nosy.query, None
+                if query is not None:
+                    query()
+                return self.x < other.x
+
+        for query in [lambda: ls[3], lambda: ls[10:20], lambda: list(ls),
+                      lambda: ls.count(Nosy(5)), lambda: Nosy(5) in ls,
+                      lambda: ls.index(Nosy(5)), lambda: ls.view[2:8],
+                      lambda: ls.select_many([1, 2])]:
+            xs = [Nosy(x) for x in xrange(1000)]
+            random.shuffle(xs)
+            ls = LazySorted(xs)
+            for outer in [lambda: ls[500], lambda: ls.bisect_left(Nosy(30)),
+                          lambda: ls[100:900]]:
+                Nosy.query = staticmethod(query)
+                self.assertRaises(RuntimeError, outer)
+            self.assertEqual([y.x for y in ls], range(1000))
+
+    def test_rolling(self):
+        """RollingLazySorted should match the quantiles of each window"""
+        xs = [random.randrange(100) for _ in xrange(2000)]
+        for window in [1, 2, 10, 500]:
+            for ps, interpolation in [([0.5], "linear"),
+                                      ([0, 0.1, 0.99, 1], "lower"),
+                                      ([0.25, 0.75], "midpoint")]:
+                r = lazysorted.RollingLazySorted(window, quantiles=ps,
+                                                 interpolation=interpolation)
+                rolled = r.feed(xs)
+                for i in xrange(0, len(xs), 37):
+                    ls = LazySorted(xs[max(0, i - window + 1):i + 1])
+                    self.assertEqual(rolled[i], ls.quantiles(
+                        ps, interpolation=interpolation))
+                self.assertEqual(len(r), window)
+
+        # Big windows, and trending streams, which move the sorted regions
+        # around the quantiles on every push
+        for xs in [[random.random() for _ in xrange(20000)],
+                   [i + random.random() * 100 for i in xrange(20000)]]:
+            r = lazysorted.RollingLazySorted(5000, quantiles=[0.1, 0.5, 0.9])
+            rolled = r.feed(xs)
+            for i in xrange(0, len(xs), 997):
+                ls = LazySorted(xs[max(0, i - 4999):i + 1])
+                self.assertEqual(rolled[i], ls.quantiles([0.1, 0.5, 0.9]))
+
+        r = lazysorted.RollingLazySorted(3)
+        self.assertRaises(ValueError, r.quantiles)
+        for x in [5.0, 1.0, 3.0, 7.0]:
+            r.push(x)
+        self.assertEqual(r.quantiles(), [3.0])
+
+        # A NaN can't be ordered, so it's refused, and the window carries on
+        r = lazysorted.RollingLazySorted(3)
+        r.feed([1.0, 2.0, 3.0])
+        self.assertRaises(ValueError, r.feed, [float("nan"), 4.0])
+        self.assertEqual(r.feed([4.0, 5.0, 6.0]), [[3.0], [4.0], [5.0]])
+        self.assertRaises(ValueError, lazysorted.RollingLazySorted, 0)
+        self.assertRaises(ValueError, lazysorted.RollingLazySorted, 3, [1.5])
+        self.assertRaises(ValueError, lazysorted.RollingLazySorted, 3,
+                          interpolation="cubic")
+
+    def test_in_place(self):
+        """copy=False should partially sort the caller's list itself"""
+        for n in [1, 2, 20, 5000]:
+            xs = [random.randrange(n) for _ in xrange(n)]
+            ys = list(xs)
+            ls = LazySorted(ys, copy=False)
+            k = random.randrange(n)
+            self.assertEqual(ls[k], sorted(xs)[k])
+            self.assertEqual(ys[k], sorted(xs)[k])
+            ls.add(n)
+            self.assertEqual(ys[-1], n)
+            self.assertEqual(ls.tolist(), ys)
+            self.assertEqual(ys, sorted(xs + [n]))
+            ys.pop()
+            self.assertRaises(RuntimeError, lambda: ls[0])
+
+        # Every query notices the list growing or shrinking
+        queries = [lambda: ls[10], lambda: ls[5:15], lambda: list(ls),
+                   lambda: ls.sum_between(0, 50), lambda: len(ls),
+                   lambda: ls.count(3), lambda: 3 in ls, lambda: ls.view[0:5]]
+        for change in [lambda ys: ys.__delitem__(slice(None)),
+                       lambda ys: ys.append(0)]:
+            for query in queries:
+                ys = range(50)
+                random.shuffle(ys)
+                ls = LazySorted(ys, copy=False)
+                ls[25]
+                change(ys)
+                self.assertRaises(RuntimeError, query)
+
+        xs = []
+        xs.extend(ListMeddler(x, xs) for x in xrange(100))
+        ls = LazySorted(xs, copy=False)
+        ls[50]
+        self.assertEqual(len(xs), 100)
+        self.assertRaises(RuntimeError, lambda: ls[51])
+        self.assertRaises(TypeError, LazySorted, (1, 2), copy=False)
+
+    def test_select_functions(self):
+        """nth_element, select and median should select like LazySorted"""
+        for n in self.test_lengths + [5000]:
+            if n == 0:
+                continue
+            xs = [random.randrange(n) for _ in xrange(n)]
+            s = sorted(xs)
+            k = random.randrange(-n, n)
+            ys = list(xs)
+            lazysorted.nth_element(ys, k)
+            self.assertEqual(sorted(ys), s)
+            self.assertEqual(ys[k], s[k])
+            self.assertTrue(all(y <= s[k] for y in ys[:k % n]))
+            self.assertTrue(all(y >= s[k] for y in ys[k % n:]))
+            ys = list(xs)
+            lazysorted.nth_element(ys, k, key=lambda x: -x)
+            self.assertEqual(ys[k], s[-1 - k % n])
+            self.assertEqual(lazysorted.select(xs, k), s[k])
+            self.assertEqual(lazysorted.select(iter(xs), k, key=lambda x: -x),
+                             s[-1 - k % n])
+            if n % 2:
+                median = s[n // 2]
+            else:
+                median = (s[n // 2 - 1] + s[n // 2]) / 2.0
+            self.assertEqual(lazysorted.median(xs), median)
+            self.assertEqual(lazysorted.median(array.array('i', xs)), median)
+            if sys.version_info[0] >= 3:
+                ys = array.array('d', xs)
+                lazysorted.nth_element(ys, k)
+                self.assertEqual(ys[k], s[k])
+
+        self.assertRaises(ValueError, lazysorted.median, [])
+        self.assertRaises(IndexError, lazysorted.select, [1, 2], 2)
+        self.assertRaises(IndexError, lazysorted.nth_element, [1, 2], -3)
+        self.assertRaises(TypeError, lazysorted.nth_element, (2, 1), 0)
+        self.assertRaises(TypeError, lazysorted.select, [1], 0, key=1)
+
+        xs = []
+        xs.extend(ListMeddler(x, xs) for x in xrange(100))
+        self.assertRaises(ValueError, lazysorted.nth_element, xs, 50)
+        self.assertEqual(sorted(x.x for x in xs), range(100))
+
+    def test_comparison_errors(self):
+        """Errors raised by comparisons mid-partition should propagate"""
+        class Fragile(object):
+            calls = 0
+            fail_at = 0
+
+            def __init__(self, x):
+                self.x = x
+
+            def __lt__(self, other):
+                Fragile.calls += 1
+                if Fragile.calls == Fragile.fail_at:
+                    raise ZeroDivisionError
+                return self.x < other.x
+
+        for n, fail_at in [(1000, 700), (5000, 100), (5000, 3000)]:
+            Fragile.calls = 0
+            Fragile.fail_at = fail_at
+            xs = [Fragile(x) for x in xrange(n)]
+            random.shuffle(xs)
+            ls = LazySorted(xs)
+            self.assertRaises(ZeroDivisionError, lambda: ls[n // 2])
+            self.assertEqual([y.x for y in ls[100:200]], range(100, 200))
+            self.assertEqual(sorted(y.x for y in ls), range(n))
+
+    def test_adversarial(self):
+        """Selection and sorting should stay fast against an adversary"""
+        class Adversary(object):
+            """McIlroy's adversary, which makes up the order of the items as
+            it's asked about them so as to make quicksort quadratic"""
+            def __init__(self, n):
+                self.gas = n
+                self.vals = [n] * n
+                self.nsolid = 0
+                self.candidate = None
+                self.calls = 0
+
+            def cmp(self, i, j):
+                self.calls += 1
+                if self.vals[i] == self.gas and self.vals[j] == self.gas:
+                    self.freeze(i if i == self.candidate else j)
+                if self.vals[i] == self.gas:
+                    self.candidate = i
+                elif self.vals[j] == self.gas:
+                    self.candidate = j
+                return self.vals[i] - self.vals[j]
+
+            def freeze(self, i):
+                self.vals[i] = self.nsolid
+                self.nsolid += 1
+
+        class Item(object):
+            def __init__(self, adversary, i):
+                self.adversary = adversary
+                self.i = i
+
+            def __lt__(self, other):
+                return self.adversary.cmp(self.i, other.i) < 0
+
+            def __eq__(self, other):
+                return self.adversary.cmp(self.i, other.i) == 0
+
+        n = 4000
+        adversary = Adversary(n)
+        ls = LazySorted([Item(adversary, i) for i in xrange(n)])
+        median = ls[n // 2]
+        self.assertTrue(adversary.calls < 50 * n)
+        self.assertEqual(adversary.vals[median.i],
+                         sorted(adversary.vals)[n // 2])
+
+        adversary = Adversary(n)
+        ls = LazySorted([Item(adversary, i) for i in xrange(n)])
+        vals = [adversary.vals[x.i] for x in ls[0:n]]
+        self.assertTrue(adversary.calls < 100 * n)
+        self.assertEqual(vals, sorted(adversary.vals))
+
+        for code in "id":
+            xs = array.array(code, [7] * 20000)
+            self.assertEqual(LazySorted(xs)[12345], 7)
+
+    def test_seed(self):
+        """Objects with the same seed should pick the same pivots"""
+        xs = range(1000)
+        random.shuffle(xs)
+        for seed in [0, 1, 12345, 2 ** 64 + 7, -3]:
+            for data in [xs, array.array("i", xs)]:
+                ls1 = LazySorted(data, seed=seed)
+                ls2 = LazySorted(data, seed=seed)
+                for k in [500, 10, 990, 250]:
+                    self.assertEqual(ls1[k], k)
+                    self.assertEqual(ls2[k], k)
+                self.assertEqual(ls1._pivots(), ls2._pivots())
+
+        self.assertEqual(LazySorted(xs, seed=None)[100], 100)
+        self.assertRaises(TypeError, lambda: LazySorted(xs, seed=1.5))
+        self.assertRaises(TypeError, lambda: LazySorted(xs, seed="1"))
+
+    def test_select_many(self):
+        """select_many should agree with indexing one rank at a time"""
+        for n in [1, 2, 10, 100, 3000]:
+            xs = [random.randrange(n // 2 + 1) for _ in xrange(n)]
+            ys = sorted(xs)
+            for _ in xrange(5):
+                ranks = [random.randrange(-n, n)
+                         for _ in xrange(random.randrange(20))]
+                ls = LazySorted(xs)
+                self.assertEqual(ls.select_many(ranks), [ys[k] for k in ranks])
+                self.assertEqual(list(ls), ys)
+            for step in [n // 7 + 1, n // 3 + 1, -(n // 5) - 1]:
+                self.assertEqual(LazySorted(xs)[::step], ys[::step])
+
+        ls = LazySorted(range(10))
+        self.assertEqual(ls.select_many(xrange(9, -1, -3)), [9, 6, 3, 0])
+        self.assertEqual(ls.select_many([]), [])
+        self.assertRaises(IndexError, lambda: ls.select_many([3, 10]))
+        self.assertRaises(IndexError, lambda: ls.select_many([-11]))
+        self.assertRaises(TypeError, lambda: ls.select_many([1.0]))
+        self.assertRaises(TypeError, lambda: ls.select_many(5))
+
+    def test_quantiles(self):
+        """quantiles should interpolate between ranks like numpy"""
+        def quantile(ys, p, interpolation):
+            pos = p * (len(ys) - 1)
+            lo = int(math.floor(pos))
+            hi = int(math.ceil(pos))
+            frac = pos - lo
+            if lo == hi or interpolation == "lower":
+                return ys[lo]
+            elif interpolation == "higher":
+                return ys[hi]
+            elif interpolation == "nearest":
+                if frac < 0.5 or (frac == 0.5 and lo % 2 == 0):
+                    return ys[lo]
+                return ys[hi]
+            elif interpolation == "midpoint":
+                return (ys[lo] + ys[hi]) / 2.0
+            return ys[lo] + (ys[hi] - ys[lo]) * frac
+
+        for n in [1, 2, 5, 100, 1001]:
+            xs = [random.random() for _ in xrange(n)]
+            ys = sorted(xs)
+            ps = [0.0, 1.0, 0.5, 0.25, 0.125] + [random.random()
+                                                 for _ in xrange(5)]
+            for interpolation in ["linear", "lower", "higher", "nearest",
+                                  "midpoint"]:
+                ls = LazySorted(xs)
+                qs = ls.quantiles(ps, interpolation=interpolation)
+                for q, p in zip(qs, ps):
+                    self.assertAlmostEqual(q, quantile(ys, p, interpolation))
+
+        ls = LazySorted(range(11))
+        self.assertEqual(ls.quantiles([0.5, 0.1]), [5, 1])
+        self.assertEqual(ls.quantiles([]), [])
+        self.assertEqual(LazySorted([]).quantiles([]), [])
+        self.assertRaises(ValueError, lambda: LazySorted([]).quantiles([0.5]))
+        self.assertRaises(ValueError, lambda: ls.quantiles([1.5]))
+        self.assertRaises(ValueError, lambda: ls.quantiles([-0.1]))
+        self.assertRaises(ValueError,
+                          lambda: ls.quantiles([0.5], interpolation="foo"))
+        self.assertRaises(TypeError, lambda: ls.quantiles(["foo"]))
+
+    def test_buckets(self):
+        """buckets should split the items into ordered groups"""
+        for n in [0, 1, 7, 100, 2500]:
+            xs = [random.randrange(n // 3 + 1) for _ in xrange(n)]
+            ys = sorted(xs)
+            for m in [1, 2, 3, 10, n + 3]:
+                ls = LazySorted(xs)
+                buckets = ls.buckets(m)
+                self.assertEqual(len(buckets), m)
+                sizes = [len(bucket) for bucket in buckets]
+                self.assertTrue(max(sizes) - min(sizes) <= 1)
+                self.assertEqual(sizes, sorted(sizes, reverse=True))
+                self.assertEqual(sum(map(sorted, buckets), []), ys)
+
+        self.assertRaises(ValueError, lambda: LazySorted(range(5)).buckets(0))
+
+    def test_bisect(self):
+        """bisect_left, bisect_right, rank, and equal_range should agree with
+        the bisect module on the sorted list"""
+        for n in [0, 1, 5, 100, 3000]:
+            for m in [1, 3, 10, n + 1]:
+                xs = [random.randrange(m) for _ in xrange(n)]
+                ys = sorted(xs)
+                for data in [xs, array.array("i", xs)]:
+                    ls = LazySorted(data)
+                    for x in [-1, 0, m // 2, m - 1, m, 1.5]:
+                        lo = bisect.bisect_left(ys, x)
+                        hi = bisect.bisect_right(ys, x)
+                        self.assertEqual(ls.bisect_left(x), lo)
+                        self.assertEqual(ls.bisect_right(x), hi)
+                        self.assertEqual(ls.rank(x), lo)
+                        self.assertEqual(ls.equal_range(x), (lo, hi))
+                        self.assertEqual(ls.count(x), hi - lo)
+                    self.assertEqual(list(ls), ys)
+
+        # The key function applies to the probe too, and reverse flips it
+        xs = range(100)
+        random.shuffle(xs)
+        ls = LazySorted(xs, key=lambda x: x // 10, reverse=True)
+        self.assertEqual(ls.equal_range(42), (50, 60))
+        self.assertEqual(ls.bisect_left(1000), 0)
+        self.assertEqual(ls.bisect_right(-5), 100)
+        self.assertRaises(TypeError, lambda: ls.bisect_left())
+
+    def test_count_logarithmic(self):
+        """Counting a frequent item again shouldn't scan its run"""
+        n = 20000
+        xs = [Counted(random.randrange(5)) for _ in xrange(n)]
+        for probe in xs[:5] + [Counted(-1), Counted(2.5)]:
+            ls = LazySorted(xs)
+            count = ls.count(probe)
+            self.assertEqual(count, sum(y.x == probe.x for y in xs))
+            Counted.lts = 0
+            self.assertEqual(ls.count(probe), count)
+            self.assertTrue(Counted.lts < 100)
+
+        ls = LazySorted(xs)
+        list(ls)
+        Counted.lts = 0
+        for x in xrange(5):
+            ls.count(Counted(x))
+        self.assertTrue(Counted.lts < 500)
+
+    def test_values_between(self):
+        """values_between should return the items in a range of values"""
+        for n in [0, 1, 5, 100, 3000]:
+            for m in [1, 10, n + 1]:
+                xs = [random.randrange(m) for _ in xrange(n)]
+                for data in [xs, array.array("i", xs)]:
+                    for reverse in [False, True]:
+                        ls = LazySorted(data, reverse=reverse)
+                        for _ in xrange(5):
+                            lo = random.randrange(-1, m + 1)
+                            hi = random.randrange(-1, m + 1)
+                            for inclusive in [False, True]:
+                                got = ls.values_between(lo, hi, inclusive)
+                                expected = [x for x in xs if lo <= x < hi or
+                                            inclusive and lo <= x <= hi]
+                                self.assertEqual(sorted(got), sorted(expected))
+                        self.assertEqual(list(ls), sorted(xs,
+                                                          reverse=reverse))
+
+        xs = range(100)
+        random.shuffle(xs)
+        ls = LazySorted(xs, key=lambda x: x // 10)
+        self.assertEqual(sorted(ls.values_between(25, 42)), range(20, 40))
+        self.assertEqual(sorted(ls.values_between(25, 42, inclusive=True)),
+                         range(20, 50))
+        self.assertRaises(TypeError, lambda: ls.values_between(1))
+
+    def test_values_between_cracks(self):
+        """Repeating a range query shouldn't partition the data again"""
+        n = 20000
+        xs = [Counted(random.random()) for _ in xrange(n)]
+        ls = LazySorted(xs)
+        lo, hi = Counted(0.2), Counted(0.3)
+        first = len(ls.values_between(lo, hi))
+        Counted.lts = 0
+        self.assertEqual(len(ls.values_between(lo, hi)), first)
+        self.assertTrue(Counted.lts < 100)
+
     def test_sorting(self):
         """Iteration should be equivalent to sorting"""
         for length in TestLazySorted.test_lengths:
@@ -255,6 +871,46 @@ class TestLazySorted(unittest.TestCase):
             self.assertEqual(list(LazySorted(items, reverse=True)),
                              range(length-1, -1, -1))
 
+    def test_reversed(self):
+        """reversed should iterate from the end, even if interrupted"""
+        for length in TestLazySorted.test_lengths:
+            for m in [3, length + 1]:
+                xs = [random.randrange(m) for _ in xrange(length)]
+                for data in [xs, array.array("i", xs)]:
+                    for reverse in [False, True]:
+                        ls = LazySorted(data, reverse=reverse)
+                        it = reversed(ls)
+                        ys = list(islice(it, 30))
+                        if length > 0:
+                            _ = ls[random.randrange(length)]
+                        ys += list(it)
+                        self.assertEqual(ys, sorted(xs, reverse=not reverse))
+
+    def test_tolist(self):
+        """tolist should sort everything, and iterators should know their
+        lengths"""
+        for length in TestLazySorted.test_lengths:
+            xs = [random.randrange(10) for _ in xrange(length)]
+            for data in [xs, array.array("i", xs)]:
+                ls = LazySorted(data)
+                it = iter(ls)
+                self.assertEqual(it.__length_hint__(), length)
+                _ = list(islice(it, 5))
+                self.assertEqual(it.__length_hint__(), max(length - 5, 0))
+                self.assertEqual(ls.tolist(), sorted(xs))
+                self.assertEqual(list(it), sorted(xs)[5:])
+                self.assertEqual(reversed(ls).__length_hint__(), length)
+
+    def test_iter_comparisons(self):
+        """Iterating through everything shouldn't cost much more than
+        sorting"""
+        n = 20000
+        xs = [Counted(random.random()) for _ in xrange(n)]
+        for it in [iter, reversed]:
+            Counted.lts = 0
+            self.assertEqual(len(list(it(LazySorted(xs)))), n)
+            self.assertTrue(Counted.lts < 2.5 * n * math.log(n, 2))
+
     def test_keys(self):
         """Using keys should work fine, with or without reverse"""
         for rep in xrange(100):
@@ -266,6 +922,373 @@ class TestLazySorted(unittest.TestCase):
                 self.assertEqual(list(LazySorted(items, key=lambda x: x[1])),
                                  sorted(items, key=lambda x: x[1]))
 
+    def test_key_calls(self):
+        """The key function should be called at most once per element"""
+        for n in TestLazySorted.test_lengths:
+            xs = range(n)
+            random.shuffle(xs)
+            calls = [0]
+
+            def key(x):
+                calls[0] += 1
+                return -x
+
+            ls = LazySorted(xs, key=key)
+            self.assertEqual(list(ls), range(n - 1, -1, -1))
+            self.assertEqual(ls[n // 2:], range(n - 1 - n // 2, -1, -1))
+            self.assertTrue(calls[0] <= n)
+
+    def test_key_kinds(self):
+        """Sorting should work on homogeneous and mixed kinds of data"""
+        makers = [lambda: random.random(),
+                  lambda: random.randrange(-100, 100),
+                  lambda: random.randrange(-2 ** 70, 2 ** 70),
+                  lambda: "".join(random.choice("abc") for _ in xrange(3)),
+                  lambda: (random.randrange(5), random.random()),
+                  lambda: ((random.randrange(3),), random.randrange(3)),
+                  lambda: random.choice([1, 2.5, -3, 4.25])]
+        for maker in makers:
+            for n in TestLazySorted.test_lengths:
+                xs = [maker() for _ in xrange(n)]
+                for reverse in [False, True]:
+                    ls = LazySorted(xs, reverse=reverse)
+                    self.assertEqual(list(ls), sorted(xs, reverse=reverse))
+                    for x in xs[:5]:
+                        self.assertTrue(x in ls)
+                        self.assertEqual(ls.count(x), xs.count(x))
+
+        # Probes of a different kind than the data
+        ls = LazySorted(range(100))
+        self.assertEqual(ls.index(5.0), 5)
+        self.assertFalse(5.5 in ls)
+        ls = LazySorted([float(x) for x in range(100)])
+        self.assertEqual(ls.index(5), 5)
+        self.assertFalse(2 ** 80 in ls)
+
+    def test_buffers(self):
+        """Numeric buffers should behave just like lists of their values"""
+        codes = [("b", -128, 128), ("B", 0, 256), ("h", -500, 500),
+                 ("H", 0, 1000), ("i", -10 ** 6, 10 ** 6), ("I", 0, 10 ** 6),
+                 ("l", -10 ** 9, 10 ** 9), ("L", 0, 10 ** 9),
+                 ("f", -100, 100), ("d", -1000, 1000)]
+        try:
+            array.array("q")
+            codes += [("q", -2 ** 62, 2 ** 62), ("Q", 0, 2 ** 63)]
+        except ValueError:
+            pass
+        for code, lo, hi in codes:
+            for n in TestLazySorted.test_lengths + [1000, 4099]:
+                if code in "fd":
+                    xs = [float(random.randrange(lo, hi)) for _ in xrange(n)]
+                else:
+                    xs = [random.randrange(lo, hi) for _ in xrange(n)]
+                buf = array.array(code, xs)
+                for reverse in [False, True]:
+                    ys = sorted(xs, reverse=reverse)
+                    ls = LazySorted(buf, reverse=reverse)
+                    self.assertEqual(len(ls), n)
+                    if n:
+                        k = random.randrange(n)
+                        self.assertEqual(ls[k], ys[k])
+                        self.assertEqual(ls.index(ys[k]), ys.index(ys[k]))
+                        self.assertEqual(ls.count(ys[k]), ys.count(ys[k]))
+                        self.assertTrue(ys[k] in ls)
+                    self.assertFalse(hi + 0.5 in ls)
+                    self.assertEqual(ls[::3], ys[::3])
+                    self.assertEqual(sorted(ls.between(1, n - 1)),
+                                     sorted(ys[1:n - 1]))
+                    self.assertEqual(list(ls), ys)
+
+        # The buffer is copied, so changing it doesn't affect the LazySorted
+        buf = array.array("d", [3.0, 1.0, 2.0])
+        ls = LazySorted(buf)
+        buf[0] = -1.0
+        self.assertEqual(list(ls), [1.0, 2.0, 3.0])
+
+    def test_buffer_kernels(self):
+        """The buffer tests should pass with each set of partition kernels"""
+        env = dict(os.environ)
+        env["PYTHONPATH"] = os.pathsep.join(
+            [os.path.dirname(os.path.abspath(lazysorted.__file__))] +
+            [p for p in [env.get("PYTHONPATH")] if p])
+        for simd in ["avx2", "none"]:
+            env["LAZYSORTED_SIMD"] = simd
+            args = [sys.executable, os.path.abspath(__file__),
+                    "TestLazySorted.test_buffers"]
+            proc = subprocess.Popen(args, env=env, stdout=subprocess.PIPE,
+                                    stderr=subprocess.STDOUT)
+            output = proc.communicate()[0]
+            self.assertEqual(proc.returncode, 0,
+                             msg="LAZYSORTED_SIMD=%s: %s" % (simd, output))
+
+    def test_sum_between(self):
+        """sum_between and friends should match the items of between"""
+        def close(x, y):
+            self.assertTrue(abs(x - y) <= 1e-9 * (abs(y) + 1), (x, y))
+
+        for n in [0, 1, 10, 100, 1000]:
+            xs = [random.randrange(-2**40, 2**40) for _ in xrange(n)]
+            fs = [random.gauss(0, 1) for _ in xrange(n)]
+            for data, exact in [(xs, True), (array.array('l', xs), True),
+                                (fs, False), (array.array('d', fs), False)]:
+                ls = LazySorted(data)
+                i, j = sorted(random.randrange(n + 1) for _ in xrange(2))
+                ys = ls.between(i, j)
+                total = ls.sum_between(i, j)
+                if exact:
+                    self.assertEqual(total, sum(ys))
+                else:
+                    close(total, math.fsum(ys))
+                if j - i > 1:
+                    mean = math.fsum(ys) / len(ys)
+                    var = math.fsum((y - mean) ** 2 for y in ys)
+                    close(ls.mean_between(i, j), mean)
+                    close(ls.var_between(i, j), var / len(ys))
+                    close(ls.var_between(i, j, 1), var / (len(ys) - 1))
+                else:
+                    self.assertRaises(ValueError, ls.var_between, i, j, 1)
+
+        self.assertEqual(LazySorted([0.1] * 10).sum_between(0, 10), 1.0)
+        self.assertEqual(LazySorted([10 ** 30, 1]).sum_between(0, 2),
+                         10 ** 30 + 1)
+        self.assertEqual(LazySorted(range(10)).trimmed_mean(0.1), 4.5)
+        self.assertEqual(LazySorted(range(10)).sum_between(5, 5), 0)
+        self.assertRaises(ValueError, LazySorted([1]).mean_between, 1, 1)
+        self.assertRaises(ValueError, LazySorted([1]).trimmed_mean, 0.5)
+        self.assertRaises(ValueError, LazySorted([]).trimmed_mean, 0.1)
+
+    def test_nsmallest(self):
+        """nsmallest and nlargest should match heapq, heap or no heap"""
+        for n in [0, 1, 10, 100, 1000, 10000]:
+            xs = [random.randrange(n // 2 + 1) for _ in xrange(n)]
+            ys = sorted(xs)
+            for k in [0, 1, 2, 10, 100, max(n - 1, 0), n, n + 5]:
+                self.assertEqual(LazySorted(xs).nsmallest(k), ys[:k])
+                self.assertEqual(LazySorted(xs).nlargest(k),
+                                 ys[::-1][:k])
+                ls = LazySorted(xs)
+                self.assertEqual(ls[:k], ys[:k])
+                self.assertEqual(ls[max(n - k, 0):], ys[max(n - k, 0):])
+                self.assertEqual(list(ls), ys)
+            if n:
+                self.assertEqual(LazySorted(xs)[0], ys[0])
+                self.assertEqual(LazySorted(xs)[-1], ys[-1])
+        self.assertRaises(ValueError, LazySorted([1]).nsmallest, -1)
+
+    def test_return_indices(self):
+        """return_indices=True should sort the indices of the items"""
+        for n in [0, 1, 10, 100, 1000, 10000]:
+            xs = [random.randrange(n // 2 + 1) for _ in xrange(n)]
+            for key in [None, lambda x: -x]:
+                keyf = key or (lambda x: x)
+                for reverse in [False, True]:
+                    ls = LazySorted(xs, key=key, reverse=reverse,
+                                    return_indices=True)
+                    ys = sorted(xs, key=key, reverse=reverse)
+                    self.assertEqual([keyf(xs[i]) for i in ls[:5]],
+                                     [keyf(y) for y in ys[:5]])
+                    if n:
+                        k = random.randrange(n)
+                        self.assertEqual(keyf(xs[ls[k]]), keyf(ys[k]))
+                        x = random.choice(xs)
+                        self.assertEqual(xs[ls[ls.index(x)]], x)
+                        self.assertEqual(ls.count(x), xs.count(x))
+                    self.assertEqual([keyf(xs[i]) for i in ls[1:-1]],
+                                     [keyf(y) for y in ys[1:-1]])
+                    self.assertEqual(sorted(ls), range(n))
+
+        ls = LazySorted(array.array('d', [2.5, 0.5, 1.5]),
+                        return_indices=True)
+        self.assertEqual(list(ls), [1, 2, 0])
+        self.assertEqual(ls.quantiles([0.5, 1.0]), [2, 0])
+        self.assertRaises(ValueError, ls.quantiles, [0.5], 'linear')
+        self.assertRaises(TypeError, ls.add, 1.0)
+        self.assertRaises(TypeError, ls.remove, 1.5)
+
+    def test_views(self):
+        """Views should read ranges of ranks until items come or go"""
+        for n in [0, 1, 10, 100, 1000]:
+            xs = [random.randrange(n // 2 + 1) for _ in xrange(n)]
+            ys = sorted(xs)
+            for data in [xs, array.array('d', xs)]:
+                ls = LazySorted(data)
+                i, j = sorted(random.randrange(n + 1) for _ in xrange(2))
+                view = ls.view[i:j]
+                self.assertEqual(len(view), j - i)
+                self.assertEqual(list(view), ys[i:j])
+                self.assertEqual(list(view[1:-1]), ys[i:j][1:-1])
+                self.assertEqual(view[::2], ys[i:j][::2])
+                if i < j:
+                    self.assertEqual(view[-1], ys[j - 1])
+                self.assertRaises(IndexError, view.__getitem__, j - i)
+
+                between = ls.between_view(i, j)
+                self.assertEqual(sorted(between), ys[i:j])
+                if n:
+                    ls[random.randrange(n)]
+                self.assertEqual(sorted(between), ys[i:j])
+
+                if sys.version_info >= (3,) and data is not xs and i < j:
+                    buf = memoryview(view)
+                    self.assertEqual(buf.tolist(), ys[i:j])
+                    self.assertRaises(BufferError, ls.add, 0)
+                    buf.release()
+
+                ls.add(0)
+                if i < j:
+                    self.assertRaises(RuntimeError, list, view)
+                    self.assertRaises(RuntimeError, list, between)
+
+        ls = LazySorted(range(10))
+        self.assertRaises(ValueError, ls.view.__getitem__, slice(0, 5, 2))
+        self.assertRaises(TypeError, ls.view.__getitem__, 3)
+
+    def test_pickle(self):
+        """Pickled LazySorteds should keep their order and their pivots"""
+        for n in [0, 1, 10, 100, 10000]:
+            xs = [random.randrange(n // 2 + 1) for _ in xrange(n)]
+            for kwds in [{}, {"reverse": True}, {"key": abs},
+                         {"return_indices": True}]:
+                for data in [xs, array.array('d', xs)]:
+                    ls = LazySorted(data, **kwds)
+                    if n:
+                        ls[random.randrange(n)]
+                    ls[n // 3:n // 2]
+                    for proto in xrange(pickle.HIGHEST_PROTOCOL + 1):
+                        copy = pickle.loads(pickle.dumps(ls, proto))
+                        self.assertEqual(copy._pivots(), ls._pivots())
+                        self.assertEqual(list(copy), list(ls))
+
+                    state = ls.__getstate__(pivots=False)
+                    copy = LazySorted([], **kwds)
+                    copy.__setstate__(state)
+                    self.assertEqual(len(copy._pivots()), 2)
+                    if "return_indices" in kwds:
+                        self.assertEqual([xs[i] for i in copy],
+                                         [xs[i] for i in ls])
+                    else:
+                        self.assertEqual(list(copy), list(ls))
+
+        ls = LazySorted([3, 1, 2])
+        items, values, keys, rng, gaps, flags = ls.__getstate__()
+        for bad in [(items, values, keys, rng, b"\x01\x05", b"\x00"),
+                    (items, values, keys, rng, b"\x01\x04", b"\x20"),
+                    (items, values, keys, rng, b"\x01\x04", b"\x04"),
+                    (items, values, keys, rng, b"\x01\x04", b"\x80"),
+                    (items, values, keys, rng, b"\x01\x02\x02", b"\x40\x00"),
+                    (items, [0], keys, rng, None, None),
+                    (items, [0, 0, 1], keys, rng, None, None),
+                    (items, values, keys, rng)]:
+            self.assertRaises((ValueError, TypeError), ls.__setstate__, bad)
+        self.assertEqual(list(ls), [1, 2, 3])
+
+    def test_threads(self):
+        """Threads sharing a big unboxed LazySorted should see it sorted"""
+        xs = [random.random() for _ in xrange(200000)]
+        ys = sorted(xs)
+        ls = LazySorted(xs)
+        errors = []
+
+        def query(seed):
+            rng = random.Random(seed)
+            try:
+                for _ in xrange(20):
+                    k = rng.randrange(len(xs))
+                    if ls[k] != ys[k] or ls[k:k + 1000] != ys[k:k + 1000]:
+                        errors.append(k)
+                    ks = [rng.randrange(len(xs)) for _ in xrange(10)]
+                    if ls.select_many(ks) != [ys[k] for k in ks]:
+                        errors.append(ks)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=query, args=(seed,))
+                   for seed in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(list(ls), ys)
+
+    def test_threads_with_readers(self):
+        """Readers should wait out threads partitioning without the GIL"""
+        xs = array.array('d', (random.random() for _ in xrange(300000)))
+        ys = sorted(xs)
+        ls = LazySorted(xs)
+        starts = [random.randrange(len(xs) - 1000) for _ in xrange(8)]
+        for k in starts:
+            ls[k:k + 1000]
+        errors = []
+
+        def read(seed):
+            rng = random.Random(seed)
+            try:
+                for _ in xrange(200):
+                    k = rng.choice(starts) + rng.randrange(900)
+                    if ls[k] != ys[k] or ls[k:k + 100] != ys[k:k + 100]:
+                        errors.append(k)
+            except Exception as e:
+                errors.append(e)
+
+        def partition(seed):
+            rng = random.Random(seed)
+            try:
+                for _ in xrange(20):
+                    ks = [rng.randrange(len(xs)) for _ in xrange(10)]
+                    if ls.select_many(ks) != [ys[k] for k in ks]:
+                        errors.append(ks)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=target, args=(seed,))
+                   for seed in xrange(3) for target in (read, partition)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(list(ls), ys)
+
+    def test_threads_with_writers(self):
+        """Threads should take turns changing a LazySorted mid-comparison"""
+        class Slow(object):
+            def __init__(self, x):
+                self.x = x
+
+            def __lt__(self, other):
+                # Lets other threads in while a comparison is running
+                if self.x % 97 == 0:
+                    time.sleep(0)
+                return self.x < other.x
+
+        xs = [Slow(random.randrange(10 ** 6)) for _ in xrange(20000)]
+        ls = LazySorted(xs)
+        errors = []
+
+        def work(seed):
+            rng = random.Random(seed)
+            try:
+                for _ in xrange(50):
+                    ls.add(Slow(rng.randrange(10 ** 6)))
+                    k = rng.randrange(len(ls))
+                    items = ls[k:k + 100]
+                    if any(b < a for a, b in zip(items, items[1:])):
+                        errors.append(k)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=work, args=(seed,))
+                   for seed in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(len(ls), 20200)
+        ys = [item.x for item in ls]
+        self.assertEqual(ys, sorted(ys))
+
     def test_API(self):
         """The sorted(...) API should be implemented except for cmp"""
         xs = range(10)